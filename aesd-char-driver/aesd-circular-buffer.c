@@ -17,14 +17,15 @@
 #endif
 
 #include "aesd-circular-buffer.h"
+#include "aesd-ring-buffer.h"
 
 #define LENGTH(entries)\
     sizeof(entries)/sizeof(entries[0])
 
 #define CB_POINTER_INC(pointer,entries)\
-    pointer = (pointer + 1)%(LENGTH(entries))
+    pointer = AESD_RING_WRAP(pointer + 1, LENGTH(entries))
 #define CB_POINTER_CAST(pointer,entries)\
-    pointer%(LENGTH(entries))
+    AESD_RING_WRAP(pointer, LENGTH(entries))
 #define CB_LOOP_UPPER_BOUNDARY(buffer,boundary_var)  \
 do {    \
     boundary_var = buffer->in_offs; \
@@ -0,0 +1,249 @@
+/*
+ * aesd-ring-buffer.h
+ *
+ *  Generic, type-parameterised ring buffers shared between the aesdchar
+ *  driver and the userspace programs (aesdsocket and friends).
+ *
+ *  Each ring is generated at compile time for an element type and a fixed
+ *  capacity, which must be a power of two: counters are free running size_t
+ *  values reduced with a mask, and a modulo of any other capacity would jump
+ *  when a counter wraps around.  The declarations refuse other capacities with
+ *  a static assertion.  AESD_RING_WRAP also serves indices kept below the
+ *  capacity by their user, such as the offsets of aesd_circular_buffer, which
+ *  may use any capacity.
+ *
+ *  Three flavours are provided:
+ *  - AESD_RING_DECLARE: plain ring, any necessary locking must be performed by caller
+ *  - AESD_SPSC_RING_DECLARE: lock-free ring for exactly one producer and one consumer
+ *  - AESD_MPSC_RING_DECLARE: lock-free ring for many producers and one consumer
+ */
+
+#ifndef AESD_RING_BUFFER_H
+#define AESD_RING_BUFFER_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/compiler.h>
+#include <linux/cache.h>
+#include <asm/barrier.h>
+#else
+#include <stddef.h> // size_t
+#include <stdbool.h>
+#endif
+
+#define AESD_RING_IS_POW2(n) ((n) != 0 && (((n) & ((n) - 1)) == 0))
+
+#define AESD_RING_ASSERT_POW2(name, capacity) \
+    _Static_assert(AESD_RING_IS_POW2(capacity), "capacity of " #name " must be a power of two");
+
+/**
+ * Reduce a free running counter @param idx to a slot index of a ring with @param cap entries
+ */
+#define AESD_RING_WRAP(idx, cap) \
+    (AESD_RING_IS_POW2(cap) ? ((idx) & ((cap) - 1)) : ((idx) % (cap)))
+
+#ifdef __KERNEL__
+#   define AESD_RING_LOAD_RELAXED(ptr)          READ_ONCE(*(ptr))
+#   define AESD_RING_LOAD_ACQUIRE(ptr)          smp_load_acquire(ptr)
+#   define AESD_RING_STORE_RELEASE(ptr, val)    smp_store_release(ptr, val)
+#   define AESD_RING_CACHELINE_ALIGNED          ____cacheline_aligned_in_smp
+#   define AESD_RING_CAS(ptr, expected, desired) (cmpxchg(ptr, expected, desired) == (expected))
+#else
+#   define AESD_RING_LOAD_RELAXED(ptr)          __atomic_load_n(ptr, __ATOMIC_RELAXED)
+#   define AESD_RING_LOAD_ACQUIRE(ptr)          __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#   define AESD_RING_STORE_RELEASE(ptr, val)    __atomic_store_n(ptr, val, __ATOMIC_RELEASE)
+#   define AESD_RING_CACHELINE_ALIGNED          __attribute__((aligned(64)))
+#   define AESD_RING_CAS(ptr, expected, desired) \
+        __atomic_compare_exchange_n(ptr, &(expected), desired, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)
+#endif
+
+/**
+ * Generates `struct name` holding up to @param capacity elements of @param type together with
+ * name_init, name_count, name_empty, name_full, name_at, name_push, name_push_overwrite,
+ * name_peek and name_pop.
+ * Counters are free running, the slot of a counter value is AESD_RING_WRAP(counter, capacity).
+ * Any necessary locking must be performed by caller.
+ *
+ * Example usage:
+ * AESD_RING_DECLARE(int_ring, int, 16)
+ * struct int_ring ring;
+ * int_ring_init(&ring);
+ * int_ring_push(&ring, &value);
+ */
+#define AESD_RING_DECLARE(name, type, capacity) \
+AESD_RING_ASSERT_POW2(name, capacity) \
+struct name { \
+    type entry[capacity]; \
+    size_t head; /* next slot to write */ \
+    size_t tail; /* next slot to read */ \
+}; \
+static inline void name##_init(struct name *ring) \
+{ \
+    ring->head = 0; \
+    ring->tail = 0; \
+} \
+static inline size_t name##_capacity(void) \
+{ \
+    return (capacity); \
+} \
+static inline size_t name##_count(const struct name *ring) \
+{ \
+    return ring->head - ring->tail; \
+} \
+static inline bool name##_empty(const struct name *ring) \
+{ \
+    return ring->head == ring->tail; \
+} \
+static inline bool name##_full(const struct name *ring) \
+{ \
+    return ring->head - ring->tail == (capacity); \
+} \
+/* n-th oldest element, NULL when n is out of range */ \
+static inline type *name##_at(struct name *ring, size_t n) \
+{ \
+    if (n >= name##_count(ring)) return NULL; \
+    return &ring->entry[AESD_RING_WRAP(ring->tail + n, (capacity))]; \
+} \
+/* returns false when the ring is full */ \
+static inline bool name##_push(struct name *ring, const type *value) \
+{ \
+    if (name##_full(ring)) return false; \
+    ring->entry[AESD_RING_WRAP(ring->head, (capacity))] = *value; \
+    ring->head++; \
+    return true; \
+} \
+/* overwrites the oldest element when full, returning true and copying it to evicted (if not NULL) */ \
+static inline bool name##_push_overwrite(struct name *ring, const type *value, type *evicted) \
+{ \
+    bool was_full = name##_full(ring); \
+    size_t slot = AESD_RING_WRAP(ring->head, (capacity)); \
+    if (was_full) { \
+        if (evicted) *evicted = ring->entry[slot]; \
+        ring->tail++; \
+    } \
+    ring->entry[slot] = *value; \
+    ring->head++; \
+    return was_full; \
+} \
+static inline type *name##_peek(struct name *ring) \
+{ \
+    return name##_at(ring, 0); \
+} \
+/* returns false when the ring is empty */ \
+static inline bool name##_pop(struct name *ring, type *value) \
+{ \
+    if (name##_empty(ring)) return false; \
+    if (value) *value = ring->entry[AESD_RING_WRAP(ring->tail, (capacity))]; \
+    ring->tail++; \
+    return true; \
+}
+
+/**
+ * Iterates over the elements of a ring declared with AESD_RING_DECLARE from the oldest to the newest.
+ * @param elemptr is a type* set to the current element
+ * @param ring is the struct name * describing the ring
+ * @param index is a size_t stack allocated value used by this macro for an index
+ */
+#define AESD_RING_FOREACH(name, elemptr, ring, index) \
+    for (index = 0; (elemptr = name##_at(ring, index)) != NULL; index++)
+
+/**
+ * Generates `struct name`, a lock-free ring for a single producer and a single consumer thread
+ * with name_init, name_count, name_push and name_pop.  The producer only writes head and the
+ * consumer only writes tail, publication is ordered with acquire/release.
+ */
+#define AESD_SPSC_RING_DECLARE(name, type, capacity) \
+AESD_RING_ASSERT_POW2(name, capacity) \
+struct name { \
+    size_t head AESD_RING_CACHELINE_ALIGNED; /* written by producer */ \
+    size_t tail AESD_RING_CACHELINE_ALIGNED; /* written by consumer */ \
+    type entry[capacity] AESD_RING_CACHELINE_ALIGNED; \
+}; \
+static inline void name##_init(struct name *ring) \
+{ \
+    ring->head = 0; \
+    ring->tail = 0; \
+} \
+static inline size_t name##_count(struct name *ring) \
+{ \
+    return AESD_RING_LOAD_ACQUIRE(&ring->head) - AESD_RING_LOAD_ACQUIRE(&ring->tail); \
+} \
+/* producer side, returns false when the ring is full */ \
+static inline bool name##_push(struct name *ring, const type *value) \
+{ \
+    size_t head = AESD_RING_LOAD_RELAXED(&ring->head); \
+    if (head - AESD_RING_LOAD_ACQUIRE(&ring->tail) == (capacity)) return false; \
+    ring->entry[AESD_RING_WRAP(head, (capacity))] = *value; \
+    AESD_RING_STORE_RELEASE(&ring->head, head + 1); \
+    return true; \
+} \
+/* consumer side, returns false when the ring is empty */ \
+static inline bool name##_pop(struct name *ring, type *value) \
+{ \
+    size_t tail = AESD_RING_LOAD_RELAXED(&ring->tail); \
+    if (AESD_RING_LOAD_ACQUIRE(&ring->head) == tail) return false; \
+    *value = ring->entry[AESD_RING_WRAP(tail, (capacity))]; \
+    AESD_RING_STORE_RELEASE(&ring->tail, tail + 1); \
+    return true; \
+}
+
+/**
+ * Generates `struct name`, a lock-free bounded ring for many producers and a single consumer
+ * with name_init, name_push and name_pop.  Every slot carries a sequence number telling
+ * whether it is free for the producer claiming ticket n (seq == n) or holds the value
+ * published for ticket n (seq == n + 1).  Producers claim tickets with a CAS on head and
+ * never wait on each other; a full ring makes name_push fail instead of blocking.
+ */
+#define AESD_MPSC_RING_DECLARE(name, type, capacity) \
+AESD_RING_ASSERT_POW2(name, capacity) \
+struct name##_slot { \
+    size_t seq; \
+    type value; \
+}; \
+struct name { \
+    size_t head AESD_RING_CACHELINE_ALIGNED; /* next ticket for producers */ \
+    size_t tail AESD_RING_CACHELINE_ALIGNED; /* written by consumer */ \
+    struct name##_slot slot[capacity] AESD_RING_CACHELINE_ALIGNED; \
+}; \
+static inline void name##_init(struct name *ring) \
+{ \
+    size_t i; \
+    ring->head = 0; \
+    ring->tail = 0; \
+    for (i = 0; i < (capacity); i++) ring->slot[i].seq = i; \
+} \
+/* producer side, safe from any number of threads, returns false when the ring is full */ \
+static inline bool name##_push(struct name *ring, const type *value) \
+{ \
+    struct name##_slot *slot; \
+    size_t head = AESD_RING_LOAD_RELAXED(&ring->head); \
+    for (;;) { \
+        long diff; \
+        slot = &ring->slot[head & ((capacity) - 1)]; \
+        diff = (long)AESD_RING_LOAD_ACQUIRE(&slot->seq) - (long)head; \
+        if (diff == 0) { \
+            if (AESD_RING_CAS(&ring->head, head, head + 1)) break; \
+            head = AESD_RING_LOAD_RELAXED(&ring->head); \
+        } else if (diff < 0) { \
+            return false; \
+        } else { \
+            head = AESD_RING_LOAD_RELAXED(&ring->head); \
+        } \
+    } \
+    slot->value = *value; \
+    AESD_RING_STORE_RELEASE(&slot->seq, head + 1); \
+    return true; \
+} \
+/* consumer side, returns false when the ring is empty or the oldest value is not published yet */ \
+static inline bool name##_pop(struct name *ring, type *value) \
+{ \
+    size_t tail = ring->tail; \
+    struct name##_slot *slot = &ring->slot[tail & ((capacity) - 1)]; \
+    if (AESD_RING_LOAD_ACQUIRE(&slot->seq) != tail + 1) return false; \
+    *value = slot->value; \
+    AESD_RING_STORE_RELEASE(&slot->seq, tail + (capacity)); \
+    ring->tail = tail + 1; \
+    return true; \
+}
+
+#endif /* AESD_RING_BUFFER_H */
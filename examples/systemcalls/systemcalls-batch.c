@@ -0,0 +1,140 @@
+#include "systemcalls-batch.h"
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#define BATCH_WAIT_MAX 64
+
+static unsigned int default_concurrency()
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? (unsigned int) cores : 1;
+}
+
+static void report(const struct exec_batch_options *options, size_t index, struct exec_handle *handle)
+{
+    struct exec_batch_result result = {
+        .index = index,
+        .started = handle != NULL,
+        .success = handle && handle->success,
+        .status = handle ? handle->status : -1,
+    };
+    if (options->on_done) {
+        options->on_done(&result, options->arg);
+    }
+}
+
+// reports and frees a collected command, returns true if it failed
+static bool finish(const struct exec_batch_options *options, struct exec_handle *handle, size_t *failed)
+{
+    bool success = handle->success;
+
+    report(options, (size_t) handle->data, handle);
+    exec_handle_free(handle);
+    if (!success) {
+        (*failed)++;
+    }
+
+    return !success;
+}
+
+// the pidfd keeps addressing our child even if it exited in the meantime
+static void terminate(struct exec_handle *handle, int signal)
+{
+    syscall(SYS_pidfd_send_signal, handle->pidfd, signal, NULL, 0);
+}
+
+size_t do_exec_batch(char **commands[], size_t count, const struct exec_batch_options *options)
+{
+    struct exec_batch_options defaults = { 0 };
+    struct exec_handle *done[BATCH_WAIT_MAX];
+    struct exec_handle **running;
+    struct exec_waitset *set;
+    size_t next = 0, failed = 0;
+    bool stopping = false, terminated = false;
+
+    if (!options) {
+        options = &defaults;
+    }
+    unsigned int concurrency = options->concurrency ? options->concurrency : default_concurrency();
+    if (concurrency > count) {
+        concurrency = count;
+    }
+    // slot i of running holds the command started in it, handle->data its index in the batch
+    running = calloc(concurrency ? concurrency : 1, sizeof(*running));
+    set = exec_waitset_create();
+    if (!running || !set) {
+        free(running);
+        exec_waitset_destroy(set);
+        return count;
+    }
+
+    for (;;) {
+        // fill the free slots
+        for (unsigned int slot = 0; slot < concurrency; slot++) {
+            while (!running[slot] && next < count && !stopping) {
+                size_t index = next++;
+                struct exec_handle *handle = do_execv_async(commands[index], NULL);
+                if (!handle) {
+                    report(options, index, NULL);
+                    failed++;
+                    stopping = options->fail_fast;
+                    continue;
+                }
+                handle->data = (void *) index;
+                if (!exec_waitset_add(set, handle)) {
+                    // nothing would notice it exit, kill it rather than stall the other slots
+                    terminate(handle, SIGKILL);
+                    exec_handle_wait(handle);
+                    stopping = finish(options, handle, &failed) && options->fail_fast;
+                    continue;
+                }
+                running[slot] = handle;
+            }
+        }
+        if (stopping && !terminated) {
+            for (unsigned int slot = 0; slot < concurrency; slot++) {
+                if (running[slot]) {
+                    terminate(running[slot], SIGTERM);
+                }
+            }
+            terminated = true;
+        }
+        if (exec_waitset_count(set) == 0) {
+            break;
+        }
+
+        int n = exec_waitset_wait(set, done, BATCH_WAIT_MAX, -1);
+        if (n < 0) {
+            // the epoll set is unusable, collect what is running one by one
+            for (unsigned int slot = 0; slot < concurrency; slot++) {
+                if (running[slot]) {
+                    exec_handle_wait(running[slot]);
+                    finish(options, running[slot], &failed);
+                }
+            }
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            for (unsigned int slot = 0; slot < concurrency; slot++) {
+                if (running[slot] == done[i]) {
+                    running[slot] = NULL;
+                }
+            }
+            if (finish(options, done[i], &failed) && options->fail_fast) {
+                stopping = true;
+            }
+        }
+    }
+
+    // commands never started because of fail-fast
+    while (next < count) {
+        report(options, next++, NULL);
+        failed++;
+    }
+    free(running);
+    exec_waitset_destroy(set);
+
+    return failed;
+}
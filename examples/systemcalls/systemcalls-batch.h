@@ -0,0 +1,34 @@
+#ifndef SYSTEMCALLS_BATCH_H
+#define SYSTEMCALLS_BATCH_H
+
+#include "systemcalls.h"
+
+/**
+ * Outcome of one command of a batch, passed to the callback as soon as it is known.
+ */
+struct exec_batch_result {
+    size_t index;       // position of the command in the batch
+    bool started;       // false when it could not start or was skipped after a failure
+    bool success;       // exited with status 0
+    int status;         // exit status, or the number of the signal that killed it
+};
+
+typedef void (*exec_batch_callback)(const struct exec_batch_result *result, void *arg);
+
+struct exec_batch_options {
+    unsigned int concurrency;   // commands running at once, 0 for the number of online cores
+    bool fail_fast;             // on the first failure, stop starting commands and terminate running ones
+    exec_batch_callback on_done;    // may be NULL
+    void *arg;                  // passed to on_done
+};
+
+/**
+ * Runs @param count commands, each a NULL terminated argv vector with the full path of
+ * the command first, at most options->concurrency at a time. Results are reported in
+ * completion order, every command gets exactly one on_done call.
+ * @param options may be NULL for the defaults.
+ * @return the number of commands which did not succeed, 0 when all of them did.
+ */
+size_t do_exec_batch(char **commands[], size_t count, const struct exec_batch_options *options);
+
+#endif
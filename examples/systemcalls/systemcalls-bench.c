@@ -0,0 +1,134 @@
+#include "systemcalls.h"
+#include "systemcalls-batch.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Measures the latency of do_exec("/bin/true") with both backends while the process
+ * holds a given amount of touched memory, then the wall time of a batch of short
+ * sleeps run through do_exec_batch() at several concurrency limits.
+ * Usage: systemcalls-bench [runs] [resident MiB ...]
+ */
+#define DEFAULT_RUNS 200
+#define COMMAND "/bin/true"
+
+#define BATCH_COMMAND "/bin/sleep"
+#define BATCH_SLEEP "0.01"
+
+static const size_t default_sizes[] = { 0, 64, 256, 1024 };
+// 0 is the number of online cores
+static const unsigned int batch_concurrency[] = { 1, 4, 16, 0 };
+
+static const char *backend_names[] = {
+    [EXEC_BACKEND_SPAWN] = "posix_spawn",
+    [EXEC_BACKEND_FORK] = "fork",
+};
+
+static double now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static int run(enum exec_backend backend, int runs, size_t rss_mib)
+{
+    double *latency = malloc(runs * sizeof(*latency));
+    double total = 0;
+
+    if (!latency) {
+        return -1;
+    }
+    set_exec_backend(backend);
+    for (int i = 0; i < runs; i++) {
+        double start = now_us();
+        if (!do_exec(1, COMMAND)) {
+            fprintf(stderr, "%s failed\n", COMMAND);
+            free(latency);
+            return -1;
+        }
+        latency[i] = now_us() - start;
+        total += latency[i];
+    }
+    qsort(latency, runs, sizeof(*latency), compare_double);
+    printf("%8zu %12s %10.1f %10.1f %10.1f\n", rss_mib, backend_names[backend],
+           total / runs, latency[runs / 2], latency[runs * 99 / 100]);
+    free(latency);
+
+    return 0;
+}
+
+static int run_batch(int runs, unsigned int concurrency)
+{
+    char *command[] = { BATCH_COMMAND, BATCH_SLEEP, NULL };
+    char ***commands = malloc(runs * sizeof(*commands));
+    struct exec_batch_options options = { .concurrency = concurrency };
+
+    if (!commands) {
+        return -1;
+    }
+    for (int i = 0; i < runs; i++) {
+        commands[i] = command;
+    }
+    set_exec_backend(EXEC_BACKEND_SPAWN);
+    double start = now_us();
+    size_t failed = do_exec_batch(commands, runs, &options);
+    double wall = now_us() - start;
+    free(commands);
+    if (failed > 0) {
+        fprintf(stderr, "%zu of %d commands failed\n", failed, runs);
+        return -1;
+    }
+    if (concurrency) {
+        printf("%11u %10.1f\n", concurrency, wall / 1e3);
+    } else {
+        printf("%11s %10.1f\n", "cores", wall / 1e3);
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int runs = argc > 1 ? atoi(argv[1]) : DEFAULT_RUNS;
+    size_t count = argc > 2 ? (size_t) argc - 2 : sizeof(default_sizes) / sizeof(default_sizes[0]);
+
+    if (runs <= 0) {
+        fprintf(stderr, "Usage: %s [runs] [resident MiB ...]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    printf("%8s %12s %10s %10s %10s\n", "rss_mib", "backend", "mean_us", "p50_us", "p99_us");
+    for (size_t i = 0; i < count; i++) {
+        size_t rss_mib = argc > 2 ? strtoul(argv[i + 2], NULL, 10) : default_sizes[i];
+        char *ballast = NULL;
+        if (rss_mib > 0) {
+            // touched so the pages are mapped and fork() has to copy their page tables
+            ballast = malloc(rss_mib << 20);
+            if (!ballast) {
+                fprintf(stderr, "Failure to allocate %zu MiB\n", rss_mib);
+                return EXIT_FAILURE;
+            }
+            memset(ballast, 1, rss_mib << 20);
+        }
+        if (run(EXEC_BACKEND_SPAWN, runs, rss_mib) != 0 || run(EXEC_BACKEND_FORK, runs, rss_mib) != 0) {
+            return EXIT_FAILURE;
+        }
+        free(ballast);
+    }
+
+    printf("\n%d x %s %s\n%11s %10s\n", runs, BATCH_COMMAND, BATCH_SLEEP, "concurrency", "wall_ms");
+    for (size_t i = 0; i < sizeof(batch_concurrency) / sizeof(batch_concurrency[0]); i++) {
+        if (run_batch(runs, batch_concurrency[i]) != 0) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
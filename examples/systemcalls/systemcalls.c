@@ -1,9 +1,93 @@
+#define _GNU_SOURCE
 #include "systemcalls.h"
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
 #include <sys/wait.h>
 #include <sys/types.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+
+#define WAITSET_BATCH 64
+#define CAPTURE_CHUNK (64*1024)
+#define CAPTURE_INITIAL_SIZE 4096
+
+struct exec_waitset {
+    int epoll_fd;
+    int count;
+};
+
+extern char **environ;
+
+static enum exec_backend exec_backend = EXEC_BACKEND_SPAWN;
+
+void set_exec_backend(enum exec_backend backend)
+{
+    exec_backend = backend;
+}
+
+/**
+ * Starts @param command, command[0] being the full path of the executable, with standard
+ * out redirected to @param out_fd and standard error to @param err_fd unless they are -1.
+ * @return the pid of the child, or -1 with errno set if it could not be started.
+ */
+static pid_t start_command(char *command[], int out_fd, int err_fd)
+{
+    pid_t pid;
+
+    fflush(stdout);
+
+    if (exec_backend == EXEC_BACKEND_SPAWN) {
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        if (out_fd >= 0) {
+            posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+        }
+        if (err_fd >= 0) {
+            posix_spawn_file_actions_adddup2(&actions, err_fd, STDERR_FILENO);
+        }
+        // glibc starts the child with clone(CLONE_VM|CLONE_VFORK), the parent's page
+        // tables are not copied, and reports exec failures as the return value
+        int rc = posix_spawn(&pid, command[0], &actions, NULL, command, environ);
+        posix_spawn_file_actions_destroy(&actions);
+        if (rc != 0) {
+            errno = rc;
+            return -1;
+        }
+
+        return pid;
+    }
+
+    pid = fork();
+    if (pid == 0) {
+        if ((out_fd < 0 || dup2(out_fd, STDOUT_FILENO) >= 0) &&
+            (err_fd < 0 || dup2(err_fd, STDERR_FILENO) >= 0)) {
+            execv(command[0], command);
+        }
+        // not exit(), it would flush stdio buffers copied from the parent a second time
+        _exit(EXIT_FAILURE);
+    }
+
+    return pid;
+}
+
+/**
+ * Waits for the child @param pid only, other children of the caller are left alone.
+ * @return true if it exited with status 0.
+ */
+static bool wait_command(pid_t pid)
+{
+    pid_t rc;
+    int w;
+
+    while ((rc = waitpid(pid, &w, 0)) == -1 && errno == EINTR);
+
+    return rc == pid && WIFEXITED(w) && WEXITSTATUS(w) == 0;
+}
 
 /**
  * @param cmd the command to execute with system()
@@ -66,26 +150,8 @@ bool do_exec(int count, ...)
     bool result = true;
 
     if (count > 0) {
-        pid_t pid;
-        int w, wstatus;
-
-        fflush(stdout);
-
-        pid = fork();
-        switch (pid) {
-            case -1:
-                result = false;
-            case 0:
-                execv(command[0], command);
-                exit(EXIT_FAILURE);
-            default:                
-                wstatus = wait(&w);
-                if (wstatus == -1) {
-                    result = false;
-                } else {
-                    result = WIFEXITED(w) && WEXITSTATUS(w) == 0;
-                }
-        }
+        pid_t pid = start_command(command, -1, -1);
+        result = pid != -1 && wait_command(pid);
     }
 
     va_end(args);
@@ -118,40 +184,352 @@ bool do_exec_redirect(const char *outputfile, int count, ...)
  *
 */
     bool result = true;
-    int fd = open(outputfile, O_WRONLY|O_TRUNC|O_CREAT, 0644);
+    // O_CLOEXEC: only the stdout copy made in the child survives the exec
+    int fd = open(outputfile, O_WRONLY|O_TRUNC|O_CREAT|O_CLOEXEC, 0644);
     if (fd < 0) {
         result = false;
     } else if (count > 0) {
-        pid_t pid;
-        int w, wstatus;
-
-        fflush(stdout);
-
-        pid = fork();
-        switch (pid) {
-            case -1:
-                close(fd);
-                result = false;
-            case 0:
-                if (dup2(fd, 1) < 0) {
-                    exit(EXIT_FAILURE);
-                } else {
-                    close(fd);
-                    execv(command[0], command);
-                    exit(EXIT_FAILURE);
-                }
-            default:
-                close(fd);                
-                wstatus = wait(&w);
-                if (wstatus == -1) {
-                    result = false;
-                } else {
-                    result = WIFEXITED(w) && WEXITSTATUS(w) == 0;
-                }
-        }        
+        pid_t pid = start_command(command, fd, -1);
+        close(fd);
+        result = pid != -1 && wait_command(pid);
+    } else {
+        close(fd);
     }
 
     va_end(args);
 
     return result;
 }
+
+static bool write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t rc = write(fd, buf, len);
+        if (rc < 0 && errno != EINTR) {
+            return false;
+        }
+        if (rc > 0) {
+            buf += rc;
+            len -= rc;
+        }
+    }
+
+    return true;
+}
+
+// makes room for @param n more bytes and the NUL terminator, up to the limit
+static size_t capture_reserve(struct exec_capture *capture, size_t n)
+{
+    size_t limit = capture->limit ? capture->limit : EXEC_CAPTURE_LIMIT;
+
+    if (n > limit - capture->len) {
+        n = limit - capture->len;
+    }
+    if (n > 0 && capture->len + n + 1 > capture->size) {
+        size_t size = capture->size ? capture->size : CAPTURE_INITIAL_SIZE;
+        while (size < capture->len + n + 1) {
+            size *= 2;
+        }
+        if (size > limit + 1) {
+            size = limit + 1;
+        }
+        char *data = realloc(capture->data, size);
+        if (!data) {
+            return 0;
+        }
+        capture->data = data;
+        capture->size = size;
+    }
+
+    return n;
+}
+
+/**
+ * Moves what the pipe @param pipe_fd holds to @param capture.
+ * @return the bytes taken from the pipe, 0 once the command closed it, -1 on error.
+ */
+static ssize_t capture_drain(struct exec_capture *capture, int pipe_fd)
+{
+    size_t limit = capture->limit ? capture->limit : EXEC_CAPTURE_LIMIT;
+    char discard[4096];
+    ssize_t rc;
+
+    if (capture->len >= limit) {
+        if ((rc = read(pipe_fd, discard, sizeof(discard))) > 0) {
+            capture->truncated = true;
+        }
+        return rc;
+    }
+    if (capture->fd >= 0) {
+        size_t want = limit - capture->len < CAPTURE_CHUNK ? limit - capture->len : CAPTURE_CHUNK;
+        rc = splice(pipe_fd, NULL, capture->fd, NULL, want, SPLICE_F_MOVE);
+        if (rc < 0 && errno == EINVAL) {
+            // the sink does not take spliced pages, copy through user space
+            rc = read(pipe_fd, discard, sizeof(discard) < want ? sizeof(discard) : want);
+            if (rc > 0 && !write_all(capture->fd, discard, rc)) {
+                rc = -1;
+            }
+        }
+    } else {
+        // pipe to memory is one copy whatever the call, vmsplice() only saves it the other way
+        size_t room = capture_reserve(capture, CAPTURE_CHUNK);
+        if (room == 0) {
+            return -1;
+        }
+        if ((rc = read(pipe_fd, capture->data + capture->len, room)) >= 0) {
+            capture->data[capture->len + rc] = '\0';
+        }
+    }
+    if (rc > 0) {
+        capture->len += rc;
+    }
+
+    return rc;
+}
+
+bool do_execv_capture(char *command[], struct exec_capture *out, struct exec_capture *err)
+{
+    struct exec_capture *captures[2] = { out, err == out ? NULL : err };
+    struct pollfd fds[2];
+    int pipes[2][2] = { { -1, -1 }, { -1, -1 } };
+    bool result = true;
+    int open_fds = 0;
+
+    for (int i = 0; i < 2; i++) {
+        if (captures[i] && pipe2(pipes[i], O_CLOEXEC) != 0) {
+            result = false;
+        }
+    }
+    pid_t pid = -1;
+    if (result) {
+        pid = start_command(command, pipes[0][1], err == out && err ? pipes[0][1] : pipes[1][1]);
+    }
+    for (int i = 0; i < 2; i++) {
+        if (pipes[i][1] >= 0) {
+            close(pipes[i][1]);
+        }
+        fds[i].fd = pipes[i][0];
+        fds[i].events = POLLIN;
+        open_fds += pipes[i][0] >= 0;
+    }
+    if (pid == -1) {
+        result = false;
+    }
+
+    // until the command and everything it started closed both pipes
+    while (pid != -1 && open_fds > 0) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            result = false;
+            break;
+        }
+        for (int i = 0; i < 2; i++) {
+            if (fds[i].fd < 0 || !(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+            ssize_t rc = capture_drain(captures[i], fds[i].fd);
+            if (rc < 0 && errno == EINTR) {
+                continue;
+            }
+            if (rc <= 0) {
+                // on error the pipe is closed and the command gets SIGPIPE rather than blocking
+                result = result && rc == 0;
+                close(fds[i].fd);
+                fds[i].fd = -1;
+                open_fds--;
+            }
+        }
+    }
+    for (int i = 0; i < 2; i++) {
+        if (fds[i].fd >= 0) {
+            close(fds[i].fd);
+        }
+    }
+
+    return pid != -1 && wait_command(pid) && result;
+}
+
+bool do_exec_capture(struct exec_capture *out, struct exec_capture *err, int count, ...)
+{
+    va_list args;
+    va_start(args, count);
+    char * command[count+1];
+    int i;
+    for(i=0; i<count; i++)
+    {
+        command[i] = va_arg(args, char *);
+    }
+    command[count] = NULL;
+    va_end(args);
+
+    return count > 0 && do_execv_capture(command, out, err);
+}
+
+struct exec_handle *do_execv_async(char *command[], const char *outputfile)
+{
+    struct exec_handle *handle = calloc(1, sizeof(*handle));
+    int fd = -1;
+
+    if (!handle) {
+        return NULL;
+    }
+    if (outputfile && (fd = open(outputfile, O_WRONLY|O_TRUNC|O_CREAT|O_CLOEXEC, 0644)) < 0) {
+        free(handle);
+        return NULL;
+    }
+    handle->pid = start_command(command, fd, -1);
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (handle->pid == -1) {
+        free(handle);
+        return NULL;
+    }
+    // the child is not reaped before we wait for it, the pid cannot have been reused
+    handle->pidfd = syscall(SYS_pidfd_open, handle->pid, 0);
+    if (handle->pidfd < 0) {
+        // without a pidfd nothing could wait for it, do not block the caller until it exits
+        int saved_errno = errno;
+        kill(handle->pid, SIGKILL);
+        wait_command(handle->pid);
+        free(handle);
+        errno = saved_errno;
+        return NULL;
+    }
+    fcntl(handle->pidfd, F_SETFD, FD_CLOEXEC);
+
+    return handle;
+}
+
+struct exec_handle *do_exec_async(int count, ...)
+{
+    va_list args;
+    va_start(args, count);
+    char * command[count+1];
+    int i;
+    for(i=0; i<count; i++)
+    {
+        command[i] = va_arg(args, char *);
+    }
+    command[count] = NULL;
+    va_end(args);
+
+    return count > 0 ? do_execv_async(command, NULL) : NULL;
+}
+
+struct exec_handle *do_exec_redirect_async(const char *outputfile, int count, ...)
+{
+    va_list args;
+    va_start(args, count);
+    char * command[count+1];
+    int i;
+    for(i=0; i<count; i++)
+    {
+        command[i] = va_arg(args, char *);
+    }
+    command[count] = NULL;
+    va_end(args);
+
+    return count > 0 ? do_execv_async(command, outputfile) : NULL;
+}
+
+// collects the exit status, blocks unless the pidfd is readable
+static bool collect(struct exec_handle *handle)
+{
+    siginfo_t info;
+
+    if (handle->done) {
+        return handle->success;
+    }
+    while (waitid(P_PIDFD, handle->pidfd, &info, WEXITED) == -1) {
+        if (errno != EINTR) {
+            return false;
+        }
+    }
+    handle->done = true;
+    handle->status = info.si_status;
+    handle->success = info.si_code == CLD_EXITED && info.si_status == 0;
+    close(handle->pidfd);
+    handle->pidfd = -1;
+
+    return handle->success;
+}
+
+bool exec_handle_wait(struct exec_handle *handle)
+{
+    return collect(handle);
+}
+
+void exec_handle_free(struct exec_handle *handle)
+{
+    if (handle) {
+        collect(handle);
+        free(handle);
+    }
+}
+
+struct exec_waitset *exec_waitset_create()
+{
+    struct exec_waitset *set = calloc(1, sizeof(*set));
+
+    if (set && (set->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        free(set);
+        return NULL;
+    }
+
+    return set;
+}
+
+bool exec_waitset_add(struct exec_waitset *set, struct exec_handle *handle)
+{
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = handle };
+
+    if (handle->done || epoll_ctl(set->epoll_fd, EPOLL_CTL_ADD, handle->pidfd, &ev) != 0) {
+        return false;
+    }
+    set->count++;
+
+    return true;
+}
+
+int exec_waitset_wait(struct exec_waitset *set, struct exec_handle **done, int max, int timeout_ms)
+{
+    struct epoll_event events[WAITSET_BATCH];
+
+    if (max > WAITSET_BATCH) {
+        max = WAITSET_BATCH;
+    }
+    int n = epoll_wait(set->epoll_fd, events, max, timeout_ms);
+    if (n < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+    for (int i = 0; i < n; i++) {
+        struct exec_handle *handle = events[i].data.ptr;
+        epoll_ctl(set->epoll_fd, EPOLL_CTL_DEL, handle->pidfd, NULL);
+        set->count--;
+        collect(handle);
+        done[i] = handle;
+    }
+
+    return n;
+}
+
+int exec_waitset_count(struct exec_waitset *set)
+{
+    return set->count;
+}
+
+int exec_waitset_fd(struct exec_waitset *set)
+{
+    return set->epoll_fd;
+}
+
+void exec_waitset_destroy(struct exec_waitset *set)
+{
+    if (set) {
+        close(set->epoll_fd);
+        free(set);
+    }
+}
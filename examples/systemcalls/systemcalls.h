@@ -1,9 +1,122 @@
+#ifndef SYSTEMCALLS_H
+#define SYSTEMCALLS_H
+
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <sys/types.h>
+
+/**
+ * How do_exec() and do_exec_redirect() start the command:
+ * EXEC_BACKEND_SPAWN - posix_spawn(), the child shares the parent's memory until it execs,
+ *   so the cost does not grow with the size of the caller (default)
+ * EXEC_BACKEND_FORK - fork() and execv(), copies the page tables of the caller
+ */
+enum exec_backend {
+    EXEC_BACKEND_SPAWN,
+    EXEC_BACKEND_FORK,
+};
+
+void set_exec_backend(enum exec_backend backend);
 
 bool do_system(const char *command);
 
 bool do_exec(int count, ...);
 
 bool do_exec_redirect(const char *outputfile, int count, ...);
+
+// default bound on the bytes captured from one stream
+#define EXEC_CAPTURE_LIMIT (16*1024*1024)
+
+/**
+ * Destination of a standard stream of the command, connected to it through a pipe.
+ * When fd is -1 the output is collected in data, grown on demand and kept NUL terminated,
+ * the caller frees it. Otherwise it is moved to fd with splice(), without passing through
+ * user space when fd allows it (a file not opened O_APPEND, a pipe or a socket).
+ * Output past limit is read and discarded so the command never blocks on a full pipe,
+ * and truncated is set.
+ */
+struct exec_capture {
+    int fd;
+    char *data;
+    size_t len;
+    size_t size;        // allocated bytes of data
+    size_t limit;       // 0 for EXEC_CAPTURE_LIMIT
+    bool truncated;
+};
+
+// initializers for a capture into memory and into @param sink_fd
+#define EXEC_CAPTURE_BUFFER { .fd = -1 }
+#define EXEC_CAPTURE_FD(sink_fd) { .fd = (sink_fd) }
+
+/**
+ * As do_exec(), with standard out captured into @param out and standard error into
+ * @param err. Either may be NULL to leave the stream to the caller's, both may point to
+ * the same capture to merge them in order.
+ * @return true if the command exited with status 0 and its output could be captured.
+ */
+bool do_execv_capture(char *command[], struct exec_capture *out, struct exec_capture *err);
+bool do_exec_capture(struct exec_capture *out, struct exec_capture *err, int count, ...);
+
+/**
+ * A command started without waiting for it. The pidfd refers to exactly this child: it
+ * becomes readable when the child exits and its status is collected with waitid(P_PIDFD),
+ * which never reaps another child of the caller, so no SIGCHLD handler is involved.
+ */
+struct exec_handle {
+    pid_t pid;
+    int pidfd;
+    bool done;          // status collected
+    bool success;       // exited with status 0, valid once done
+    int status;         // exit status, or the number of the signal that killed it
+    void *data;         // left to the caller
+};
+
+/**
+ * Starts @param command (NULL terminated, command[0] being the full path) with standard
+ * out redirected to @param outputfile unless it is NULL.
+ * @return a handle to collect the command with exec_handle_wait() or a waitset, NULL with
+ *   errno set if it could not be started or no pidfd could be opened for it, in which
+ *   case the child is killed and reaped before returning.
+ */
+struct exec_handle *do_execv_async(char *command[], const char *outputfile);
+/**
+ * Asynchronous do_exec() and do_exec_redirect(), see do_execv_async().
+ */
+struct exec_handle *do_exec_async(int count, ...);
+struct exec_handle *do_exec_redirect_async(const char *outputfile, int count, ...);
+/**
+ * Blocks until the command exited, unless it is done already.
+ * @return true if it exited with status 0.
+ */
+bool exec_handle_wait(struct exec_handle *handle);
+/**
+ * Frees @param handle, waiting for the command first if it is still running.
+ */
+void exec_handle_free(struct exec_handle *handle);
+
+/**
+ * Set of running commands waited on together through one epoll instance, so a single
+ * thread can supervise any number of them.
+ */
+struct exec_waitset;
+
+struct exec_waitset *exec_waitset_create();
+bool exec_waitset_add(struct exec_waitset *set, struct exec_handle *handle);
+/**
+ * Waits up to @param timeout_ms (-1 forever) for commands of the set to exit, collects
+ * them and removes them from the set.
+ * @return the number of handles stored in @param done (at most @param max), 0 on timeout
+ *   or when interrupted by a signal, -1 on error.
+ */
+int exec_waitset_wait(struct exec_waitset *set, struct exec_handle **done, int max, int timeout_ms);
+// number of commands in the set
+int exec_waitset_count(struct exec_waitset *set);
+// the epoll descriptor, readable while a command of the set has exited, for the caller's own loop
+int exec_waitset_fd(struct exec_waitset *set);
+/**
+ * Frees the set, handles still in it are left running and owned by the caller.
+ */
+void exec_waitset_destroy(struct exec_waitset *set);
+
+#endif
@@ -0,0 +1,407 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+/*
+ * Lock contention benchmark following the pattern of threadfunc(): every thread waits
+ * (think time), obtains the lock, holds it (hold time) and releases it, in a loop for the
+ * duration of the run. Think and hold times are busy waits so they can be microseconds.
+ * For every lock it reports the acquisitions per second, Jain's fairness index over the
+ * acquisitions of the threads (1 when they all got the same share, 1/N when one thread
+ * got them all) and percentiles of the time taken to obtain the lock.
+ *
+ * Usage: lock-bench [-t threads] [-d duration_ms] [-o hold_us] [-w think_us] [-l lock,...]
+ */
+#define DEFAULT_THREADS 4
+#define DEFAULT_DURATION_MS 1000
+#define DEFAULT_HOLD_US 1
+#define DEFAULT_THINK_US 1
+
+#define ERROR_LOG(msg,...) printf("[ERROR] lock-bench: " msg "\n" , ##__VA_ARGS__)
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__("yield")
+#else
+#define cpu_relax() do { } while (0)
+#endif
+
+/*
+ * Latency histogram with 64 linear sub-buckets per power of two, values below 128ns are
+ * exact and larger ones within 1.6%.
+ */
+#define HIST_SUB_BITS 6
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+static unsigned int hist_index(uint64_t ns)
+{
+    if (ns < 2 * HIST_SUB) {
+        return ns;
+    }
+    unsigned int shift = 63 - __builtin_clzll(ns) - HIST_SUB_BITS;
+    return shift * HIST_SUB + (ns >> shift);
+}
+
+// lowest value of bucket @param index
+static uint64_t hist_value(unsigned int index)
+{
+    if (index < 2 * HIST_SUB) {
+        return index;
+    }
+    unsigned int shift = index / HIST_SUB - 1;
+    return (uint64_t) (index - shift * HIST_SUB) << shift;
+}
+
+union bench_lock {
+    pthread_mutex_t mutex;
+    pthread_spinlock_t spin;
+    struct {
+        unsigned int next;
+        unsigned int serving;
+    } ticket;
+    // 0 unlocked, 1 locked, 2 locked with waiters
+    int futex;
+};
+
+struct lock_ops {
+    const char *name;
+    int (*init)(union bench_lock *lock);
+    void (*lock)(union bench_lock *lock);
+    void (*unlock)(union bench_lock *lock);
+    void (*destroy)(union bench_lock *lock);
+};
+
+static int mutex_init(union bench_lock *lock)
+{
+    return pthread_mutex_init(&lock->mutex, NULL);
+}
+
+static int adaptive_init(union bench_lock *lock)
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    // spins a while before sleeping in the kernel
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ADAPTIVE_NP);
+    int rc = pthread_mutex_init(&lock->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    return rc;
+}
+
+static void mutex_lock(union bench_lock *lock)
+{
+    pthread_mutex_lock(&lock->mutex);
+}
+
+static void mutex_unlock(union bench_lock *lock)
+{
+    pthread_mutex_unlock(&lock->mutex);
+}
+
+static void mutex_destroy(union bench_lock *lock)
+{
+    pthread_mutex_destroy(&lock->mutex);
+}
+
+static int spin_init(union bench_lock *lock)
+{
+    return pthread_spin_init(&lock->spin, PTHREAD_PROCESS_PRIVATE);
+}
+
+static void spin_lock(union bench_lock *lock)
+{
+    pthread_spin_lock(&lock->spin);
+}
+
+static void spin_unlock(union bench_lock *lock)
+{
+    pthread_spin_unlock(&lock->spin);
+}
+
+static void spin_destroy(union bench_lock *lock)
+{
+    pthread_spin_destroy(&lock->spin);
+}
+
+static int ticket_init(union bench_lock *lock)
+{
+    lock->ticket.next = 0;
+    lock->ticket.serving = 0;
+    return 0;
+}
+
+// FIFO: threads are served in the order they took a ticket
+static void ticket_lock(union bench_lock *lock)
+{
+    unsigned int ticket = __atomic_fetch_add(&lock->ticket.next, 1, __ATOMIC_RELAXED);
+    while (__atomic_load_n(&lock->ticket.serving, __ATOMIC_ACQUIRE) != ticket) {
+        cpu_relax();
+    }
+}
+
+static void ticket_unlock(union bench_lock *lock)
+{
+    // only the holder writes serving
+    __atomic_store_n(&lock->ticket.serving, lock->ticket.serving + 1, __ATOMIC_RELEASE);
+}
+
+static void no_destroy(union bench_lock *lock)
+{
+}
+
+static int futex_init(union bench_lock *lock)
+{
+    lock->futex = 0;
+    return 0;
+}
+
+static int cmpxchg(int *value, int expected, int desired)
+{
+    __atomic_compare_exchange_n(value, &expected, desired, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+    return expected;
+}
+
+// the three state mutex of Drepper's "Futexes Are Tricky"
+static void futex_lock(union bench_lock *lock)
+{
+    int c = cmpxchg(&lock->futex, 0, 1);
+    if (c == 0) {
+        return;
+    }
+    if (c != 2) {
+        c = __atomic_exchange_n(&lock->futex, 2, __ATOMIC_ACQUIRE);
+    }
+    while (c != 0) {
+        syscall(SYS_futex, &lock->futex, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+        c = __atomic_exchange_n(&lock->futex, 2, __ATOMIC_ACQUIRE);
+    }
+}
+
+static void futex_unlock(union bench_lock *lock)
+{
+    if (__atomic_fetch_sub(&lock->futex, 1, __ATOMIC_RELEASE) != 1) {
+        __atomic_store_n(&lock->futex, 0, __ATOMIC_RELEASE);
+        syscall(SYS_futex, &lock->futex, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+static const struct lock_ops locks[] = {
+    { "pthread", mutex_init, mutex_lock, mutex_unlock, mutex_destroy },
+    { "adaptive", adaptive_init, mutex_lock, mutex_unlock, mutex_destroy },
+    { "spin", spin_init, spin_lock, spin_unlock, spin_destroy },
+    { "ticket", ticket_init, ticket_lock, ticket_unlock, no_destroy },
+    { "futex", futex_init, futex_lock, futex_unlock, no_destroy },
+};
+
+struct bench {
+    const struct lock_ops *ops;
+    union bench_lock lock;
+    unsigned long hold_ns;
+    unsigned long think_ns;
+    pthread_barrier_t start;
+    int stop;
+    // incremented without atomics under the lock, checks mutual exclusion
+    uint64_t protected_count;
+};
+
+struct bench_thread {
+    struct bench *bench;
+    pthread_t thread;
+    uint64_t acquisitions;
+    uint64_t hist[HIST_BUCKETS];
+};
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void busy_wait(unsigned long ns)
+{
+    if (ns > 0) {
+        uint64_t end = now_ns() + ns;
+        while (now_ns() < end) {
+            cpu_relax();
+        }
+    }
+}
+
+static void *bench_thread_main(void *param)
+{
+    struct bench_thread *self = (struct bench_thread *) param;
+    struct bench *bench = self->bench;
+
+    pthread_barrier_wait(&bench->start);
+    while (!__atomic_load_n(&bench->stop, __ATOMIC_RELAXED)) {
+        busy_wait(bench->think_ns);
+
+        uint64_t start = now_ns();
+        bench->ops->lock(&bench->lock);
+        uint64_t obtained = now_ns();
+
+        bench->protected_count++;
+        busy_wait(bench->hold_ns);
+        bench->ops->unlock(&bench->lock);
+
+        self->acquisitions++;
+        self->hist[hist_index(obtained - start)]++;
+    }
+
+    return self;
+}
+
+static uint64_t percentile(const uint64_t *hist, uint64_t total, double p)
+{
+    uint64_t rank = (uint64_t) (total * p), seen = 0;
+
+    for (unsigned int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist[i];
+        if (seen > rank) {
+            return hist_value(i);
+        }
+    }
+    return 0;
+}
+
+static int run(const struct lock_ops *ops, unsigned int threads, unsigned int duration_ms, unsigned long hold_us, unsigned long think_us)
+{
+    struct bench bench = {
+        .ops = ops,
+        .hold_ns = hold_us * 1000,
+        .think_ns = think_us * 1000,
+    };
+    struct bench_thread *workers = calloc(threads, sizeof(*workers));
+    uint64_t *hist = calloc(HIST_BUCKETS, sizeof(*hist));
+    unsigned int started;
+    int rc = 0;
+
+    if (!workers || !hist || ops->init(&bench.lock) != 0) {
+        ERROR_LOG("Failure to set up %s", ops->name);
+        free(workers);
+        free(hist);
+        return -1;
+    }
+    pthread_barrier_init(&bench.start, NULL, threads + 1);
+    for (started = 0; started < threads; started++) {
+        workers[started].bench = &bench;
+        if (pthread_create(&workers[started].thread, NULL, bench_thread_main, &workers[started]) != 0) {
+            ERROR_LOG("Failure to create thread");
+            // the barrier cannot complete anymore
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pthread_barrier_wait(&bench.start);
+    uint64_t begin = now_ns();
+    struct timespec duration = { duration_ms / 1000, (duration_ms % 1000) * 1000000L };
+    while (nanosleep(&duration, &duration) != 0);
+    __atomic_store_n(&bench.stop, 1, __ATOMIC_RELAXED);
+
+    uint64_t total = 0, squares = 0;
+    for (unsigned int i = 0; i < threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        total += workers[i].acquisitions;
+        squares += workers[i].acquisitions * workers[i].acquisitions;
+        for (unsigned int b = 0; b < HIST_BUCKETS; b++) {
+            hist[b] += workers[i].hist[b];
+        }
+    }
+    double elapsed = (now_ns() - begin) / 1e9;
+
+    if (bench.protected_count != total) {
+        ERROR_LOG("%s: %lu acquisitions but %lu increments under the lock", ops->name,
+                  (unsigned long) total, (unsigned long) bench.protected_count);
+        rc = -1;
+    }
+    double jain = squares ? (double) total * total / ((double) threads * squares) : 0;
+    printf("%-9s %8u %12.0f %7.3f %9lu %9lu %9lu\n", ops->name, threads, total / elapsed, jain,
+           (unsigned long) percentile(hist, total, 0.5),
+           (unsigned long) percentile(hist, total, 0.99),
+           (unsigned long) percentile(hist, total, 0.999));
+
+    ops->destroy(&bench.lock);
+    pthread_barrier_destroy(&bench.start);
+    free(workers);
+    free(hist);
+
+    return rc;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-t threads] [-d duration_ms] [-o hold_us] [-w think_us] [-l lock,...]\n", name);
+    fprintf(stderr, "Locks:");
+    for (size_t i = 0; i < sizeof(locks) / sizeof(locks[0]); i++) {
+        fprintf(stderr, " %s", locks[i].name);
+    }
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int threads = DEFAULT_THREADS, duration_ms = DEFAULT_DURATION_MS;
+    unsigned long hold_us = DEFAULT_HOLD_US, think_us = DEFAULT_THINK_US;
+    char *selected = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:d:o:w:l:")) != -1) {
+        switch (opt) {
+            case 't':
+                threads = strtoul(optarg, NULL, 10);
+                break;
+            case 'd':
+                duration_ms = strtoul(optarg, NULL, 10);
+                break;
+            case 'o':
+                hold_us = strtoul(optarg, NULL, 10);
+                break;
+            case 'w':
+                think_us = strtoul(optarg, NULL, 10);
+                break;
+            case 'l':
+                selected = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (threads == 0 || duration_ms == 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    printf("hold %lu us, think %lu us, %u ms per lock\n", hold_us, think_us, duration_ms);
+    printf("%-9s %8s %12s %7s %9s %9s %9s\n", "lock", "threads", "acq_per_s", "jain", "p50_ns", "p99_ns", "p999_ns");
+    int rc = EXIT_SUCCESS;
+    for (size_t i = 0; i < sizeof(locks) / sizeof(locks[0]); i++) {
+        if (selected) {
+            // match whole names in the comma separated list
+            size_t len = strlen(locks[i].name);
+            const char *p = selected;
+            while ((p = strstr(p, locks[i].name)) &&
+                   ((p != selected && p[-1] != ',') || (p[len] != '\0' && p[len] != ','))) {
+                p += len;
+            }
+            if (!p) {
+                continue;
+            }
+        }
+        if (run(&locks[i], threads, duration_ms, hold_us, think_us) != 0) {
+            rc = EXIT_FAILURE;
+        }
+    }
+
+    return rc;
+}
@@ -1,7 +1,10 @@
+#define _GNU_SOURCE
 #include "threading.h"
+#include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 // Optional: use these functions to add debug or error prints to your application
 // #define DEBUG_LOG(msg,...)
@@ -76,3 +79,203 @@ bool start_thread_obtaining_mutex(pthread_t *thread, pthread_mutex_t *mutex,int
     return true;
 }
 
+static void* pool_threadfunc(void* thread_param)
+{
+    struct thread_data* args = (struct thread_data *) thread_param;
+
+    args->pool_thread = pthread_self();
+    args->thread_id = &args->pool_thread;
+
+    return threadfunc(args);
+}
+
+struct threadpool_future *submit_obtaining_mutex(struct threadpool *pool, pthread_mutex_t *mutex, int wait_to_obtain_ms, int wait_to_release_ms)
+{
+    struct thread_data* args = calloc(1, sizeof *args);
+    if (!args) {
+        ERROR_LOG("Failure to allocate thread data");
+        return NULL;
+    }
+    args->mutex = mutex;
+    args->wait_to_obtain_ms = wait_to_obtain_ms;
+    args->wait_to_release_ms = wait_to_release_ms;
+
+    struct threadpool_future *future = threadpool_submit(pool, pool_threadfunc, args);
+    if (!future) {
+        ERROR_LOG("Failure to submit task");
+
+        free(args);
+    }
+
+    return future;
+}
+
+bool cancel_token_init(struct cancel_token *token)
+{
+    pthread_condattr_t attr;
+
+    token->cancelled = false;
+    token->check_interval_us = CANCEL_CHECK_INTERVAL_US;
+    if (pthread_mutex_init(&token->mutex, NULL) != 0) {
+        return false;
+    }
+    // deadlines are on CLOCK_MONOTONIC, see deadline_after_us()
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    int rc = pthread_cond_init(&token->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    if (rc != 0) {
+        pthread_mutex_destroy(&token->mutex);
+        return false;
+    }
+
+    return true;
+}
+
+void cancel_token_cancel(struct cancel_token *token)
+{
+    pthread_mutex_lock(&token->mutex);
+    token->cancelled = true;
+    pthread_cond_broadcast(&token->cond);
+    pthread_mutex_unlock(&token->mutex);
+}
+
+bool cancel_token_cancelled(struct cancel_token *token)
+{
+    pthread_mutex_lock(&token->mutex);
+    bool cancelled = token->cancelled;
+    pthread_mutex_unlock(&token->mutex);
+
+    return cancelled;
+}
+
+void cancel_token_destroy(struct cancel_token *token)
+{
+    pthread_mutex_destroy(&token->mutex);
+    pthread_cond_destroy(&token->cond);
+}
+
+struct timespec deadline_after_us(unsigned long us)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += us / 1000000;
+    ts.tv_nsec += (us % 1000000) * 1000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+
+    return ts;
+}
+
+static bool before(const struct timespec *a, const struct timespec *b)
+{
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+int sleep_until(const struct timespec *deadline, struct cancel_token *token)
+{
+    int rc = 0;
+
+    if (!token) {
+        // absolute, so a signal interrupting it does not make the sleep longer
+        while ((rc = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL)) == EINTR);
+        return rc;
+    }
+
+    pthread_mutex_lock(&token->mutex);
+    // 0 is a spurious or broadcast wakeup, anything but ETIMEDOUT is an error (EINVAL deadline)
+    while (!token->cancelled && rc == 0) {
+        rc = pthread_cond_timedwait(&token->cond, &token->mutex, deadline);
+    }
+    if (token->cancelled) {
+        rc = ECANCELED;
+    } else if (rc == ETIMEDOUT) {
+        rc = 0;
+    }
+    pthread_mutex_unlock(&token->mutex);
+
+    return rc;
+}
+
+int mutex_lock_until(pthread_mutex_t *mutex, const struct timespec *deadline, struct cancel_token *token)
+{
+    int rc;
+
+    if (!token) {
+        return deadline ? pthread_mutex_clocklock(mutex, CLOCK_MONOTONIC, deadline) : pthread_mutex_lock(mutex);
+    }
+
+    do {
+        if (cancel_token_cancelled(token)) {
+            return ECANCELED;
+        }
+        struct timespec slice = deadline_after_us(token->check_interval_us);
+        bool last = deadline && before(deadline, &slice);
+        rc = pthread_mutex_clocklock(mutex, CLOCK_MONOTONIC, last ? deadline : &slice);
+        if (rc == ETIMEDOUT && !last) {
+            rc = EAGAIN;
+        }
+    } while (rc == EAGAIN);
+
+    return rc;
+}
+
+static void* threadfunc_timed(void* thread_param)
+{
+    struct thread_data* args = (struct thread_data *) thread_param;
+    struct timespec deadline = deadline_after_us(args->wait_to_obtain_us);
+    int rc;
+
+    args->thread_complete_success = false;
+    if ((rc = sleep_until(&deadline, args->token)) != 0) {
+        ERROR_LOG("Failure to wait for obtain mutex: %ld, %s", *(args->thread_id), strerror(rc));
+    } else {
+        deadline = deadline_after_us(args->obtain_timeout_us);
+        if ((rc = mutex_lock_until(args->mutex, args->obtain_timeout_us ? &deadline : NULL, args->token)) != 0) {
+            ERROR_LOG("Failure to obtain mutex: %ld, %s", *(args->thread_id), strerror(rc));
+        } else {
+            DEBUG_LOG("mutex obtained: %ld", *(args->thread_id));
+
+            deadline = deadline_after_us(args->wait_to_release_us);
+            // the mutex is released on cancellation as well
+            rc = sleep_until(&deadline, args->token);
+            int unlock_rc = pthread_mutex_unlock(args->mutex);
+            rc = rc ? rc : unlock_rc;
+        }
+    }
+
+    args->error = rc;
+    args->thread_complete_success = rc == 0;
+
+    return args;
+}
+
+bool start_thread_obtaining_mutex_timed(pthread_t *thread, pthread_mutex_t *mutex, unsigned long wait_to_obtain_us,
+                                        unsigned long wait_to_release_us, unsigned long obtain_timeout_us,
+                                        struct cancel_token *token)
+{
+    struct thread_data* args = calloc(1, sizeof *args);
+    if (!args) {
+        ERROR_LOG("Failure to allocate thread data");
+        return false;
+    }
+    args->mutex = mutex;
+    args->thread_id = thread;
+    args->wait_to_obtain_us = wait_to_obtain_us;
+    args->wait_to_release_us = wait_to_release_us;
+    args->obtain_timeout_us = obtain_timeout_us;
+    args->token = token;
+
+    int rc_th = pthread_create(args->thread_id, NULL, &threadfunc_timed, (void *)args);
+    if (rc_th != 0) {
+        ERROR_LOG("Failure to create thread");
+
+        free(args);
+        return false;
+    }
+
+    return true;
+}
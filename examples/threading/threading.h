@@ -1,5 +1,53 @@
 #include <stdbool.h>
 #include <pthread.h>
+#include <time.h>
+#include "threadpool.h"
+
+/**
+ * Cooperative cancellation: cancel_token_cancel() ends the waits of sleep_until() and
+ * mutex_lock_until() taking the token, and threads check cancel_token_cancelled() between
+ * steps. Nothing is interrupted asynchronously, the thread still releases what it holds.
+ */
+struct cancel_token {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool cancelled;
+    /**
+     * Slice of mutex_lock_until() waits, CANCEL_CHECK_INTERVAL_US after cancel_token_init().
+     * Shorter notices a cancellation sooner, at the cost of waking every waiter that often.
+     */
+    unsigned long check_interval_us;
+};
+
+bool cancel_token_init(struct cancel_token *token);
+void cancel_token_cancel(struct cancel_token *token);
+bool cancel_token_cancelled(struct cancel_token *token);
+void cancel_token_destroy(struct cancel_token *token);
+
+/**
+ * @return the CLOCK_MONOTONIC time @param us microseconds from now, the clock the timed
+ *   functions below take their deadlines on, so changes of the wall clock do not affect them.
+ */
+struct timespec deadline_after_us(unsigned long us);
+/**
+ * Sleeps until @param deadline, with clock_nanosleep() or, given a @param token which
+ * may be NULL, on the token so cancelling it wakes the thread up.
+ * @return 0, ECANCELED if the token was cancelled first, or the error of the wait
+ *   (EINVAL for a deadline with tv_nsec out of range).
+ */
+int sleep_until(const struct timespec *deadline, struct cancel_token *token);
+/**
+ * Obtains @param mutex with pthread_mutex_clocklock(), giving up at @param deadline
+ * unless it is NULL. A mutex cannot be waited on together with a condition, so with a
+ * @param token the wait is cut in slices of token->check_interval_us to notice a
+ * cancellation: every waiter wakes up once per slice for as long as the mutex is held.
+ * @return 0 when the mutex is held, ETIMEDOUT, ECANCELED or the error of the lock.
+ */
+int mutex_lock_until(pthread_mutex_t *mutex, const struct timespec *deadline, struct cancel_token *token);
+
+#ifndef CANCEL_CHECK_INTERVAL_US
+#define CANCEL_CHECK_INTERVAL_US 10000
+#endif
 
 /**
  * This structure should be dynamically allocated and passed as
@@ -24,6 +72,22 @@ struct thread_data{
      * if an error occurred.
      */
     bool thread_complete_success;
+
+    /**
+     * Used by start_thread_obtaining_mutex_timed() only: waits in microseconds, the
+     * longest wait for the mutex (0 for no limit), the token ending waits early (may be
+     * NULL), and why the thread failed: ETIMEDOUT, ECANCELED or the error of a call.
+     */
+    unsigned long wait_to_obtain_us;
+    unsigned long wait_to_release_us;
+    unsigned long obtain_timeout_us;
+    struct cancel_token *token;
+    int error;
+
+    /**
+     * Holds the ID of the worker when run by a thread pool, thread_id then points here.
+     */
+    pthread_t pool_thread;
 };
 
 
@@ -42,3 +106,22 @@ struct thread_data{
 * @return true if the thread could be started, false if a failure occurred.
 */
 bool start_thread_obtaining_mutex(pthread_t *thread, pthread_mutex_t *mutex,int wait_to_obtain_ms, int wait_to_release_ms);
+
+/**
+* Same as start_thread_obtaining_mutex(), run as a task of @param pool instead of a thread
+* of its own. The future returns the thread_data structure, which the caller frees after
+* threadpool_future_get().
+* @return the future of the task, NULL if it could not be submitted.
+*/
+struct threadpool_future *submit_obtaining_mutex(struct threadpool *pool, pthread_mutex_t *mutex, int wait_to_obtain_ms, int wait_to_release_ms);
+
+/**
+* Same as start_thread_obtaining_mutex() with waits in microseconds, the mutex abandoned
+* after @param obtain_timeout_us (0 to wait as long as it takes) and every wait ending
+* early when @param token, which may be NULL, is cancelled. The thread_data returned by
+* the thread tells why it failed in error.
+* @return true if the thread could be started, false if a failure occurred.
+*/
+bool start_thread_obtaining_mutex_timed(pthread_t *thread, pthread_mutex_t *mutex, unsigned long wait_to_obtain_us,
+                                        unsigned long wait_to_release_us, unsigned long obtain_timeout_us,
+                                        struct cancel_token *token);
@@ -0,0 +1,340 @@
+#include "threadpool.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define ERROR_LOG(msg,...) printf("[ERROR] threadpool: " msg "\n" , ##__VA_ARGS__)
+
+#define DEQUE_INITIAL_SIZE 64
+
+struct threadpool_future {
+    threadpool_task task;
+    void *arg;
+    void *result;
+    int done;
+    int refs;           // pool and submitter
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+/**
+ * Ring buffer of tasks, the owner pushes and pops at the bottom, thieves take from the
+ * top. The lock is only held to move a pointer, tasks run unlocked.
+ */
+struct deque {
+    pthread_mutex_t lock;
+    struct threadpool_future **items;
+    size_t top;
+    size_t count;
+    size_t size;
+};
+
+struct worker {
+    struct threadpool *pool;
+    unsigned int index;
+    pthread_t thread;
+    struct deque deque;
+};
+
+struct threadpool {
+    struct worker *workers;
+    unsigned int count;
+    unsigned int next;      // round robin for submissions from outside the pool
+    int pending;            // queued tasks not taken yet
+    int sleepers;
+    int stopping;
+    pthread_mutex_t mutex;  // guards sleeping and stopping
+    pthread_cond_t cond;
+};
+
+// the worker the calling thread is, if any
+static __thread struct worker *current_worker;
+
+static int deque_push(struct deque *deque, struct threadpool_future *future)
+{
+    int rc = 0;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count == deque->size) {
+        size_t size = deque->size ? deque->size * 2 : DEQUE_INITIAL_SIZE;
+        struct threadpool_future **items = malloc(size * sizeof(*items));
+        if (items) {
+            for (size_t i = 0; i < deque->count; i++) {
+                items[i] = deque->items[(deque->top + i) % deque->size];
+            }
+            free(deque->items);
+            deque->items = items;
+            deque->top = 0;
+            deque->size = size;
+        } else {
+            rc = -1;
+        }
+    }
+    if (rc == 0) {
+        deque->items[(deque->top + deque->count) % deque->size] = future;
+        deque->count++;
+    }
+    pthread_mutex_unlock(&deque->lock);
+
+    return rc;
+}
+
+static struct threadpool_future *deque_pop_bottom(struct deque *deque)
+{
+    struct threadpool_future *future = NULL;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count > 0) {
+        deque->count--;
+        future = deque->items[(deque->top + deque->count) % deque->size];
+    }
+    pthread_mutex_unlock(&deque->lock);
+
+    return future;
+}
+
+static struct threadpool_future *deque_steal_top(struct deque *deque)
+{
+    struct threadpool_future *future = NULL;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count > 0) {
+        future = deque->items[deque->top];
+        deque->top = (deque->top + 1) % deque->size;
+        deque->count--;
+    }
+    pthread_mutex_unlock(&deque->lock);
+
+    return future;
+}
+
+static void future_release(struct threadpool_future *future)
+{
+    if (__atomic_sub_fetch(&future->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        pthread_mutex_destroy(&future->mutex);
+        pthread_cond_destroy(&future->cond);
+        free(future);
+    }
+}
+
+static void run(struct threadpool_future *future)
+{
+    void *result = future->task(future->arg);
+
+    pthread_mutex_lock(&future->mutex);
+    future->result = result;
+    future->done = 1;
+    pthread_cond_broadcast(&future->cond);
+    pthread_mutex_unlock(&future->mutex);
+    future_release(future);
+}
+
+/**
+ * Takes a task from the deque of @param self first, then from the other workers.
+ * @param self is NULL for a thread outside the pool, which only steals.
+ */
+static struct threadpool_future *take(struct threadpool *pool, struct worker *self)
+{
+    struct threadpool_future *future = self ? deque_pop_bottom(&self->deque) : NULL;
+    unsigned int start = self ? self->index + 1 : 0;
+
+    for (unsigned int i = 0; !future && i < pool->count; i++) {
+        struct worker *victim = &pool->workers[(start + i) % pool->count];
+        if (victim != self) {
+            future = deque_steal_top(&victim->deque);
+        }
+    }
+    if (future) {
+        __atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+    }
+
+    return future;
+}
+
+static void *worker_main(void *param)
+{
+    struct worker *self = (struct worker *) param;
+    struct threadpool *pool = self->pool;
+
+    current_worker = self;
+    for (;;) {
+        struct threadpool_future *future = take(pool, self);
+        if (future) {
+            run(future);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->mutex);
+        // pairs with the pending increment and sleepers check in threadpool_submit()
+        __atomic_add_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) == 0 && !pool->stopping) {
+            pthread_cond_wait(&pool->cond, &pool->mutex);
+        }
+        __atomic_sub_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+        // queued tasks are run before leaving
+        int leave = pool->stopping && __atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) == 0;
+        pthread_mutex_unlock(&pool->mutex);
+        if (leave) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+struct threadpool *threadpool_create(unsigned int workers)
+{
+    struct threadpool *pool = calloc(1, sizeof(*pool));
+
+    if (workers == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = cores > 0 ? (unsigned int) cores : 1;
+    }
+    if (!pool || !(pool->workers = calloc(workers, sizeof(*pool->workers)))) {
+        ERROR_LOG("Failure to allocate a pool of %u workers", workers);
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    for (unsigned int i = 0; i < workers; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+        pthread_mutex_init(&pool->workers[i].deque.lock, NULL);
+    }
+    pool->count = workers;
+    unsigned int started;
+    for (started = 0; started < workers; started++) {
+        int rc = pthread_create(&pool->workers[started].thread, NULL, worker_main, &pool->workers[started]);
+        if (rc != 0) {
+            ERROR_LOG("Failure to create worker thread with error code: %d", rc);
+            break;
+        }
+    }
+    if (started < workers) {
+        // the started workers find no task and leave
+        pthread_mutex_lock(&pool->mutex);
+        pool->stopping = 1;
+        pthread_cond_broadcast(&pool->cond);
+        pthread_mutex_unlock(&pool->mutex);
+        for (unsigned int i = 0; i < started; i++) {
+            pthread_join(pool->workers[i].thread, NULL);
+        }
+        for (unsigned int i = 0; i < workers; i++) {
+            pthread_mutex_destroy(&pool->workers[i].deque.lock);
+        }
+        pthread_mutex_destroy(&pool->mutex);
+        pthread_cond_destroy(&pool->cond);
+        free(pool->workers);
+        free(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+struct threadpool_future *threadpool_submit(struct threadpool *pool, threadpool_task task, void *arg)
+{
+    struct worker *self = current_worker && current_worker->pool == pool ? current_worker : NULL;
+
+    if (!self && __atomic_load_n(&pool->stopping, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    struct threadpool_future *future = malloc(sizeof(*future));
+    if (!future) {
+        return NULL;
+    }
+    future->task = task;
+    future->arg = arg;
+    future->result = NULL;
+    future->done = 0;
+    future->refs = 2;
+    pthread_mutex_init(&future->mutex, NULL);
+    pthread_cond_init(&future->cond, NULL);
+
+    struct worker *target = self;
+    if (!target) {
+        target = &pool->workers[__atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED) % pool->count];
+    }
+    if (deque_push(&target->deque, future) != 0) {
+        pthread_mutex_destroy(&future->mutex);
+        pthread_cond_destroy(&future->cond);
+        free(future);
+        return NULL;
+    }
+
+    __atomic_add_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+    // a worker about to sleep either sees pending or is counted in sleepers
+    if (__atomic_load_n(&pool->sleepers, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&pool->mutex);
+        pthread_cond_signal(&pool->cond);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+
+    return future;
+}
+
+void *threadpool_future_get(struct threadpool_future *future)
+{
+    struct worker *self = current_worker;
+    void *result;
+
+    // a worker blocking here could leave the task it waits for queued behind itself, once
+    // nothing is queued that task is running on another worker
+    while (self && !threadpool_future_done(future)) {
+        struct threadpool_future *other = take(self->pool, self);
+        if (!other) {
+            break;
+        }
+        run(other);
+    }
+
+    pthread_mutex_lock(&future->mutex);
+    while (!future->done) {
+        pthread_cond_wait(&future->cond, &future->mutex);
+    }
+    result = future->result;
+    pthread_mutex_unlock(&future->mutex);
+
+    return result;
+}
+
+bool threadpool_future_done(struct threadpool_future *future)
+{
+    pthread_mutex_lock(&future->mutex);
+    bool done = future->done;
+    pthread_mutex_unlock(&future->mutex);
+
+    return done;
+}
+
+void threadpool_future_free(struct threadpool_future *future)
+{
+    if (future) {
+        future_release(future);
+    }
+}
+
+void threadpool_destroy(struct threadpool *pool)
+{
+    if (!pool) {
+        return;
+    }
+    pthread_mutex_lock(&pool->mutex);
+    __atomic_store_n(&pool->stopping, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (unsigned int i = 0; i < pool->count; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+    for (unsigned int i = 0; i < pool->count; i++) {
+        pthread_mutex_destroy(&pool->workers[i].deque.lock);
+        free(pool->workers[i].deque.items);
+    }
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->cond);
+    free(pool->workers);
+    free(pool);
+}
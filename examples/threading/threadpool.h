@@ -0,0 +1,54 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <stdbool.h>
+
+/**
+ * Fixed set of worker threads running short tasks, so a task does not pay for creating
+ * a thread. Every worker owns a deque: a task submitted from a worker goes to the bottom
+ * of that worker's deque and is popped from there, last in first out while its data is
+ * still in cache. A worker whose deque is empty steals from the top of the others, and
+ * tasks submitted from other threads are spread over the deques round robin.
+ */
+struct threadpool;
+
+/**
+ * Result of a submitted task, owned both by the pool and the submitter until the task
+ * ran and threadpool_future_free() was called.
+ */
+struct threadpool_future;
+
+typedef void *(*threadpool_task)(void *arg);
+
+/**
+ * @param workers number of worker threads, 0 for the number of online cores.
+ * @return the pool, NULL if it could not be created.
+ */
+struct threadpool *threadpool_create(unsigned int workers);
+
+/**
+ * Queues @param task to be called with @param arg.
+ * @return its future, NULL when out of memory or once threadpool_destroy() started, except
+ *   for tasks submitted by tasks of the pool which are still run.
+ */
+struct threadpool_future *threadpool_submit(struct threadpool *pool, threadpool_task task, void *arg);
+
+/**
+ * Blocks until the task ran. Called from a task of the pool, runs queued tasks meanwhile
+ * instead of blocking the worker, so tasks may wait on tasks they submitted.
+ * @return the value returned by the task.
+ */
+void *threadpool_future_get(struct threadpool_future *future);
+bool threadpool_future_done(struct threadpool_future *future);
+/**
+ * Releases the submitter's reference, the task still runs if it did not yet.
+ */
+void threadpool_future_free(struct threadpool_future *future);
+
+/**
+ * Graceful shutdown: refuses new tasks from outside the pool, runs every task already
+ * queued, joins the workers and frees the pool.
+ */
+void threadpool_destroy(struct threadpool *pool);
+
+#endif
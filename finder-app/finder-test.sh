@@ -67,10 +67,11 @@ fi
 # make clean
 # make
 
+# one writer process creates all the files from a manifest of FILE<TAB>STRING lines
 for i in $( seq 1 $NUMFILES)
 do
-	writer "$WRITEDIR/${username}$i.txt" "$WRITESTR"
-done
+	printf '%s\t%s\n' "$WRITEDIR/${username}$i.txt" "$WRITESTR"
+done | writer -
 
 OUTPUTSTRING=$(finder.sh "$WRITEDIR" "$WRITESTR" 2>&1 | tee /tmp/assignment4-result.txt)
 
@@ -0,0 +1,353 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+/*
+ * Native finder.sh: counts the regular files under a directory and the lines of those
+ * files containing a string, as `find -type f | wc -l` and `grep -r | wc -l` do, walking
+ * the tree once. Symbolic links are not followed, as neither command does.
+ *
+ * The main thread reads directories with getdents64 and hands batches of file paths to
+ * worker threads, one per online core. Files are mmapped and searched with memmem() and
+ * memchr(), which glibc vectorises. Files holding a NUL byte count no lines: grep reports
+ * them as "binary file matches" on standard error, which wc never sees.
+ */
+#define DIRENT_BUFFER_SIZE (64*1024)
+#define BATCH_SIZE 64
+#define QUEUE_BATCHES 64
+// files this small are read rather than mmapped
+#define MMAP_THRESHOLD (64*1024)
+
+struct batch {
+    char *paths[BATCH_SIZE];
+    int count;
+};
+
+struct finder {
+    const char *needle;
+    size_t needle_len;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    struct batch *queue[QUEUE_BATCHES];
+    int head;
+    int count;
+    int done;
+
+    unsigned long files;
+    unsigned long lines;
+};
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+static void push_batch(struct finder *finder, struct batch *batch) {
+    pthread_mutex_lock(&finder->mutex);
+    while (finder->count == QUEUE_BATCHES) {
+        pthread_cond_wait(&finder->not_full, &finder->mutex);
+    }
+    finder->queue[(finder->head + finder->count) % QUEUE_BATCHES] = batch;
+    finder->count++;
+    pthread_cond_signal(&finder->not_empty);
+    pthread_mutex_unlock(&finder->mutex);
+}
+
+// returns NULL once the walk is over and the queue empty
+static struct batch *pop_batch(struct finder *finder) {
+    struct batch *batch = NULL;
+
+    pthread_mutex_lock(&finder->mutex);
+    while (finder->count == 0 && !finder->done) {
+        pthread_cond_wait(&finder->not_empty, &finder->mutex);
+    }
+    if (finder->count > 0) {
+        batch = finder->queue[finder->head];
+        finder->head = (finder->head + 1) % QUEUE_BATCHES;
+        finder->count--;
+        pthread_cond_signal(&finder->not_full);
+    }
+    pthread_mutex_unlock(&finder->mutex);
+
+    return batch;
+}
+
+// lines of @param data holding the needle, a last line without a newline counts too
+static unsigned long count_lines(const struct finder *finder, const char *data, size_t len) {
+    unsigned long lines = 0;
+    const char *end = data + len;
+    const char *p = data;
+
+    if (memchr(data, '\0', len)) {
+        return 0;
+    }
+    while (p < end) {
+        const char *match = memmem(p, end - p, finder->needle, finder->needle_len);
+        if (!match) {
+            break;
+        }
+        // count the line once, the search goes on with the next one
+        const char *newline = memchr(match, '\n', end - match);
+        lines++;
+        p = newline ? newline + 1 : end;
+    }
+
+    return lines;
+}
+
+static unsigned long search_file(const struct finder *finder, const char *path) {
+    unsigned long lines = 0;
+    struct stat st;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "finder: %s: %s\n", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 0;
+    }
+
+    if (st.st_size >= MMAP_THRESHOLD) {
+        char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            madvise(data, st.st_size, MADV_SEQUENTIAL);
+            lines = count_lines(finder, data, st.st_size);
+            munmap(data, st.st_size);
+            close(fd);
+            return lines;
+        }
+    }
+
+    // small files, and files whose size is not known up front (procfs, sysfs)
+    size_t size = st.st_size >= MMAP_THRESHOLD ? (size_t) st.st_size + 1 : MMAP_THRESHOLD;
+    size_t len = 0;
+    char *data = malloc(size);
+    ssize_t n = 0;
+    while (data && (n = read(fd, data + len, size - len)) > 0) {
+        len += n;
+        if (len == size) {
+            char *bigger = realloc(data, size * 2);
+            if (!bigger) {
+                break;
+            }
+            data = bigger;
+            size *= 2;
+        }
+    }
+    if (!data || n < 0) {
+        fprintf(stderr, "finder: %s: %s\n", path, strerror(data ? errno : ENOMEM));
+    } else {
+        lines = count_lines(finder, data, len);
+    }
+    free(data);
+    close(fd);
+
+    return lines;
+}
+
+static void *worker(void *param) {
+    struct finder *finder = (struct finder *) param;
+    unsigned long lines = 0;
+    struct batch *batch;
+
+    while ((batch = pop_batch(finder))) {
+        for (int i = 0; i < batch->count; i++) {
+            lines += search_file(finder, batch->paths[i]);
+            free(batch->paths[i]);
+        }
+        free(batch);
+    }
+
+    pthread_mutex_lock(&finder->mutex);
+    finder->lines += lines;
+    pthread_mutex_unlock(&finder->mutex);
+
+    return NULL;
+}
+
+static char *join_path(const char *dir, const char *name) {
+    size_t dir_len = strlen(dir);
+    size_t name_len = strlen(name);
+    char *path = malloc(dir_len + name_len + 2);
+
+    if (path) {
+        memcpy(path, dir, dir_len);
+        path[dir_len] = '/';
+        memcpy(path + dir_len + 1, name, name_len + 1);
+    }
+
+    return path;
+}
+
+static void add_file(struct finder *finder, struct batch **pending, char *file) {
+    if (!*pending && !(*pending = calloc(1, sizeof(**pending)))) {
+        free(file);
+        return;
+    }
+    (*pending)->paths[(*pending)->count++] = file;
+    if ((*pending)->count == BATCH_SIZE) {
+        push_batch(finder, *pending);
+        *pending = NULL;
+    }
+}
+
+/*
+ * Walks the directory @param dir_fd named @param path, takes ownership of both. The
+ * directory is read to its end before descending, so one dirent buffer serves the whole
+ * walk and a directory fd stays open per level only.
+ */
+static void walk(struct finder *finder, int dir_fd, char *path, struct batch **pending, char *buffer) {
+    char **subdirs = NULL;
+    size_t subdir_count = 0, subdir_size = 0;
+    long n;
+
+    while ((n = syscall(SYS_getdents64, dir_fd, buffer, DIRENT_BUFFER_SIZE)) > 0) {
+        for (long pos = 0; pos < n;) {
+            struct linux_dirent64 *entry = (struct linux_dirent64 *) (buffer + pos);
+            pos += entry->d_reclen;
+
+            const char *name = entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+            unsigned char type = entry->d_type;
+            if (type == DT_UNKNOWN) {
+                // some file systems do not fill d_type
+                struct stat st;
+                if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                    continue;
+                }
+                type = S_ISREG(st.st_mode) ? DT_REG : S_ISDIR(st.st_mode) ? DT_DIR : DT_LNK;
+            }
+
+            if (type == DT_REG) {
+                char *file = join_path(path, name);
+                if (file) {
+                    finder->files++;
+                    add_file(finder, pending, file);
+                }
+            } else if (type == DT_DIR) {
+                if (subdir_count == subdir_size) {
+                    size_t size = subdir_size ? subdir_size * 2 : 16;
+                    char **bigger = realloc(subdirs, size * sizeof(*subdirs));
+                    if (!bigger) {
+                        continue;
+                    }
+                    subdirs = bigger;
+                    subdir_size = size;
+                }
+                if ((subdirs[subdir_count] = strdup(name))) {
+                    subdir_count++;
+                }
+            }
+        }
+    }
+    if (n < 0) {
+        fprintf(stderr, "finder: %s: %s\n", path, strerror(errno));
+    }
+
+    for (size_t i = 0; i < subdir_count; i++) {
+        int sub_fd = openat(dir_fd, subdirs[i], O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (sub_fd < 0) {
+            fprintf(stderr, "finder: %s/%s: %s\n", path, subdirs[i], strerror(errno));
+        } else {
+            char *sub_path = join_path(path, subdirs[i]);
+            if (sub_path) {
+                walk(finder, sub_fd, sub_path, pending, buffer);
+            } else {
+                close(sub_fd);
+            }
+        }
+        free(subdirs[i]);
+    }
+    free(subdirs);
+    close(dir_fd);
+    free(path);
+}
+
+int main(int argc, char** argv) {
+    const char* filesdir = argc > 1 ? argv[1] : "";
+    const char* searchstr = argc > 2 ? argv[2] : "";
+
+    if (strlen(filesdir) == 0) {
+        printf("Required parameter 'filesdir' is blank.\n");
+        return 1;
+    }
+    if (strlen(searchstr) == 0) {
+        printf("Required parameter 'searchstr' is blank.\n");
+        return 1;
+    }
+    int dir_fd = open(filesdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) {
+        printf("Directory '%s' is not found.\n", filesdir);
+        return 1;
+    }
+
+    struct finder finder = {
+        .needle = searchstr,
+        .needle_len = strlen(searchstr),
+        .mutex = PTHREAD_MUTEX_INITIALIZER,
+        .not_empty = PTHREAD_COND_INITIALIZER,
+        .not_full = PTHREAD_COND_INITIALIZER,
+    };
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int workers = cores > 0 ? (int) cores : 1;
+    pthread_t threads[workers];
+    int started;
+    for (started = 0; started < workers; started++) {
+        if (pthread_create(&threads[started], NULL, worker, &finder) != 0) {
+            break;
+        }
+    }
+    if (started == 0) {
+        fprintf(stderr, "finder: Failure to create worker thread\n");
+        return 1;
+    }
+
+    char *buffer = malloc(DIRENT_BUFFER_SIZE);
+    char *path = strdup(filesdir);
+    size_t path_len = path ? strlen(path) : 0;
+    while (path_len > 1 && path[path_len - 1] == '/') {
+        path[--path_len] = '\0';
+    }
+    struct batch *pending = NULL;
+    if (!buffer || !path) {
+        fprintf(stderr, "finder: %s\n", strerror(ENOMEM));
+        close(dir_fd);
+        free(path);
+    } else {
+        walk(&finder, dir_fd, path, &pending, buffer);
+    }
+    if (pending) {
+        push_batch(&finder, pending);
+    }
+    free(buffer);
+
+    pthread_mutex_lock(&finder.mutex);
+    finder.done = 1;
+    pthread_cond_broadcast(&finder.not_empty);
+    pthread_mutex_unlock(&finder.mutex);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    printf("The number of files are %lu and the number of matching lines are %lu\n", finder.files, finder.lines);
+
+    return 0;
+}
@@ -21,6 +21,13 @@ then
     exit 1
 fi
 
+# the native finder walks the tree once with worker threads, same output
+finder_bin="$(dirname "$0")/finder"
+if [ -x "$finder_bin" ]
+then
+    exec "$finder_bin" "$filesdir" "$searchstr"
+fi
+
 num_of_lines="$(grep -r $searchstr $filesdir | wc -l)"
 ## FIXME: filter by files only; exclude dirs
 num_of_files="$(find $filesdir -type f| wc -l)"
@@ -0,0 +1,252 @@
+#include "writer-uring.h"
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// OPENAT, WRITE and CLOSE
+#define SQES_PER_JOB 3
+
+struct writer_uring {
+    int fd;
+    unsigned int jobs;
+    // completions reaped per job of the batch
+    unsigned char* job_cqes;
+    // set once a submission failed, SQEs the kernel did not take are left in the ring
+    int broken;
+
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+
+    unsigned int* sq_tail;
+    unsigned int* sq_mask;
+    unsigned int* sq_array;
+    unsigned int* cq_head;
+    unsigned int* cq_tail;
+    unsigned int* cq_mask;
+    struct io_uring_cqe* cqes;
+};
+
+void writer_uring_destroy(struct writer_uring* ring) {
+    if (!ring) {
+        return;
+    }
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    free(ring->job_cqes);
+    // also closes the files left in direct descriptor slots
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    free(ring);
+}
+
+struct writer_uring* writer_uring_create(unsigned int jobs) {
+    struct io_uring_params params;
+    struct writer_uring* ring = calloc(1, sizeof(*ring));
+
+    if (!ring) {
+        return NULL;
+    }
+    memset(&params, 0, sizeof(params));
+    ring->jobs = jobs;
+    ring->job_cqes = malloc(jobs);
+    if (!ring->job_cqes) {
+        free(ring);
+        return NULL;
+    }
+    ring->fd = syscall(SYS_io_uring_setup, jobs * SQES_PER_JOB, &params);
+    if (ring->fd < 0) {
+        syslog(LOG_DEBUG, "io_uring unavailable: %s", strerror(errno));
+        free(ring->job_cqes);
+        free(ring);
+        return NULL;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        writer_uring_destroy(ring);
+        return NULL;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = NULL;
+            writer_uring_destroy(ring);
+            return NULL;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        writer_uring_destroy(ring);
+        return NULL;
+    }
+
+    char* sq = ring->sq_ring;
+    char* cq = ring->cq_ring;
+    ring->sq_tail = (unsigned int*) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned int*) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int*) (sq + params.sq_off.array);
+    ring->cq_head = (unsigned int*) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int*) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned int*) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+
+    // one empty direct descriptor slot per job of a batch
+    struct io_uring_rsrc_register reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.nr = jobs;
+    reg.flags = IORING_RSRC_REGISTER_SPARSE;
+    if (syscall(SYS_io_uring_register, ring->fd, IORING_REGISTER_FILES2, &reg, sizeof(reg)) != 0) {
+        syslog(LOG_DEBUG, "io_uring direct descriptors unavailable: %s", strerror(errno));
+        writer_uring_destroy(ring);
+        return NULL;
+    }
+
+    return ring;
+}
+
+static struct io_uring_sqe* next_sqe(struct writer_uring* ring, unsigned int* tail) {
+    unsigned int index = *tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    (*tail)++;
+
+    return sqe;
+}
+
+unsigned int writer_uring_run(struct writer_uring* ring, int dir_fd, struct writer_job* jobs, unsigned int count,
+                              int open_flags, mode_t mode) {
+    if (ring->broken) {
+        return 0;
+    }
+
+    for (unsigned int first = 0; first < count; first += ring->jobs) {
+        unsigned int n = count - first < ring->jobs ? count - first : ring->jobs;
+        // the kernel does not write the SQ tail, only we do
+        unsigned int tail = *ring->sq_tail;
+
+        for (unsigned int slot = 0; slot < n; slot++) {
+            struct writer_job* job = &jobs[first + slot];
+            unsigned long long user_data = (unsigned long long) slot * SQES_PER_JOB;
+
+            job->error = 0;
+            struct io_uring_sqe* sqe = next_sqe(ring, &tail);
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->flags = IOSQE_IO_LINK;
+            sqe->fd = dir_fd;
+            sqe->addr = (unsigned long) job->path;
+            // a direct descriptor is not in the file table, the kernel refuses O_CLOEXEC for it
+            sqe->open_flags = open_flags & ~O_CLOEXEC;
+            sqe->len = mode;
+            // slot + 1, 0 means a regular descriptor
+            sqe->file_index = slot + 1;
+            sqe->user_data = user_data;
+
+            sqe = next_sqe(ring, &tail);
+            sqe->opcode = IORING_OP_WRITE;
+            sqe->flags = IOSQE_IO_LINK | IOSQE_FIXED_FILE;
+            sqe->fd = slot;
+            sqe->addr = (unsigned long) job->text;
+            sqe->len = job->len;
+            sqe->off = 0;
+            sqe->user_data = user_data + 1;
+
+            sqe = next_sqe(ring, &tail);
+            sqe->opcode = IORING_OP_CLOSE;
+            sqe->file_index = slot + 1;
+            sqe->user_data = user_data + 2;
+        }
+        __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+        unsigned int submitted = n * SQES_PER_JOB;
+        // SQEs the kernel did not take yet
+        unsigned int pending = submitted;
+        unsigned int completed = 0;
+        memset(ring->job_cqes, 0, n);
+        // after a failed submission only the SQEs taken already are waited for
+        while (completed < (ring->broken ? submitted - pending : submitted)) {
+            unsigned int to_submit = ring->broken ? 0 : pending;
+            unsigned int wait = (ring->broken ? submitted - pending : submitted) - completed;
+            int rc = syscall(SYS_io_uring_enter, ring->fd, to_submit, wait, IORING_ENTER_GETEVENTS, NULL, 0);
+            if (rc < 0 && errno != EINTR) {
+                syslog(LOG_ERR, "Failure to submit to io_uring: %s", strerror(errno));
+                if (ring->broken) {
+                    // the outcome of the batch is unknown, it is written again
+                    return first;
+                }
+                ring->broken = 1;
+                continue;
+            }
+            if (rc > 0 && !ring->broken) {
+                pending -= rc;
+            }
+
+            unsigned int head = *ring->cq_head;
+            unsigned int cq_tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+            for (; head != cq_tail; head++) {
+                const struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+                unsigned int slot = cqe->user_data / SQES_PER_JOB;
+                unsigned int op = cqe->user_data % SQES_PER_JOB;
+                struct writer_job* job = &jobs[first + slot];
+                int res = cqe->res;
+                if (op == 1 && res >= 0 && (size_t) res != job->len) {
+                    res = -EIO;
+                }
+                // once a link fails the rest of the chain completes with -ECANCELED
+                if (res < 0 && res != -ECANCELED && !job->error) {
+                    job->error = -res;
+                    syslog(LOG_ERR, "Failure to write file %s: %s", job->path, strerror(-res));
+                }
+                ring->job_cqes[slot]++;
+                completed++;
+            }
+            __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        }
+
+        if (ring->broken) {
+            // the kernel takes SQEs in order, the jobs run are the ones completed or failed up front
+            unsigned int done = 0;
+            while (done < n && (ring->job_cqes[done] == SQES_PER_JOB || jobs[first + done].error)) {
+                done++;
+            }
+            return first + done;
+        }
+    }
+
+    return count;
+}
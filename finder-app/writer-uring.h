@@ -0,0 +1,39 @@
+#ifndef WRITER_URING_H
+#define WRITER_URING_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+struct writer_job {
+    const char* path;
+    const char* text;
+    size_t len;
+    // set by writer_uring_run(), 0 once written or the errno of the failure
+    int error;
+};
+
+/*
+ * Creates files through io_uring without liburing. Every file is a linked chain of
+ * OPENAT into a direct descriptor slot, WRITE and CLOSE, so a whole batch of files is
+ * submitted and completed with a single io_uring_enter() and never enters the process
+ * file table.
+ */
+struct writer_uring;
+
+/*
+ * @param jobs the largest batch that will be run.
+ * Returns NULL when io_uring or direct descriptors are unavailable (kernel older than
+ * 5.19, io_uring disabled by sysctl or seccomp), the caller then writes synchronously.
+ */
+struct writer_uring* writer_uring_create(unsigned int jobs);
+/*
+ * Creates the @param count files of @param jobs, paths relative to @param dir_fd, and sets
+ * their error, failures are logged. Returns the number of jobs run, fewer than @param count
+ * once submitting to the ring failed: the ring is unusable from then on and the remaining
+ * jobs are left to the caller.
+ */
+unsigned int writer_uring_run(struct writer_uring* ring, int dir_fd, struct writer_job* jobs, unsigned int count,
+                              int open_flags, mode_t mode);
+void writer_uring_destroy(struct writer_uring* ring);
+
+#endif
@@ -1,8 +1,78 @@
+#define _GNU_SOURCE
 #include <string.h>
 #include <syslog.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "writer-uring.h"
+
+/*
+ * Usage: writer [-C DIR] [-u] [-s SIZE] [-f] [-D] [-y] [-m MODE] [-t] FILE STRING [FILE STRING ...]
+ *        writer [-C DIR] [-u] [-s SIZE] [-f] [-D] [-y] [-m MODE] [-t] -
+ *
+ * Writes every STRING to its FILE, or with "-" the files of a manifest read from standard
+ * input, one "FILE<TAB>STRING" per line. Relative paths are opened with openat() from
+ * DIR (the working directory by default) and the directory of the previous file is kept
+ * open, so files of one directory skip the path walk. With -u files are created in
+ * batches through io_uring when the kernel allows it.
+ *
+ * To use writer as a storage throughput tool:
+ *   -s SIZE  repeat STRING up to SIZE bytes (K, M and G suffixes), written from one block
+ *            buffer reused for every file
+ *   -f       preallocate SIZE bytes with fallocate() before writing
+ *   -D       O_DIRECT, the block buffer is page aligned and the unaligned tail of a file
+ *            is written through the page cache
+ *   -y       O_DSYNC, every write returns once the data is on stable storage
+ *   -m MODE  octal mode of created files, 0644 by default
+ *   -t       print the bytes, files and throughput to standard output
+ * -s, -f and -D write files one by one, -u then only applies without them.
+ */
+#define WRITER_BATCH 128
+#define WRITER_MODE 0644
+#define WRITER_OPEN_FLAGS (O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC)
+// O_DIRECT buffer, offset and length alignment, a multiple of common logical block sizes
+#define WRITER_ALIGN 4096
+#define WRITER_BLOCK (1024*1024)
+// largest block holding a whole number of STRING repetitions, beyond it they restart every block
+#define WRITER_BLOCK_MAX (16*1024*1024)
+
+struct write_options {
+    size_t size;
+    int preallocate;
+    int direct;
+    int dsync;
+    mode_t mode;
+    int report;
+};
+
+struct writer {
+    struct write_options options;
+    int open_flags;
+    int dir_fd;
+    struct writer_uring* ring;
+    struct writer_job jobs[WRITER_BATCH];
+    // manifest lines the jobs point into
+    char* lines[WRITER_BATCH];
+    unsigned int count;
+    unsigned int failed;
+    // directory of the last file written without io_uring
+    char* parent;
+    size_t parent_len;
+    int parent_fd;
+    // block of repeated STRING, period is the length of STRING when the block holds a whole
+    // number of repetitions, 0 when they restart every block
+    char* block;
+    size_t block_size;
+    size_t block_capacity;
+    size_t text_len;
+    size_t period;
+    unsigned long long bytes;
+    unsigned long long files;
+};
 
 int exitWriter(int code) {
     closelog();
@@ -10,44 +80,400 @@ int exitWriter(int code) {
     return code;
 }
 
-int main(int argc, char** argv) {
-    openlog(NULL, LOG_ODELAY, LOG_USER);
+static int usage() {
+    syslog(LOG_ERR, "Usage: writer [-C DIR] [-u] [-s SIZE] [-f] [-D] [-y] [-m MODE] [-t] <FILE> <STRING> [<FILE> <STRING> ...] | -");
+
+    return exitWriter(1);
+}
+
+// the directory to open the last component of @param path from, and that component in @param name
+static int parent_fd(struct writer* writer, const char* path, const char** name) {
+    const char* slash = strrchr(path, '/');
+
+    if (!slash) {
+        *name = path;
+        return writer->dir_fd;
+    }
+    *name = slash + 1;
+    size_t len = slash == path ? 1 : (size_t) (slash - path);
+    if (writer->parent && writer->parent_len == len && memcmp(writer->parent, path, len) == 0) {
+        return writer->parent_fd;
+    }
+
+    if (writer->parent) {
+        close(writer->parent_fd);
+        free(writer->parent);
+        writer->parent = NULL;
+    }
+    char* parent = strndup(path, len);
+    if (!parent) {
+        return -1;
+    }
+    int fd = openat(writer->dir_fd, parent, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        free(parent);
+        return -1;
+    }
+    writer->parent = parent;
+    writer->parent_len = len;
+    writer->parent_fd = fd;
+
+    return fd;
+}
+
+static int write_all(int fd, const char* text, size_t len) {
+    while (len > 0) {
+        ssize_t result = write(fd, text, len);
+        if (result == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        text += result;
+        len -= result;
+    }
+
+    return 0;
+}
+
+static size_t gcd(size_t a, size_t b) {
+    while (b != 0) {
+        size_t t = a % b;
+        a = b;
+        b = t;
+    }
+
+    return a;
+}
+
+/*
+ * Fills the block buffer with repetitions of @param text, unless it holds them already.
+ * The block is a multiple of both the text length and WRITER_ALIGN when that fits in
+ * WRITER_BLOCK_MAX, so consecutive blocks continue the repetition and O_DIRECT writes of
+ * whole blocks stay aligned.
+ */
+static int fill_block(struct writer* writer, const char* text, size_t len) {
+    if (writer->block && writer->text_len == len && len <= writer->block_size &&
+        memcmp(writer->block, text, len) == 0) {
+        return 0;
+    }
+
+    size_t unit = len / gcd(len, WRITER_ALIGN) * WRITER_ALIGN;
+    size_t size = unit;
+    writer->period = len;
+    if (unit > WRITER_BLOCK_MAX) {
+        // still one whole STRING per block, a file of a single repetition is written as is
+        size = (len + WRITER_ALIGN - 1) / WRITER_ALIGN * WRITER_ALIGN;
+        if (size < WRITER_BLOCK) {
+            size = WRITER_BLOCK;
+        }
+        writer->period = 0;
+    } else {
+        while (size < WRITER_BLOCK) {
+            size += unit;
+        }
+    }
+    if (size > writer->block_capacity) {
+        void* block;
+        if (posix_memalign(&block, WRITER_ALIGN, size) != 0) {
+            return -1;
+        }
+        free(writer->block);
+        writer->block = block;
+        writer->block_capacity = size;
+    }
+    writer->block_size = size;
+    writer->text_len = len;
+    for (size_t pos = 0; pos < size; pos += len) {
+        memcpy(writer->block + pos, text, size - pos < len ? size - pos : len);
+    }
+
+    return 0;
+}
 
-    if (argc <= 2) {
-        syslog(LOG_ERR, "Usage: write <FILE> <STRING>");
+// writes @param total bytes of repetitions from the block
+static int write_blocks(struct writer* writer, int fd, size_t total) {
+    int direct = writer->options.direct;
+    size_t done = 0;
 
-        return exitWriter(1);
+    while (done < total) {
+        size_t offset = writer->period ? done % writer->period : done % writer->block_size;
+        size_t n = writer->block_size - offset;
+        if (n > total - done) {
+            n = total - done;
+        }
+        if (direct && (offset % WRITER_ALIGN != 0 || n % WRITER_ALIGN != 0)) {
+            if (offset == 0 && n > WRITER_ALIGN) {
+                n -= n % WRITER_ALIGN;
+            } else {
+                // the unaligned tail goes through the page cache
+                int flags = fcntl(fd, F_GETFL);
+                if (flags == -1 || fcntl(fd, F_SETFL, flags & ~O_DIRECT) == -1) {
+                    return -1;
+                }
+                direct = 0;
+            }
+        }
+        if (write_all(fd, writer->block + offset, n) != 0) {
+            return -1;
+        }
+        done += n;
     }
 
-    const char* filename = argv[1];
-    const char* text = argv[2];
+    return 0;
+}
+
+static int write_file(struct writer* writer, const struct writer_job* job) {
+    const struct write_options* options = &writer->options;
+    size_t total = options->size ? options->size : job->len;
+    const char* name;
+    int dir_fd = parent_fd(writer, job->path, &name);
+    int fd = dir_fd == -1 ? -1 : openat(dir_fd, name, writer->open_flags, options->mode);
+
+    if (fd < 0) {
+        syslog(LOG_ERR, "Failure to write file %s: %s", job->path, strerror(errno));
+        return -1;
+    }
 
+    int rc = 0;
+    if (options->preallocate && total > 0 && fallocate(fd, 0, 0, total) != 0) {
+        if (errno == EOPNOTSUPP) {
+            syslog(LOG_WARNING, "Preallocation not supported for %s", job->path);
+        } else {
+            syslog(LOG_ERR, "Failure to preallocate file %s: %s", job->path, strerror(errno));
+            rc = -1;
+        }
+    }
+    if (rc == 0) {
+        if (options->size || options->direct) {
+            rc = fill_block(writer, job->text, job->len);
+            rc = rc ? rc : write_blocks(writer, fd, total);
+        } else {
+            rc = write_all(fd, job->text, job->len);
+        }
+        if (rc != 0) {
+            syslog(LOG_ERR, "Failure to write file %s: %s", job->path, strerror(errno));
+        }
+    }
+    if (close(fd) != 0 && rc == 0) {
+        syslog(LOG_ERR, "Failure to close file %s: %s", job->path, strerror(errno));
+        rc = -1;
+    }
+    if (rc == 0) {
+        writer->bytes += total;
+        writer->files++;
+    }
+
+    return rc;
+}
+
+static void flush(struct writer* writer) {
+    unsigned int run = 0;
+
+    if (writer->ring) {
+        run = writer_uring_run(writer->ring, writer->dir_fd, writer->jobs, writer->count,
+                               writer->open_flags, writer->options.mode);
+        for (unsigned int i = 0; i < run; i++) {
+            if (writer->jobs[i].error) {
+                writer->failed++;
+            } else {
+                writer->bytes += writer->jobs[i].len;
+                writer->files++;
+            }
+        }
+        if (run < writer->count) {
+            syslog(LOG_WARNING, "io_uring failed, writing the remaining files one by one");
+            writer_uring_destroy(writer->ring);
+            writer->ring = NULL;
+        }
+    }
+    for (unsigned int i = run; i < writer->count; i++) {
+        if (write_file(writer, &writer->jobs[i]) != 0) {
+            writer->failed++;
+        }
+    }
+    for (unsigned int i = 0; i < writer->count; i++) {
+        free(writer->lines[i]);
+        writer->lines[i] = NULL;
+    }
+    writer->count = 0;
+}
+
+/*
+ * Queues writing @param text to @param filename, the batch owns @param line (may be NULL).
+ */
+static void add_file(struct writer* writer, const char* filename, const char* text, char* line) {
     if (strlen(filename) == 0) {
         syslog(LOG_ERR, "Required parameter 'FILE' is blank.");
-
-        return exitWriter(1);
+        writer->failed++;
+        free(line);
+        return;
     }
     if (strlen(text) == 0) {
         syslog(LOG_ERR, "Required parameter 'STRING' is blank.");
-
-        return exitWriter(1);
+        writer->failed++;
+        free(line);
+        return;
     }
 
     syslog(LOG_DEBUG, "Writing <%s> to <%s>", text, filename);
 
-    int exitCode = 0;
-    int fd = open(filename, O_CREAT | O_TRUNC | O_WRONLY);
-    if (fd > 0) {
-        ssize_t result = write(fd, text, strlen(text));
-        if (result == -1) {
-            syslog(LOG_ERR, "Failure to write file: %s", strerror(errno));
-            exitCode = 1;
+    struct writer_job* job = &writer->jobs[writer->count];
+    job->path = filename;
+    job->text = text;
+    job->len = strlen(text);
+    writer->lines[writer->count] = line;
+    if (++writer->count == WRITER_BATCH) {
+        flush(writer);
+    }
+}
+
+static void read_manifest(struct writer* writer) {
+    size_t number = 0;
+
+    for (;;) {
+        char* line = NULL;
+        size_t size = 0;
+        ssize_t len = getline(&line, &size, stdin);
+        if (len < 0) {
+            free(line);
+            break;
         }
+        number++;
+        if (len > 0 && line[len - 1] == '\n') {
+            line[len - 1] = '\0';
+        }
+        char* tab = strchr(line, '\t');
+        if (!tab) {
+            syslog(LOG_ERR, "Malformed manifest line %zu, expected <FILE><TAB><STRING>", number);
+            writer->failed++;
+            free(line);
+            continue;
+        }
+        *tab = '\0';
+        add_file(writer, line, tab + 1, line);
+    }
+}
+
+// parses a byte count with an optional K, M or G suffix, returns 0 when invalid
+static size_t parse_size(const char* text) {
+    char* end;
+    unsigned long long size = strtoull(text, &end, 10);
 
-        close(fd);
+    switch (*end) {
+        case 'G': case 'g':
+            size <<= 10;
+            /* fall through */
+        case 'M': case 'm':
+            size <<= 10;
+            /* fall through */
+        case 'K': case 'k':
+            size <<= 10;
+            end++;
+            break;
+    }
+
+    return *end == '\0' ? size : 0;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char** argv) {
+    struct writer writer = { .dir_fd = AT_FDCWD, .options = { .mode = WRITER_MODE } };
+    int use_uring = 0;
+    int opt;
+    char* end;
+
+    openlog(NULL, LOG_ODELAY, LOG_USER);
+
+    while ((opt = getopt(argc, argv, "+C:us:fDym:t")) != -1) {
+        switch (opt) {
+            case 'C':
+                writer.dir_fd = open(optarg, O_PATH | O_DIRECTORY | O_CLOEXEC);
+                if (writer.dir_fd < 0) {
+                    syslog(LOG_ERR, "Failure to open directory %s: %s", optarg, strerror(errno));
+                    return exitWriter(1);
+                }
+                break;
+            case 'u':
+                use_uring = 1;
+                break;
+            case 's':
+                if ((writer.options.size = parse_size(optarg)) == 0) {
+                    syslog(LOG_ERR, "Invalid size %s", optarg);
+                    return exitWriter(1);
+                }
+                break;
+            case 'f':
+                writer.options.preallocate = 1;
+                break;
+            case 'D':
+                writer.options.direct = 1;
+                break;
+            case 'y':
+                writer.options.dsync = 1;
+                break;
+            case 'm':
+                writer.options.mode = strtoul(optarg, &end, 8);
+                if (*end != '\0' || writer.options.mode > 07777) {
+                    syslog(LOG_ERR, "Invalid mode %s", optarg);
+                    return exitWriter(1);
+                }
+                break;
+            case 't':
+                writer.options.report = 1;
+                break;
+            default:
+                return usage();
+        }
+    }
+    int args = argc - optind;
+    int manifest = args == 1 && strcmp(argv[optind], "-") == 0;
+    if (!manifest && (args < 2 || args % 2 != 0)) {
+        return usage();
+    }
+
+    writer.open_flags = WRITER_OPEN_FLAGS | (writer.options.direct ? O_DIRECT : 0) | (writer.options.dsync ? O_DSYNC : 0);
+    if (use_uring && (writer.options.size || writer.options.preallocate || writer.options.direct)) {
+        syslog(LOG_INFO, "-s, -f and -D write files one by one, ignoring -u");
+        use_uring = 0;
+    }
+    if (use_uring && !(writer.ring = writer_uring_create(WRITER_BATCH))) {
+        syslog(LOG_INFO, "io_uring unavailable, writing files one by one");
+    }
+
+    double start = now();
+
+    if (manifest) {
+        read_manifest(&writer);
     } else {
-        syslog(LOG_ERR, "Failure to write file: %s", strerror(errno));
+        for (int i = optind; i + 1 < argc; i += 2) {
+            add_file(&writer, argv[i], argv[i + 1], NULL);
+        }
     }
+    flush(&writer);
 
-    return exitWriter(exitCode);
-}
\ No newline at end of file
+    if (writer.options.report) {
+        double elapsed = now() - start;
+        printf("Wrote %llu bytes to %llu files in %.3f s, %.1f MiB/s\n", writer.bytes, writer.files, elapsed,
+               elapsed > 0 ? writer.bytes / elapsed / (1024 * 1024) : 0);
+    }
+
+    free(writer.block);
+    writer_uring_destroy(writer.ring);
+    if (writer.parent) {
+        close(writer.parent_fd);
+        free(writer.parent);
+    }
+    if (writer.dir_fd != AT_FDCWD) {
+        close(writer.dir_fd);
+    }
+
+    return exitWriter(writer.failed > 0 ? 1 : 0);
+}
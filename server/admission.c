@@ -0,0 +1,147 @@
+#include "admission.h"
+#include "metrics.h"
+#include "log.h"
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+static struct admission_config admission_cfg;
+static pthread_mutex_t admission_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t slot_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t bytes_cond = PTHREAD_COND_INITIALIZER;
+static unsigned int connections;
+// updated with atomics, the mutex is only taken to wait for or to signal the limit
+static size_t inflight;
+static unsigned int bytes_waiters;
+static int stopping;
+static int slot_fd = -1;
+
+int admission_init(const struct admission_config *cfg) {
+    admission_cfg = *cfg;
+    if (admission_cfg.max_connections > 0) {
+        slot_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (slot_fd < 0) {
+            aesd_syslog(LOG_ERR, "Failure to create eventfd: %s", strerror(errno));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void admission_shutdown() {
+    pthread_mutex_lock(&admission_mutex);
+    stopping = 1;
+    pthread_cond_broadcast(&slot_cond);
+    pthread_mutex_unlock(&admission_mutex);
+}
+
+int admission_try_connection() {
+    int admitted;
+
+    pthread_mutex_lock(&admission_mutex);
+    admitted = admission_cfg.max_connections == 0 || connections < admission_cfg.max_connections;
+    if (admitted) {
+        connections++;
+    }
+    pthread_mutex_unlock(&admission_mutex);
+
+    return admitted;
+}
+
+int admission_wait_connection() {
+    int rc = 0;
+
+    pthread_mutex_lock(&admission_mutex);
+    while (!stopping && admission_cfg.max_connections > 0 && connections >= admission_cfg.max_connections) {
+        pthread_cond_wait(&slot_cond, &admission_mutex);
+    }
+    if (stopping) {
+        rc = -1;
+    } else {
+        connections++;
+    }
+    pthread_mutex_unlock(&admission_mutex);
+
+    return rc;
+}
+
+void admission_release_connection() {
+    pthread_mutex_lock(&admission_mutex);
+    connections--;
+    pthread_cond_signal(&slot_cond);
+    pthread_mutex_unlock(&admission_mutex);
+
+    if (slot_fd >= 0) {
+        uint64_t one = 1;
+        if (write(slot_fd, &one, sizeof(one)) < 0) {
+            aesd_syslog(LOG_ERR, "Failure to signal eventfd: %s", strerror(errno));
+        }
+    }
+}
+
+int admission_fd() {
+    return slot_fd;
+}
+
+void admission_clear_fd() {
+    uint64_t count;
+    if (slot_fd >= 0 && read(slot_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        aesd_syslog(LOG_ERR, "Failure to read eventfd: %s", strerror(errno));
+    }
+}
+
+size_t admission_max_line() {
+    return admission_cfg.max_line;
+}
+
+static void stop_waiting_bytes(void *param) {
+    __atomic_sub_fetch(&bytes_waiters, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&admission_mutex);
+}
+
+void admission_wait_bytes() {
+    if (admission_cfg.max_inflight == 0 ||
+            __atomic_load_n(&inflight, __ATOMIC_SEQ_CST) < admission_cfg.max_inflight) {
+        return;
+    }
+    pthread_mutex_lock(&admission_mutex);
+    // announced before checking again, so a release crossing the limit sees it and signals
+    __atomic_add_fetch(&bytes_waiters, 1, __ATOMIC_SEQ_CST);
+    // pthread_cond_wait() is a cancellation point
+    pthread_cleanup_push(stop_waiting_bytes, NULL);
+    if (__atomic_load_n(&inflight, __ATOMIC_SEQ_CST) >= admission_cfg.max_inflight) {
+        metrics_add(METRIC_BACKPRESSURE_STALLS, 1);
+        while (__atomic_load_n(&inflight, __ATOMIC_SEQ_CST) >= admission_cfg.max_inflight) {
+            pthread_cond_wait(&bytes_cond, &admission_mutex);
+        }
+    }
+    pthread_cleanup_pop(1);
+}
+
+int admission_bytes_exhausted() {
+    return admission_cfg.max_inflight > 0 &&
+            __atomic_load_n(&inflight, __ATOMIC_SEQ_CST) >= admission_cfg.max_inflight;
+}
+
+void admission_add_bytes(size_t n) {
+    if (admission_cfg.max_inflight > 0) {
+        __atomic_add_fetch(&inflight, n, __ATOMIC_RELAXED);
+    }
+}
+
+void admission_release_bytes(size_t n) {
+    if (admission_cfg.max_inflight > 0 && n > 0) {
+        size_t before = __atomic_fetch_sub(&inflight, n, __ATOMIC_SEQ_CST);
+        // only the release going below the limit wakes the waiters up
+        if (before >= admission_cfg.max_inflight && before - n < admission_cfg.max_inflight &&
+                __atomic_load_n(&bytes_waiters, __ATOMIC_SEQ_CST) > 0) {
+            pthread_mutex_lock(&admission_mutex);
+            pthread_cond_broadcast(&bytes_cond);
+            pthread_mutex_unlock(&admission_mutex);
+        }
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef AESDSOCKET_ADMISSION_H
+#define AESDSOCKET_ADMISSION_H
+
+#include <stddef.h>
+
+/*
+ * Limits on what clients may hold in the server, 0 disables a limit.
+ *
+ * Connections over max_connections are left in the listen backlog until a slot frees
+ * up. A connection starting a new line waits while the line buffers of all connections
+ * hold max_inflight bytes or more, so it stops reading and TCP pushes back on the client.
+ * A line already started is always read to its end (at most max_line bytes), otherwise
+ * connections holding partial lines could wait on each other forever. While the budget
+ * is used up it is read no further than its end, the following lines stay in the socket.
+ */
+struct admission_config {
+    unsigned int max_connections;
+    size_t       max_line;
+    size_t       max_inflight;
+};
+
+int admission_init(const struct admission_config *cfg);
+/*
+ * Wakes up threads waiting for a connection slot, admission_wait_connection() fails
+ * from now on. Waits for in-flight bytes carry on, so connections can still drain.
+ */
+void admission_shutdown();
+
+/*
+ * Reserves a connection slot, returns 0 when all slots are taken.
+ */
+int admission_try_connection();
+/*
+ * Blocks until a connection slot is reserved, returns -1 after admission_shutdown().
+ */
+int admission_wait_connection();
+void admission_release_connection();
+/*
+ * eventfd becoming readable when a connection slot is released, for poll() loops
+ * waiting on admission_try_connection(). Read it with admission_clear_fd().
+ */
+int admission_fd();
+void admission_clear_fd();
+
+// max_line, or 0
+size_t admission_max_line();
+/*
+ * Blocks while the in-flight budget is used up. Call before reading the first bytes of a
+ * line. It is a cancellation point.
+ */
+void admission_wait_bytes();
+// 1 while the in-flight budget is used up, a started line must then only be finished
+int admission_bytes_exhausted();
+// accounts bytes buffered in a line buffer, and releases them once committed or dropped
+void admission_add_bytes(size_t n);
+void admission_release_bytes(size_t n);
+
+#endif
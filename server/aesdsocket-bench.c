@@ -0,0 +1,414 @@
+/*
+ * Load generator for aesdsocket.
+ *
+ * Opens N connections (one thread each), sends uniquely tagged lines and waits for
+ * every line to come back in the echoed data stream.  Works against both data file
+ * and char device builds of the server since the echo always contains the line just
+ * committed.
+ *
+ * Closed loop (default): each connection sends the next line as soon as the previous
+ * echo arrived.  Open loop (-r): lines are sent at a fixed rate per connection whether
+ * or not their echoes arrived, a second thread per connection reads the echoes, and
+ * latency is measured from the scheduled send time, so queueing delay is not hidden.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "../aesd-char-driver/aesd-ring-buffer.h"
+
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_PORT "9000"
+#define MIN_LINE_SIZE 24
+#define RECV_BUFFER_SIZE (64*1024)
+#define RECV_TIMEOUT_SEC 10
+#define NSEC_PER_SEC 1000000000ULL
+// open loop lines sent and not echoed yet, the sender waits when this many are outstanding
+#define INFLIGHT_LINES 1024
+#define RING_POLL_NS 10000
+
+AESD_SPSC_RING_DECLARE(sent_ring, uint64_t, INFLIGHT_LINES)
+
+struct bench_config {
+    const char* host;
+    const char* port;
+    int         connections;
+    long        lines;
+    size_t      line_size;
+    double      rate;
+    int         duration;
+};
+
+/*
+ * Echo data read but not matched yet, a line found in it is consumed together with
+ * everything before it.
+ */
+struct echo_stream {
+    char*               window;
+    size_t              len;
+};
+
+struct bench_worker {
+    pthread_t           thread_id;
+    int                 index;
+    struct bench_config* cfg;
+    int                 fd;
+    uint64_t*           latencies;
+    long                completed;
+    long                errors;
+    long                receive_errors;
+    uint64_t            bytes_sent;
+    uint64_t            bytes_received;
+    // open loop: scheduled send times of the lines sent, in order, consumed by the receiver
+    struct sent_ring*   sent;
+    bool                sender_done;
+};
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void sleep_until_ns(uint64_t deadline) {
+    struct timespec ts = { .tv_sec = deadline / NSEC_PER_SEC, .tv_nsec = deadline % NSEC_PER_SEC };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+static int connect_server(const char* host, const char* port) {
+    struct addrinfo hints, *addr, *it;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int rc = getaddrinfo(host, port, &hints, &addr);
+    if (rc != 0) {
+        fprintf(stderr, "Failure to resolve %s:%s - %s\n", host, port, gai_strerror(rc));
+        return -1;
+    }
+    int fd = -1;
+    for (it = addr; it != NULL; it = it->ai_next) {
+        fd = socket(it->ai_family, it->ai_socktype, it->ai_protocol);
+        if (fd < 0) continue;
+        if (connect(fd, it->ai_addr, it->ai_addrlen) == 0) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(addr);
+    if (fd < 0) {
+        fprintf(stderr, "Failure to connect to %s:%s - %s\n", host, port, strerror(errno));
+        return -1;
+    }
+
+    struct timeval tv = { .tv_sec = RECV_TIMEOUT_SEC, .tv_usec = 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return fd;
+}
+
+/*
+ * Tag is fixed width so no line is a prefix of another one, padding fills the line up to line_size
+ */
+static void make_line(char* line, size_t line_size, int conn, long seq) {
+    int n = snprintf(line, line_size, "bench-c%05d-s%010ld-", conn, seq);
+    memset(line + n, 'x', line_size - n - 1);
+    line[line_size - 1] = '\n';
+}
+
+static int send_all(int fd, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Reads the echo stream until @param line shows up. Data after the line stays in @param echo
+ * for the next line, and the last line_size-1 bytes of a chunk without it are carried over so
+ * a line split across recv() calls is still found.
+ * Returns 0 when found, -1 on error, timeout or connection close.
+ */
+static int await_echo(struct bench_worker* w, struct echo_stream* echo, const char* line, size_t line_size) {
+    for (;;) {
+        char* found = memmem(echo->window, echo->len, line, line_size);
+        if (found != NULL) {
+            size_t used = found + line_size - echo->window;
+            echo->len -= used;
+            memmove(echo->window, echo->window + used, echo->len);
+            return 0;
+        }
+        size_t carry = echo->len < line_size - 1 ? echo->len : line_size - 1;
+        memmove(echo->window, echo->window + echo->len - carry, carry);
+        echo->len = carry;
+
+        ssize_t n = recv(w->fd, echo->window + echo->len, RECV_BUFFER_SIZE, 0);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            return -1;
+        }
+        w->bytes_received += n;
+        echo->len += n;
+    }
+}
+
+/*
+ * Open loop receiver: matches the echo of every line the sender pushed to w->sent, in order,
+ * and records its latency from the scheduled send time.
+ */
+static void* bench_receiver_run(void* param) {
+    struct bench_worker* w = (struct bench_worker*) param;
+    struct bench_config* cfg = w->cfg;
+    struct echo_stream echo = { .window = malloc(RECV_BUFFER_SIZE + cfg->line_size), .len = 0 };
+    char* line = malloc(cfg->line_size);
+    if (echo.window == NULL || line == NULL) {
+        w->receive_errors++;
+        // the sender notices the receiver is gone when its sends fail
+        shutdown(w->fd, SHUT_RDWR);
+        goto on_exit;
+    }
+
+    for (long seq = 0; ; seq++) {
+        uint64_t sent_at;
+        while (!sent_ring_pop(w->sent, &sent_at)) {
+            if (__atomic_load_n(&w->sender_done, __ATOMIC_ACQUIRE)) {
+                // done is set after the last push, check the ring once more
+                if (!sent_ring_pop(w->sent, &sent_at)) goto on_exit;
+                break;
+            }
+            sleep_until_ns(now_ns() + RING_POLL_NS);
+        }
+
+        make_line(line, cfg->line_size, w->index, seq);
+        if (await_echo(w, &echo, line, cfg->line_size) != 0) {
+            w->receive_errors++;
+            shutdown(w->fd, SHUT_RDWR);
+            break;
+        }
+        w->latencies[w->completed++] = now_ns() - sent_at;
+    }
+
+on_exit:
+    free(line);
+    free(echo.window);
+    return w;
+}
+
+/*
+ * Open loop sender: sends every line at its scheduled time, without waiting for echoes.
+ * It only waits when INFLIGHT_LINES lines are still unmatched by the receiver.
+ */
+static void bench_send_open_loop(struct bench_worker* w, char* line, uint64_t interval, uint64_t start, uint64_t stop) {
+    struct bench_config* cfg = w->cfg;
+    pthread_t receiver;
+
+    int rc = pthread_create(&receiver, NULL, bench_receiver_run, w);
+    if (rc != 0) {
+        fprintf(stderr, "Failure to create receiver thread. Error code: %d\n", rc);
+        w->errors++;
+        return;
+    }
+
+    for (long seq = 0; seq < cfg->lines; seq++) {
+        uint64_t sent_at = start + seq * interval;
+        if (sent_at >= stop) break;
+        if (sent_at > now_ns()) sleep_until_ns(sent_at);
+
+        make_line(line, cfg->line_size, w->index, seq);
+        if (send_all(w->fd, line, cfg->line_size) != 0) {
+            w->errors++;
+            // wakes the receiver blocked on the echo of a line that will not come
+            shutdown(w->fd, SHUT_RDWR);
+            break;
+        }
+        w->bytes_sent += cfg->line_size;
+        while (!sent_ring_push(w->sent, &sent_at)) {
+            sleep_until_ns(now_ns() + RING_POLL_NS);
+        }
+    }
+    __atomic_store_n(&w->sender_done, true, __ATOMIC_RELEASE);
+    pthread_join(receiver, NULL);
+}
+
+static void* bench_worker_run(void* param) {
+    struct bench_worker* w = (struct bench_worker*) param;
+    struct bench_config* cfg = w->cfg;
+
+    uint64_t interval = cfg->rate > 0 ? (uint64_t)(NSEC_PER_SEC / cfg->rate) : 0;
+    char* line = malloc(cfg->line_size);
+    struct echo_stream echo = { .window = NULL, .len = 0 };
+    if (interval > 0) {
+        w->sent = malloc(sizeof(*w->sent));
+        if (w->sent != NULL) sent_ring_init(w->sent);
+    } else {
+        echo.window = malloc(RECV_BUFFER_SIZE + cfg->line_size);
+    }
+    w->fd = connect_server(cfg->host, cfg->port);
+    if (w->fd < 0 || line == NULL || (interval > 0 ? w->sent == NULL : echo.window == NULL)) {
+        w->errors++;
+        goto on_exit;
+    }
+
+    uint64_t start = now_ns();
+    uint64_t stop = cfg->duration > 0 ? start + (uint64_t)cfg->duration * NSEC_PER_SEC : UINT64_MAX;
+
+    if (interval > 0) {
+        bench_send_open_loop(w, line, interval, start, stop);
+        goto on_exit;
+    }
+
+    for (long seq = 0; seq < cfg->lines; seq++) {
+        uint64_t sent_at = now_ns();
+        if (sent_at >= stop) break;
+
+        make_line(line, cfg->line_size, w->index, seq);
+        if (send_all(w->fd, line, cfg->line_size) != 0) {
+            w->errors++;
+            break;
+        }
+        w->bytes_sent += cfg->line_size;
+
+        if (await_echo(w, &echo, line, cfg->line_size) != 0) {
+            w->errors++;
+            break;
+        }
+        w->latencies[w->completed++] = now_ns() - sent_at;
+    }
+
+on_exit:
+    if (w->fd >= 0) close(w->fd);
+    free(w->sent);
+    free(echo.window);
+    free(line);
+    return w;
+}
+
+static int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const uint64_t* sorted, long count, double pct) {
+    if (count == 0) return 0;
+    long i = (long)(pct / 100.0 * (count - 1) + 0.5);
+    return sorted[i] / 1000.0;
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+        "Usage: %s [-H host] [-p port] [-c connections] [-n lines] [-s line_size] [-r rate] [-t seconds]\n"
+        "  -c  number of concurrent connections, one thread each (default 1)\n"
+        "  -n  lines to send per connection (default 1000)\n"
+        "  -s  line size in bytes including the newline (default 64, minimum %d)\n"
+        "  -r  open loop: send this many lines per second per connection without waiting\n"
+        "      for their echoes (default closed loop)\n"
+        "  -t  stop after this many seconds\n"
+        "Run once against a server built with USE_AESD_CHAR_DEVICE=0 and once with the default\n"
+        "char device build to compare both data paths.\n", prog, MIN_LINE_SIZE);
+}
+
+int main(int argc, char** argv) {
+    struct bench_config cfg = {
+        .host = DEFAULT_HOST, .port = DEFAULT_PORT,
+        .connections = 1, .lines = 1000, .line_size = 64, .rate = 0, .duration = 0,
+    };
+    int opt;
+
+    while ((opt = getopt(argc, argv, "H:p:c:n:s:r:t:")) != -1) {
+        switch (opt) {
+            case 'H': cfg.host = optarg; break;
+            case 'p': cfg.port = optarg; break;
+            case 'c': cfg.connections = atoi(optarg); break;
+            case 'n': cfg.lines = atol(optarg); break;
+            case 's': cfg.line_size = strtoul(optarg, NULL, 10); break;
+            case 'r': cfg.rate = atof(optarg); break;
+            case 't': cfg.duration = atoi(optarg); break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (cfg.connections <= 0 || cfg.lines <= 0 || cfg.line_size < MIN_LINE_SIZE) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    struct bench_worker* workers = calloc(cfg.connections, sizeof(*workers));
+    if (workers == NULL) {
+        fprintf(stderr, "Failure to allocate %d workers\n", cfg.connections);
+        return EXIT_FAILURE;
+    }
+    uint64_t start = now_ns();
+    int started = 0;
+    for (int i = 0; i < cfg.connections; i++) {
+        workers[i].index = i;
+        workers[i].cfg = &cfg;
+        workers[i].fd = -1;
+        workers[i].latencies = malloc(cfg.lines * sizeof(uint64_t));
+        if (workers[i].latencies == NULL) {
+            fprintf(stderr, "Failure to allocate latencies of %ld lines\n", cfg.lines);
+            break;
+        }
+        int rc = pthread_create(&workers[i].thread_id, NULL, bench_worker_run, &workers[i]);
+        if (rc != 0) {
+            fprintf(stderr, "Failure to create thread. Error code: %d\n", rc);
+            free(workers[i].latencies);
+            break;
+        }
+        started++;
+    }
+
+    long completed = 0, errors = 0;
+    uint64_t sent = 0, received = 0;
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i].thread_id, NULL);
+        completed += workers[i].completed;
+        errors += workers[i].errors + workers[i].receive_errors;
+        sent += workers[i].bytes_sent;
+        received += workers[i].bytes_received;
+    }
+    double elapsed = (now_ns() - start) / (double) NSEC_PER_SEC;
+
+    uint64_t* all = malloc((completed > 0 ? completed : 1) * sizeof(uint64_t));
+    long k = 0;
+    for (int i = 0; i < started; i++) {
+        if (all != NULL) {
+            memcpy(all + k, workers[i].latencies, workers[i].completed * sizeof(uint64_t));
+            k += workers[i].completed;
+        }
+        free(workers[i].latencies);
+    }
+    if (all == NULL) {
+        fprintf(stderr, "Failure to allocate latencies of %ld lines\n", completed);
+        free(workers);
+        return EXIT_FAILURE;
+    }
+    qsort(all, completed, sizeof(uint64_t), compare_u64);
+
+    printf("connections: %d  line size: %zu  mode: %s\n", started, cfg.line_size,
+            cfg.rate > 0 ? "open loop" : "closed loop");
+    printf("lines: %ld ok, %ld errors in %.3f s\n", completed, errors, elapsed);
+    printf("throughput: %.1f lines/s, %.2f MB/s sent, %.2f MB/s received\n",
+            completed / elapsed, sent / elapsed / 1e6, received / elapsed / 1e6);
+    printf("latency us: p50 %.1f  p99 %.1f  p999 %.1f  max %.1f\n",
+            percentile_us(all, completed, 50), percentile_us(all, completed, 99),
+            percentile_us(all, completed, 99.9), completed ? all[completed - 1] / 1000.0 : 0);
+
+    free(all);
+    free(workers);
+
+    return errors == 0 && started == cfg.connections ? EXIT_SUCCESS : EXIT_FAILURE;
+}
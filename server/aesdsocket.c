@@ -10,57 +10,58 @@
 #include <syslog.h>
 #include <signal.h>
 #include <time.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sched.h>
+#include <stdint.h>
 #include "aesdsocket.h"
 #include "datafile.h"
+#include "metrics.h"
+#include "log.h"
+#include "binproto.h"
+#include "compress.h"
 
 #define SERVER_PORT "9000"
 #define LISTEN_BACKLOG 10
+#define MAX_ACCEPTORS 64
 #define NEWLINE '\n'
 #define ISO_2822_TIME_FMT "%a, %d %b %Y %T %z"
-
-int server_fd;
-timer_t timer_id;
+#define TIMESTAMP_INTERVAL 10
+#define DRAIN_TIMEOUT 5000
+#define DRAIN_POLL_INTERVAL 100
+
+int listen_fds[MAX_ACCEPTORS];
+int listen_count;
+int binary_listen_fd = -1;
+pthread_t acceptor_threads[MAX_ACCEPTORS];
+// CPUs the process may run on, connection threads get all of them back from pinned acceptors
+cpu_set_t process_cpus;
+pthread_attr_t connection_attr;
+pthread_attr_t *connection_attrp;
+int timer_fd = -1;
+int signal_fd = -1;
 pthread_mutex_t mutex;
 volatile sig_atomic_t stopApp;
+int draining;
+struct aesdsocket_config config = {
+    .listen_backlog = LISTEN_BACKLOG,
+    .drain_timeout = DRAIN_TIMEOUT,
+};
 
 void cleanup() {
-    if (server_fd > 0) {
-        close(server_fd);
+    for (int i = 0; i < listen_count; i++) {
+        close(listen_fds[i]);
+    }
+    if (binary_listen_fd >= 0) {
+        close(binary_listen_fd);
     }
 
     destroy_datafile();
+    log_stop();
     closelog();
 }
 
-static void signal_handler(int signum) {
-    if (signum == SIGINT || signum == SIGTERM) {
-        stopApp = 1;
-        syslog(LOG_DEBUG, "%s", "Caught signal, exiting");
-
-        if (server_fd > 0) {
-            while (shutdown(server_fd, SHUT_RDWR) == -1) {
-                syslog(LOG_ERR, "Server socket shutdown error: %s", strerror(errno));
-            }
-            close(server_fd);
-        }
-        // delete timer
-        if (timer_id && timer_delete(timer_id) != 0) {
-            syslog(LOG_ERR, "Failure to delete timer: %s", strerror(errno));
-        }
-
-        // looping thru connections and terminate threads
-        clientconn_info *conn;
-        SLIST_FOREACH(conn, &connections, next) {
-            pthread_cancel(conn->thread_id);
-        }
-        cleanup_term_conn(1);
-        pthread_mutex_destroy(&mutex);
-
-        destroy_datafile();
-        closelog();
-    }
-}
-
 void make_daemon() {
     // we can use daemon syscall or use two-fork approach
     int pid = fork();
@@ -93,194 +94,313 @@ void make_daemon() {
 int send_response(int data_fd, int client_fd) {
     char readbuf[1024*100];
     int m;
-    // position to the beginning
-    adjust_datafile_pos(data_fd, 0, SEEK_SET);
-
-    while((m = read(data_fd, readbuf, sizeof(readbuf))) > 0) {
-        int rc = send(client_fd, readbuf, m, 0);
+    // from the beginning of the retained log
+    off_t pos = datafile_begin();
+
+    for (;;) {
+        // fill the buffer across segment (or char device entry) boundaries, small sends stall on Nagle
+        size_t filled = 0;
+        while (filled < sizeof(readbuf) && (m = read_datafile(data_fd, &pos, readbuf + filled, sizeof(readbuf) - filled)) > 0) {
+            filled += m;
+        }
+        if (filled == 0) {
+            break;
+        }
+        int rc = send(client_fd, readbuf, filled, 0);
         if (rc < 0) {
             return rc;
         }
+        metrics_add(METRIC_BYTES_SENT, rc);
     }
 
     return 0;
 }
 
+/*
+ * Commits the complete line in args->buffer and echoes the data file back.
+ * Returns 0 on success, -1 when the connection has to be closed.
+ */
+static int commit_line(struct aesdsocketclientconn* args, int data_fd, size_t buflen) {
+    uint64_t line_ready = metrics_now_ns();
+    int rc = pthread_mutex_lock(args->mutex);
+    if (rc != 0) {
+        aesd_syslog(LOG_ERR, "Failure to lock mutex with error code: %d", rc);
+        return -1;
+    }
+    metrics_observe_ns(METRIC_LOCK_WAIT, metrics_now_ns() - line_ready);
+    // append to the data file, unless the line negotiates the echo compression
+    int method = compress_parse_command(args->buffer, buflen);
+    off_t commit_end = 0;
+    if (method < 0) {
+        commit_end = append_datafile(data_fd, args->buffer, buflen);
+        metrics_add(METRIC_LINES_COMMITTED, 1);
+    } else {
+        args->compress = method;
+    }
+    args->buffer[0] = '\0'; // make string empty!
+    connection_committed(args, buflen);
+
+    if (config.datafile.durability == DURABILITY_BATCH && commit_end > 0) {
+        // group commit: other connections keep appending while the sync thread flushes
+        pthread_mutex_unlock(args->mutex);
+        datafile_wait_durable(commit_end);
+        if ((rc = pthread_mutex_lock(args->mutex)) != 0) {
+            aesd_syslog(LOG_ERR, "Failure to lock mutex with error code: %d", rc);
+            return -1;
+        }
+    }
+
+    if (method >= 0) {
+        rc = send_compress_reply(args->client_fd, method);
+    } else if (args->compress == COMPRESS_LZ4) {
+        rc = send_compressed_response(data_fd, args->client_fd);
+    } else {
+        rc = send_response(data_fd, args->client_fd);
+    }
+    if (rc < 0) {
+        aesd_syslog(LOG_ERR, "Failure to send response to the client - %s", args->client_ip_addr);
+        return -1;
+    }
+    if ((rc = pthread_mutex_unlock(args->mutex)) != 0) {
+        aesd_syslog(LOG_ERR, "Failure to unlock mutex. Error code: %d", rc);
+        return -1;
+    }
+    metrics_observe_ns(METRIC_ECHO_LATENCY, metrics_now_ns() - line_ready);
+    return 0;
+}
+
+/*
+ * Number of bytes to read so that the started line is finished but the next one is not
+ * started, looked up with MSG_PEEK. At most @param size.
+ */
+static size_t line_rest(int client_fd, char* buf, size_t size) {
+    ssize_t n = recv(client_fd, buf, size, MSG_PEEK);
+    if (n <= 0) {
+        // the recv() that follows reports it
+        return size;
+    }
+    char* nl = memchr(buf, NEWLINE, n);
+    return nl ? (size_t)(nl - buf) + 1 : (size_t) n;
+}
+
 void* connnection_handler(void* param) {
-    struct aesdsocketclientconn* args = (struct aesdsocketclientconn *) param;
+    clientconn_info* info = (clientconn_info *) param;
+    struct aesdsocketclientconn* args = &info->conn;
 
-    pthread_cleanup_push(connection_cleanup, args);
+    pthread_cleanup_push(connection_cleanup, info);
 
-    syslog(LOG_DEBUG, "Accepted connection from %s", args->client_ip_addr);
+    aesd_syslog(LOG_DEBUG, "Accepted connection from %s", args->client_ip_addr);
 
-    size_t maxbuflen = args->init_buffer_size;
     char recv_buf[BUFFER_SIZE];
     int n;
     size_t buflen = 0;
-    *args->buffer[0] = '\0';
+    int closing = 0;
+
+    // char device connections keep their own descriptor, its position is moved by AESDCHAR_IOCSEEKTO
+    int data_fd = open_datafile();
+    if (data_fd < 0) {
+        pthread_exit(args);
+    }
+    args->data_fd = data_fd;
+
+    while (!closing) {
+        size_t want = sizeof(recv_buf);
+        // a new line only starts while the in-flight budget allows it, otherwise leave it in the socket
+        if (buflen == 0) {
+            admission_wait_bytes();
+        } else if (admission_bytes_exhausted()) {
+            want = line_rest(args->client_fd, recv_buf, sizeof(recv_buf));
+        }
+        if ((n = recv(args->client_fd, recv_buf, want, 0)) <= 0) {
+            break;
+        }
+        metrics_add(METRIC_BYTES_RECEIVED, n);
+        connection_received(args, n);
 
-    while((n = recv(args->client_fd, recv_buf, sizeof(recv_buf), 0)) > 0) {
-        int data_fd = open_datafile();
-        args->data_fd = data_fd;
-        if (adjust_datafile_pos(data_fd, 0, SEEK_END) > -1) {
+        // a pipelining client sends several lines per chunk, commit all of them before reading more
+        char* chunk = recv_buf;
+        while (n > 0) {
             // locate position of newline
             int k = 0;
             int has_nl = 0;
-            for (; k < n; k++) if (recv_buf[k] == NEWLINE) {
+            for (; k < n; k++) if (chunk[k] == NEWLINE) {
                 has_nl = 1;
                 break;
             }
-            int currlen = n;
-            if (k+1 < n) {
-                currlen = k+1;
-            }
+            int currlen = has_nl ? k+1 : n;
 
-            append_string(args->buffer, &maxbuflen, buflen, recv_buf, currlen);
+            size_t max_line = admission_max_line();
+            if (max_line > 0 && buflen + currlen > max_line) {
+                aesd_syslog(LOG_WARNING, "Line from %s exceeds %zu bytes, closing connection", args->client_ip_addr, max_line);
+                metrics_add(METRIC_LINES_REJECTED, 1);
+                closing = 1;
+                break;
+            }
+            if (connpool_append(args, buflen, chunk, currlen) != 0) {
+                aesd_syslog(LOG_ERR, "Failure to grow the line buffer of %s, closing connection", args->client_ip_addr);
+                closing = 1;
+                break;
+            }
             buflen += currlen;
+            chunk += currlen;
+            n -= currlen;
 
             if (has_nl) {
-                int rc = pthread_mutex_lock(args->mutex);
-                if (rc != 0) {
-                    syslog(LOG_ERR, "Failure to lock mutex with error code: %d", rc);
+                // data file position will be EOF and the rest of the chunk starts a new line
+                if (commit_line(args, data_fd, buflen) != 0) {
+                    closing = 1;
                     break;
                 }
-                // append to the data file
-                append_datafile(data_fd, *args->buffer, strlen(*args->buffer));
-                *args->buffer[0] = '\0'; // make string empty!
                 buflen = 0;
-
-                rc = send_response(data_fd, args->client_fd);
-                if (rc < 0) {
-                    syslog(LOG_ERR, "Failure to send response to the client - %s", args->client_ip_addr);
-                    break;
-                }
-                if ((rc = pthread_mutex_unlock(args->mutex)) != 0) {
-                    syslog(LOG_ERR, "Failure to unlock mutex. Error code: %d", rc);
-                    break;
-                }
-                // data file position will be EOF and we can copy any bytes after NEWLINE
-                if (k < n) {
-                    buflen = n-k-1;
-                    append_string(args->buffer, &maxbuflen, buflen, &recv_buf[k+1], buflen);
-                }
             }
-        } else {
-            syslog(LOG_ERR, "Failure to reposition cursor in the data file %d to the EOF", data_fd);
-            break;
         }
     }
 
     pthread_cleanup_pop(1);
 
-    return args;
+    return NULL;
+}
+
+void connection_received(struct aesdsocketclientconn *conn, size_t n) {
+    admission_add_bytes(n);
+    __atomic_add_fetch(&conn->buffered, n, __ATOMIC_SEQ_CST);
+}
+
+void connection_committed(struct aesdsocketclientconn *conn, size_t n) {
+    admission_release_bytes(n);
+    // drain_connections() sets draining before it looks at buffered, one of us sees the other
+    if (__atomic_sub_fetch(&conn->buffered, n, __ATOMIC_SEQ_CST) == 0 && __atomic_load_n(&draining, __ATOMIC_SEQ_CST)) {
+        // shutdown skipped this connection while it held a partial line
+        shutdown(conn->client_fd, SHUT_RD);
+    }
 }
 
 void connection_cleanup(void* param) {
-    struct aesdsocketclientconn* args = (struct aesdsocketclientconn *)param;
-    
+    clientconn_info* info = (clientconn_info *) param;
+    struct aesdsocketclientconn* args = &info->conn;
+
+    // close() is a cancellation point, a late cancel must not cut the cleanup short
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    // the descriptor number may be reused as soon as it is closed
+    registry_closing(info->handle);
     close(args->client_fd);
-    syslog(LOG_DEBUG, "Closed connection from %s", args->client_ip_addr);
+    metrics_add(METRIC_CONNECTIONS_CLOSED, 1);
+    aesd_syslog(LOG_DEBUG, "Closed connection from %s", args->client_ip_addr);
     if (args->data_fd) {
         close_datafile(args->data_fd);
     }
-    free(*args->buffer);
-    free(args->buffer);
-    free(args->client_ip_addr);
+    connpool_release_buffer(args);
     pthread_mutex_unlock(args->mutex); // don't need to handle failures since mutex is PTHREAD_MUTEX_ERRORCHECK
+    admission_release_bytes(args->buffered);
+    admission_release_connection();
+
+    registry_handle handle = info->handle;
+    connpool_put(info);
+    // last, shutdown waits for the registry to empty before tearing the pool down
+    registry_remove(handle);
 }
 
-void accept_conn() {
+void accept_conn(int listen_fd, void *(*handler)(void *)) {
     struct sockaddr client_addr;
     socklen_t client_addr_len = sizeof(client_addr);
 
-    int client_fd = accept(server_fd, &client_addr, &client_addr_len);
+    int client_fd = accept(listen_fd, &client_addr, &client_addr_len);
     if (client_fd == -1) {
-        syslog(LOG_ERR, "Failed to accept connection: %s", strerror(errno));
+        // the client poll() reported may have reset the connection before we got to it
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED) {
+            aesd_syslog(LOG_ERR, "Failed to accept connection: %s", strerror(errno));
+        }
+        admission_release_connection();
+        return;
+    }
+    clientconn_info* conn = connpool_get();
+    if (conn == NULL) {
+        aesd_syslog(LOG_ERR, "Failure to allocate a connection, rejecting the client");
+        close(client_fd);
+        admission_release_connection();
         return;
     }
+    struct aesdsocketclientconn* conn_data = &conn->conn;
     // get client ip
     struct sockaddr_in *client_inaddr = (struct sockaddr_in *) &client_addr;
-    char *client_ip_addr = inet_ntoa(client_inaddr->sin_addr);
-
-    pthread_t thread_id;
-    struct aesdsocketclientconn* conn_data = malloc(sizeof *conn_data);
+    inet_ntop(AF_INET, &client_inaddr->sin_addr, conn_data->client_ip_addr, sizeof(conn_data->client_ip_addr));
     conn_data->mutex = &mutex;
     conn_data->client_fd = client_fd;
-    conn_data->client_ip_addr = malloc(strlen(client_ip_addr)+1);
-    strcpy(conn_data->client_ip_addr, client_ip_addr);
     conn_data->data_fd = 0;
-    conn_data->init_buffer_size = BUFFER_SIZE;
-    conn_data->buffer = malloc(sizeof(char *));
-    *conn_data->buffer = malloc(BUFFER_SIZE);
+    conn_data->buffered = 0;
+    conn_data->compress = COMPRESS_NONE;
+
+    conn->handle = registry_add(conn);
+    if (conn->handle == 0) {
+        aesd_syslog(LOG_ERR, "Failure to register connection from %s", conn_data->client_ip_addr);
+        close(client_fd);
+        connpool_put(conn);
+        admission_release_connection();
+        return;
+    }
 
-    int rc = pthread_create(&thread_id, NULL, connnection_handler, conn_data);
+    pthread_t thread_id;
+    int rc = pthread_create(&thread_id, connection_attrp, handler, conn);
     if (rc != 0) {
-        syslog(LOG_ERR, "Failure to create thread. Error code: %d", rc);        
-        free(conn_data);
+        aesd_syslog(LOG_ERR, "Failure to create thread. Error code: %d", rc);        
+        close(client_fd);
+        registry_remove(conn->handle);
+        connpool_put(conn);
+        admission_release_connection();
     } else {
-        // track thread for later monitoring
-        clientconn_info* conn = malloc(sizeof(*conn));
-        conn->thread_id = thread_id;
-        conn->ref = conn_data;
-        // conn->conn_status = conn_data->status;
-        SLIST_INSERT_HEAD(&connections, conn, next);
-        // look thru LL and determine if any connections has ended
-        cleanup_term_conn(0);
+        metrics_add(METRIC_CONNECTIONS_ACCEPTED, 1);
+        // nobody joins connection threads, they clean up after themselves
+        pthread_detach(thread_id);
+        registry_started(conn->handle, thread_id);
     }
 }
 
-void cleanup_term_conn(int await_termination) {
-    clientconn_info *item, *tmp_item;
-
-    SLIST_FOREACH_SAFE(item, &connections, next, tmp_item) {
-        // try join
-        int rc;
-        if (await_termination != 0) {
-            rc = pthread_join(item->thread_id, NULL);
-        } else {
-            rc = pthread_tryjoin_np(item->thread_id, NULL);
-        }
-        if (rc == 0) {
-            SLIST_REMOVE(&connections, item, _clientconn_info, next);
-            free(item->ref);
-            free(item);
-        }
-    }
-}
-
-int register_sighandlers() {
-    struct sigaction app_action;
-    memset(&app_action, 0, sizeof(sigaction));
-    app_action.sa_handler = signal_handler;
-    sigemptyset (&app_action.sa_mask);
-    app_action.sa_flags = 0;
-
-    if (sigaction(SIGTERM, &app_action, NULL) != 0) {
-        perror("Failure to register SIGTERM handler");
-        return -1;
-    }
-    if (sigaction(SIGINT, &app_action, NULL) != 0) {
-        perror("Failure to register SIGINT handler");
+/*
+ * Blocks SIGINT and SIGTERM and opens a signalfd for them. Every thread created later
+ * inherits the mask, so the signals are only seen as the signalfd becoming readable.
+ */
+int create_signalfd() {
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+
+    signal_fd = signalfd(-1, &stop_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd < 0) {
+        aesd_syslog(LOG_ERR, "Failure to create signalfd: %s", strerror(errno));
         return -1;
     }
 
     return 0;
 }
 
-int start_server(const char *port, int as_daemon) {
+// returns 1 when a stop signal is pending on the signalfd
+static int read_signal() {
+    struct signalfd_siginfo info;
+    return read(signal_fd, &info, sizeof(info)) == sizeof(info);
+}
 
-    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd < 0) {
-        syslog(LOG_ERR, "%s", "Failure to open socket");
-        cleanup();
-        exit(EXIT_FAILURE);
+int open_listener(const char *port, int backlog, int reuseport) {
+    // non-blocking, accept() after poll() must not wait when the pending client is gone;
+    // accepted sockets do not inherit the flag
+    int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (listen_fd < 0) {
+        aesd_syslog(LOG_ERR, "%s", "Failure to open socket");
+        return -1;
     }
     // set SO_REUSEADDR
     const int enable = 1;
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0) {
-        syslog(LOG_ERR, "Failed to set socket options - %s", "SO_REUSEADDR");
-        cleanup();
-        exit(EXIT_FAILURE);
+    if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0) {
+        aesd_syslog(LOG_ERR, "Failed to set socket options - %s", "SO_REUSEADDR");
+        close(listen_fd);
+        return -1;
+    }
+    // every acceptor binds its own socket to the port, the kernel spreads connections between them
+    if (reuseport && setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int)) < 0) {
+        aesd_syslog(LOG_ERR, "Failed to set socket options - %s", "SO_REUSEPORT");
+        close(listen_fd);
+        return -1;
     }
 
     // get addr
@@ -294,114 +414,509 @@ int start_server(const char *port, int as_daemon) {
 
     int rc = getaddrinfo(NULL, port, &hints, &addr);
     if (rc != 0) {
-        syslog(LOG_ERR, "Failure to obtain address: return code = %d", rc);
-        cleanup();
-        exit(EXIT_FAILURE);
+        aesd_syslog(LOG_ERR, "Failure to obtain address: return code = %d", rc);
+        close(listen_fd);
+        return -1;
     }
 
-    rc = bind(server_fd, addr->ai_addr, sizeof(struct sockaddr));
+    rc = bind(listen_fd, addr->ai_addr, sizeof(struct sockaddr));
     freeaddrinfo(addr);
     if (rc != 0) {
-        syslog(LOG_ERR, "Unable to bind server on port %s: %s", SERVER_PORT, strerror(errno));
-        cleanup();
-        exit(EXIT_FAILURE);
+        aesd_syslog(LOG_ERR, "Unable to bind server on port %s: %s", port, strerror(errno));
+        close(listen_fd);
+        return -1;
     }
-    
-    if (as_daemon) make_daemon();
 
-    rc = listen(server_fd, LISTEN_BACKLOG);
+    rc = listen(listen_fd, backlog);
     if (rc != 0) {            
-        syslog(LOG_ERR, "Failure to listen socket: %s", strerror(errno));
-        cleanup();
-        exit(EXIT_FAILURE);
+        aesd_syslog(LOG_ERR, "Failure to listen socket: %s", strerror(errno));
+        close(listen_fd);
+        return -1;
     }
-    syslog(LOG_DEBUG, "Listening for connections on port %s", SERVER_PORT);
 
-    return server_fd;
+    return listen_fd;
 }
 
-static void timer_action(union sigval arg) {
-    int rc = pthread_mutex_lock(&mutex);
-    if (rc != 0) {
-        syslog(LOG_ERR, "Error locking thread data: %s", strerror(errno));
-    } else {
-        struct timespec ts;
-        rc = clock_gettime(CLOCK_REALTIME, &ts);
+void start_server(const char *port, int as_daemon) {
+    int count = config.acceptors > 0 ? config.acceptors : 1;
+
+    for (int i = 0; i < count; i++) {
+        int listen_fd = open_listener(port, config.listen_backlog, config.acceptors > 0);
+        if (listen_fd < 0) {
+            cleanup();
+            exit(EXIT_FAILURE);
+        }
+        listen_fds[listen_count++] = listen_fd;
+    }
+    if (config.binary_port) {
+        binary_listen_fd = open_listener(config.binary_port, config.listen_backlog, 0);
+        if (binary_listen_fd < 0) {
+            cleanup();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (as_daemon) make_daemon();
+
+    aesd_syslog(LOG_DEBUG, "Listening for connections on port %s with %d acceptor(s)", port, count);
+    if (config.binary_port) {
+        aesd_syslog(LOG_DEBUG, "Listening for binary protocol connections on port %s", config.binary_port);
+    }
+}
+
+static void* acceptor_loop(void* param) {
+    int index = (int)(intptr_t) param;
+    int cpus = CPU_COUNT(&process_cpus);
+
+    if (connection_attrp && cpus > 0) {
+        // the index % cpus-th CPU the process may run on
+        int skip = index % cpus;
+        int cpu = 0;
+        while (!CPU_ISSET(cpu, &process_cpus) || skip-- > 0) {
+            cpu++;
+        }
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(cpu, &cpuset);
+        int rc = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
         if (rc != 0) {
-            syslog(LOG_ERR, "Failure to get system wall clock time: %s", strerror(errno));
+            aesd_syslog(LOG_ERR, "Failure to pin acceptor %d to CPU %d. Error code: %d", index, cpu, rc);
+        }
+    }
+
+    struct pollfd pfd = { .fd = listen_fds[index], .events = POLLIN };
+    while (!stopApp) {
+        // only an acceptor with a client pending takes a connection slot, the kernel
+        // picked the listener and no other acceptor can serve it
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+            aesd_syslog(LOG_ERR, "Failure to poll: %s", strerror(errno));
+            break;
+        }
+        if (stopApp || admission_wait_connection() != 0) {
+            break;
+        }
+        accept_conn(listen_fds[index], connnection_handler);
+    }
+
+    return NULL;
+}
+
+/*
+ * Starts one accept loop per SO_REUSEPORT listener. Must be called with SIGINT and SIGTERM
+ * blocked so the acceptors inherit the mask and the signals are delivered to the main loop.
+ */
+int start_acceptors() {
+    // only the acceptors are pinned, connection threads are created with the whole set
+    if (sched_getaffinity(0, sizeof(process_cpus), &process_cpus) != 0) {
+        aesd_syslog(LOG_ERR, "Failure to read the CPU affinity, acceptors are not pinned: %s", strerror(errno));
+    } else if (pthread_attr_init(&connection_attr) == 0) {
+        if (pthread_attr_setaffinity_np(&connection_attr, sizeof(process_cpus), &process_cpus) == 0) {
+            connection_attrp = &connection_attr;
         } else {
-            char dt[100], ts_row[120];
-            struct tm tm;
-            tzset();
-            localtime_r(&ts.tv_sec, &tm);
-            size_t len = strftime(dt, 100, ISO_2822_TIME_FMT, &tm);
-            strcpy(ts_row, "timestamp:");
-            strncat(ts_row, dt, len);
-            len = strlen(ts_row);
-            ts_row[len] = NEWLINE;
-            ts_row[len+1] = '\0';
-
-            int fd = open_datafile();
-            if (adjust_datafile_pos(fd, 0, SEEK_END) > -1) 
-                append_datafile(fd, ts_row, strlen(ts_row));
-            else
-                syslog(LOG_ERR, "Failure to adjust data file to position to the end!");
-            close_datafile(fd);
+            pthread_attr_destroy(&connection_attr);
         }
-        if (pthread_mutex_unlock(&mutex) != 0) {
-            syslog(LOG_ERR, "Failed to unlock thread data: %s", strerror(errno));
+    }
+
+    for (int i = 0; i < listen_count; i++) {
+        int rc = pthread_create(&acceptor_threads[i], NULL, acceptor_loop, (void*)(intptr_t) i);
+        if (rc != 0) {
+            aesd_syslog(LOG_ERR, "Failure to create acceptor thread. Error code: %d", rc);
+            return -1;
         }
     }
+
+    return 0;
 }
 
-void create_timer() {
-    struct sigevent sev;
-    memset(&sev, 0, sizeof(struct sigevent));
-    sev.sigev_notify = SIGEV_THREAD;
-    sev.sigev_notify_function = timer_action;
+static void write_timestamp() {
+    uint64_t expirations;
+    if (read(timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return;
+    }
 
-    if (timer_create(CLOCK_MONOTONIC, &sev, &timer_id) != 0) {
-        syslog(LOG_ERR, "Failure to create timer: %s", strerror(errno));
-    } else {
-        struct itimerspec ts;
-        ts.it_interval.tv_sec = 10;
-        ts.it_interval.tv_nsec = 0;
-        ts.it_value.tv_sec = 10;
-        ts.it_value.tv_nsec = 0;
-
-        if (timer_settime(timer_id, 0, &ts, NULL) != 0) {
-            syslog(LOG_ERR, "Failure to arm timer!!!");
+    struct timespec ts;
+    if (clock_gettime(CLOCK_REALTIME, &ts) != 0) {
+        aesd_syslog(LOG_ERR, "Failure to get system wall clock time: %s", strerror(errno));
+        return;
+    }
+    char ts_row[120];
+    struct tm tm;
+    // the zone was loaded by create_timer(), localtime_r() does not check TZ again
+    localtime_r(&ts.tv_sec, &tm);
+    size_t len = strlen(strcpy(ts_row, "timestamp:"));
+    len += strftime(ts_row + len, sizeof(ts_row) - len - 1, ISO_2822_TIME_FMT, &tm);
+    ts_row[len++] = NEWLINE;
+
+    int rc = pthread_mutex_lock(&mutex);
+    if (rc != 0) {
+        aesd_syslog(LOG_ERR, "Error locking thread data. Error code: %d", rc);
+        return;
+    }
+    // the timer only runs in data file mode, where every writer shares the segments
+    append_datafile(DATAFILE_SHARED, ts_row, len);
+    if ((rc = pthread_mutex_unlock(&mutex)) != 0) {
+        aesd_syslog(LOG_ERR, "Failed to unlock thread data. Error code: %d", rc);
+    }
+}
+
+/*
+ * Arms a timerfd expiring every TIMESTAMP_INTERVAL seconds, the main loop appends a
+ * timestamp line whenever it becomes readable.
+ */
+int create_timer() {
+    tzset();
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd < 0) {
+        aesd_syslog(LOG_ERR, "Failure to create timer: %s", strerror(errno));
+        return -1;
+    }
+    struct itimerspec ts;
+    ts.it_interval.tv_sec = TIMESTAMP_INTERVAL;
+    ts.it_interval.tv_nsec = 0;
+    ts.it_value.tv_sec = TIMESTAMP_INTERVAL;
+    ts.it_value.tv_nsec = 0;
+
+    if (timerfd_settime(timer_fd, 0, &ts, NULL) != 0) {
+        aesd_syslog(LOG_ERR, "Failure to arm timer: %s", strerror(errno));
+        close(timer_fd);
+        timer_fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Waits for a stop signal, the timer and for connections on the binary protocol listener
+ * and, without acceptor threads, on the listener. Returns once SIGINT or SIGTERM arrived.
+ * While all connection slots are taken the listeners are swapped for the admission eventfd,
+ * new clients stay in the backlog until a connection ends.
+ */
+static void main_loop() {
+    struct pollfd fds[5];
+    int listeners[5];
+    void *(*handlers[5])(void *) = { NULL };
+    nfds_t nfds = 0;
+    int slot_wait = -1, accepting = 1;
+
+    fds[nfds].fd = signal_fd;
+    fds[nfds++].events = POLLIN;
+    if (timer_fd >= 0) {
+        fds[nfds].fd = timer_fd;
+        fds[nfds++].events = POLLIN;
+    }
+    if (config.acceptors == 0) {
+        listeners[nfds] = listen_fds[0];
+        handlers[nfds] = connnection_handler;
+        fds[nfds++].events = POLLIN;
+    }
+    if (binary_listen_fd >= 0) {
+        listeners[nfds] = binary_listen_fd;
+        handlers[nfds] = binproto_handler;
+        fds[nfds++].events = POLLIN;
+    }
+    if (admission_fd() >= 0) {
+        slot_wait = nfds;
+        fds[nfds++].events = POLLIN;
+    }
+
+    while (!stopApp) {
+        // poll() skips negative descriptors
+        for (nfds_t i = 0; i < nfds; i++) {
+            if (handlers[i]) {
+                fds[i].fd = accepting ? listeners[i] : -1;
+            }
+        }
+        if (slot_wait >= 0) {
+            fds[slot_wait].fd = accepting ? -1 : admission_fd();
+        }
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno != EINTR) {
+                aesd_syslog(LOG_ERR, "Failure to poll: %s", strerror(errno));
+            }
+            continue;
+        }
+        for (nfds_t i = 0; i < nfds && !stopApp; i++) {
+            if (!(fds[i].revents & POLLIN)) {
+                continue;
+            }
+            if (fds[i].fd == signal_fd) {
+                if (read_signal()) {
+                    stopApp = 1;
+                    aesd_syslog(LOG_DEBUG, "%s", "Caught signal, exiting");
+                }
+            } else if (fds[i].fd == timer_fd) {
+                write_timestamp();
+            } else if ((int) i == slot_wait) {
+                admission_clear_fd();
+                accepting = 1;
+            } else if (!accepting) {
+                // an earlier listener of this round took the last slot
+                continue;
+            } else if (admission_try_connection()) {
+                accept_conn(fds[i].fd, handlers[i]);
+            } else {
+                accepting = 0;
+            }
+        }
+    }
+}
+
+static void stop_accepting() {
+    // wakes up poll() in every acceptor
+    for (int i = 0; i < listen_count; i++) {
+        if (shutdown(listen_fds[i], SHUT_RDWR) == -1) {
+            aesd_syslog(LOG_ERR, "Server socket shutdown error: %s", strerror(errno));
+        }
+    }
+    // and the acceptors waiting for a connection slot
+    admission_shutdown();
+    if (config.acceptors > 0) {
+        for (int i = 0; i < listen_count; i++) {
+            pthread_join(acceptor_threads[i], NULL);
+        }
+    }
+    for (int i = 0; i < listen_count; i++) {
+        close(listen_fds[i]);
+    }
+    listen_count = 0;
+    // only accepted from the main loop
+    if (binary_listen_fd >= 0) {
+        close(binary_listen_fd);
+        binary_listen_fd = -1;
+    }
+    if (connection_attrp) {
+        pthread_attr_destroy(connection_attrp);
+        connection_attrp = NULL;
+    }
+}
+
+static void shutdown_client(void *conn, void *param) {
+    clientconn_info *info = (clientconn_info *) conn;
+    int how = *(int *) param;
+    // a partial line is read to its end first, the thread shuts its socket down once it commits
+    if (how == SHUT_RD && __atomic_load_n(&info->conn.buffered, __ATOMIC_SEQ_CST) > 0) {
+        return;
+    }
+    if (shutdown(info->conn.client_fd, how) == -1 && errno != ENOTCONN) {
+        aesd_syslog(LOG_ERR, "Client socket shutdown error: %s", strerror(errno));
+    }
+}
+
+static void add_ms(struct timespec *ts, unsigned int ms) {
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+static int before(const struct timespec *a, const struct timespec *b) {
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/*
+ * Lets connections finish on their own: with their sockets shut down for reading each
+ * thread commits and echoes the complete lines it already received, sees EOF and closes
+ * its connection, all of them in parallel. A line still arriving is read to its end
+ * before the socket is shut down, shutdown(SHUT_RD) drops data received after it.
+ * Connections left after config.drain_timeout ms, or once another stop signal arrives,
+ * are shut down for writing too so a stuck echo fails, and are cancelled if even that
+ * does not end them.
+ */
+static void drain_connections() {
+    size_t count = registry_count();
+    if (count == 0) {
+        return;
+    }
+    aesd_syslog(LOG_DEBUG, "Draining %zu connection(s)", count);
+    __atomic_store_n(&draining, 1, __ATOMIC_SEQ_CST);
+    // recv() still returns the bytes already received, then 0
+    int how = SHUT_RD;
+    registry_foreach(shutdown_client, &how);
+
+    struct timespec now, deadline, wake;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    deadline = now;
+    add_ms(&deadline, config.drain_timeout);
+    for (;;) {
+        // wake up now and then to look for a second signal
+        wake = now;
+        add_ms(&wake, DRAIN_POLL_INTERVAL);
+        if (before(&deadline, &wake)) {
+            wake = deadline;
         }
+        if (registry_wait_empty_until(&wake) == 0) {
+            return;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (read_signal() || !before(&now, &deadline)) {
+            break;
+        }
+    }
+
+    aesd_syslog(LOG_WARNING, "Closing %zu connection(s) still open", registry_count());
+    how = SHUT_RDWR;
+    registry_foreach(shutdown_client, &how);
+    add_ms(&now, DRAIN_POLL_INTERVAL);
+    if (registry_wait_empty_until(&now) != 0) {
+        registry_cancel_all();
+        registry_wait_empty();
     }
 }
 
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-d] [-m <port|/path/to/unix.sock>] [-w <acceptors>] [-b <backlog>]\n"
+        "          [-c <connections>] [-l <line size>] [-q <in-flight size>] [-g <drain timeout>]\n"
+        "          [-B <binary protocol port>]\n"
+        "          [-s <segment size>] [-a <segment age>] [-r <retained size>] [-t <retained age>]\n"
+        "          [-f <durability>] [-i <sync interval>] [-p]\n"
+        "  -w  open one SO_REUSEPORT listener and accept thread per acceptor (max %d)\n"
+        "  -b  listen backlog (default %d)\n"
+        "  -B  also serve the length-prefixed binary protocol (binproto.h) on this port\n"
+        "  -c  serve at most this many connections at once, others wait in the backlog\n"
+        "  -l  close connections sending a line longer than this (K/M/G suffixes as below)\n"
+        "  -q  stop reading new lines while connections buffer this many bytes in total\n"
+        "  -g  ms connections get on SIGINT/SIGTERM to finish the lines they sent (default %d),\n"
+        "      a second signal cancels them right away\n"
+        "data file mode only, sizes accept K/M/G suffixes and ages are in seconds:\n"
+        "  -s  seal the head segment before it exceeds this size (default %d)\n"
+        "  -a  seal the head segment once it is older than this\n"
+        "  -r  drop the oldest segments while the log is bigger than this\n"
+        "  -t  drop segments sealed longer ago than this\n"
+        "      at most %d sealed segments are kept either way, sealing another drops the oldest\n"
+        "  -f  durability: none (default), periodic, batch (group fsync before the echo) or line\n"
+        "  -i  ms between periodic syncs (default %d), or to gather a batch before syncing (default 0)\n"
+        "  -p  persistent log: checksummed records, torn writes are cut at startup and the log\n"
+        "      is kept on exit. Do not mix with a log written without -p\n",
+        prog, MAX_ACCEPTORS, LISTEN_BACKLOG, DRAIN_TIMEOUT, DATAFILE_SEGMENT_SIZE, DATAFILE_MAX_SEGMENTS, DATAFILE_SYNC_INTERVAL);
+}
+
+static size_t parse_size(const char *arg) {
+    char *unit;
+    size_t size = strtoull(arg, &unit, 10);
+    switch (*unit) {
+        case 'G': case 'g': size *= 1024;
+        /* fall through */
+        case 'M': case 'm': size *= 1024;
+        /* fall through */
+        case 'K': case 'k': size *= 1024;
+    }
+    return size;
+}
+
+static int parse_durability(const char *arg, enum datafile_durability *durability) {
+    static const char *names[] = {
+        [DURABILITY_NONE] = "none",
+        [DURABILITY_PERIODIC] = "periodic",
+        [DURABILITY_BATCH] = "batch",
+        [DURABILITY_LINE] = "line",
+    };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcmp(arg, names[i]) == 0) {
+            *durability = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
 int main(int argc, char **argv) {
-    int daemon = 0;
-    if (argc == 2 && strcmp(argv[1], "-d") == 0) {
-        daemon = 1;
-    } 
+    int opt;
+
+    while ((opt = getopt(argc, argv, "dm:w:b:s:a:r:t:f:i:pc:l:q:g:B:")) != -1) {
+        switch (opt) {
+            case 'd':
+                config.daemon = 1;
+                break;
+            case 'm':
+                config.metrics_endpoint = optarg;
+                break;
+            case 'w':
+                config.acceptors = atoi(optarg);
+                break;
+            case 'b':
+                config.listen_backlog = atoi(optarg);
+                break;
+            case 's':
+                config.datafile.segment_size = parse_size(optarg);
+                break;
+            case 'a':
+                config.datafile.segment_age = atoi(optarg);
+                break;
+            case 'r':
+                config.datafile.retention_bytes = parse_size(optarg);
+                break;
+            case 't':
+                config.datafile.retention_age = atoi(optarg);
+                break;
+            case 'f':
+                if (parse_durability(optarg, &config.datafile.durability) != 0) {
+                    usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'i':
+                config.datafile.sync_interval = atoi(optarg);
+                break;
+            case 'p':
+                config.datafile.persistent = 1;
+                break;
+            case 'c':
+                config.admission.max_connections = atoi(optarg);
+                break;
+            case 'l':
+                config.admission.max_line = parse_size(optarg);
+                break;
+            case 'q':
+                config.admission.max_inflight = parse_size(optarg);
+                break;
+            case 'g':
+                config.drain_timeout = atoi(optarg);
+                break;
+            case 'B':
+                config.binary_port = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (config.acceptors < 0 || config.acceptors > MAX_ACCEPTORS || config.listen_backlog <= 0) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
 
     openlog(NULL, LOG_ODELAY, LOG_USER);
 
-    server_fd = start_server(SERVER_PORT, daemon);
-    if (server_fd < 0) {
-        return EXIT_FAILURE;
+    start_server(SERVER_PORT, config.daemon);
+
+    // before any thread is created, they all inherit the mask
+    if (create_signalfd() != 0) {
+        cleanup();
+        exit(EXIT_FAILURE);
     }
 
-    if (register_sighandlers() != 0) {
+    // after start_server() since the daemon fork would lose the logging thread
+    if (log_start() != 0) {
+        cleanup();
         exit(EXIT_FAILURE);
     }
 
-    syslog(LOG_DEBUG, "Value of flag - %d", USE_AESD_CHAR_DEVICE);
+    aesd_syslog(LOG_DEBUG, "Value of flag - %d", USE_AESD_CHAR_DEVICE);
     
-    // open and close data file
-    int fd = open_datafile();
-    if (fd < 0) {
+    if (init_datafile(&config.datafile) != 0) {
         exit(EXIT_FAILURE);
     }
-    close_datafile(fd);
 
-    SLIST_INIT(&connections);
+    if (registry_init() != 0) {
+        exit(EXIT_FAILURE);
+    }
+    if (admission_init(&config.admission) != 0) {
+        exit(EXIT_FAILURE);
+    }
 
     pthread_mutexattr_t attr;
     pthread_mutexattr_init(&attr);
@@ -409,12 +924,35 @@ int main(int argc, char **argv) {
     pthread_mutex_init(&mutex, &attr);
     pthread_mutexattr_destroy(&attr);
 
-    if (!USE_AESD_CHAR_DEVICE) {
-        create_timer();
+    if (!USE_AESD_CHAR_DEVICE && create_timer() != 0) {
+        exit(EXIT_FAILURE);
     }
 
-    for( ; stopApp < 1 ; ) {
-        accept_conn();
+    if (config.metrics_endpoint && metrics_start(config.metrics_endpoint) != 0) {
+        exit(EXIT_FAILURE);
     }
 
+    if (config.acceptors > 0 && start_acceptors() != 0) {
+        exit(EXIT_FAILURE);
+    }
+    main_loop();
+
+    stop_accepting();
+    if (timer_fd >= 0) {
+        close(timer_fd);
+        timer_fd = -1;
+    }
+    drain_connections();
+
+    // every connection thread is gone, nothing uses the shared state anymore
+    metrics_stop();
+    registry_destroy();
+    connpool_destroy();
+    pthread_mutex_destroy(&mutex);
+    compress_destroy();
+    destroy_datafile();
+    close(signal_fd);
+
+    log_stop();
+    closelog();
 }
\ No newline at end of file
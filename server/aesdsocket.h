@@ -1,44 +1,50 @@
 #include <pthread.h>
 #include "queue.h"
+#include "datafile.h"
+#include "admission.h"
+#include "connpool.h"
 
 #define BUFFER_SIZE 128
 #define CONN_PENDING 0
 #define CONN_TERMINATED 1
 
-struct aesdsocketclientconn {
-    int                 data_fd;
-    int                 client_fd;
-    char*               client_ip_addr;
-    pthread_mutex_t*    mutex;
-    size_t              init_buffer_size;
-    char**              buffer;
-    // int*                status;
+struct aesdsocket_config {
+    int         daemon;
+    const char* metrics_endpoint;
+    const char* binary_port;    // port of the binary protocol (binproto.h), NULL - not served
+    int         acceptors;      // SO_REUSEPORT listeners with own accept thread, 0 - accept in main thread
+    int         listen_backlog;
+    unsigned int drain_timeout; // ms connections get to finish on shutdown before they are cancelled
+    struct datafile_config datafile;
+    struct admission_config admission;
 };
 
-typedef struct _clientconn_info {
-    SLIST_ENTRY(_clientconn_info) next;
-    pthread_t  thread_id;
-    struct aesdsocketclientconn* ref;
-} clientconn_info;
-
-SLIST_HEAD(conn_list, _clientconn_info) connections;
+extern struct aesdsocket_config config;
 
 /**
- * Accepts server connection by creating a new thread to handle it.
+ * Accepts server connection on @param listen_fd by creating a new thread running @param handler.
+ * The caller reserves a connection slot, it is released when the connection ends or
+ * right away when the connection could not be set up.
 */
-void accept_conn();
+void accept_conn(int listen_fd, void *(*handler)(void *));
 
 void* connnection_handler(void* param);
 
+/*
+ * Accounting of the bytes a connection buffers until they are committed, shared by the
+ * protocol handlers: counted against the in-flight limit and, on shutdown, tells whether
+ * the connection is in the middle of a line or request.
+ */
+void connection_received(struct aesdsocketclientconn *conn, size_t n);
+void connection_committed(struct aesdsocketclientconn *conn, size_t n);
+
 /*
  * Performs connection cleanup upon normal termination or when thread gets cancellation request
  * Steps:
- * 1. close client FD
+ * 1. leave shutdown's iteration over the registry and close client FD
  * 2. release buffer memory
  * 3. unlock mutex to allow successful mutex desctruction later
+ * 4. return its buffered bytes and connection slot to admission control
+ * 5. return the connection object to the pool and remove it from the registry
 */
-void connection_cleanup(void* param);
-/*
- * looping thru LL and cleanup terminated connections and remove them from LL 
-*/
-void cleanup_term_conn(int await_termination);
\ No newline at end of file
+void connection_cleanup(void* param);
\ No newline at end of file
@@ -0,0 +1,60 @@
+#include "binproto.h"
+#include <string.h>
+#include <arpa/inet.h>
+
+void binproto_parse_header(const char *buf, struct binproto_header *hdr) {
+    memcpy(hdr, buf, sizeof(*hdr));
+    hdr->id = ntohl(hdr->id);
+    hdr->len = ntohl(hdr->len);
+}
+
+void binproto_put_header(char *buf, uint8_t op, uint8_t status, uint32_t id, uint32_t len) {
+    struct binproto_header hdr = {
+        .op = op,
+        .status = status,
+        .id = htonl(id),
+        .len = htonl(len),
+    };
+    // messages are packed back to back, the header may be unaligned
+    memcpy(buf, &hdr, sizeof(hdr));
+}
+
+size_t binproto_response_size(const struct binproto_header *req, const char *payload) {
+    uint32_t want = 2 * sizeof(uint64_t);
+    if (req->op == BINPROTO_READ && req->len == BINPROTO_READ_REQUEST_SIZE) {
+        memcpy(&want, payload + sizeof(uint64_t), sizeof(want));
+        want = ntohl(want) < BINPROTO_MAX_READ ? ntohl(want) : BINPROTO_MAX_READ;
+    }
+    return sizeof(*req) + want;
+}
+
+size_t binproto_scan(const char *buf, size_t buflen, size_t max_payload, struct binproto_header *rejected) {
+    struct binproto_header req;
+    size_t end = 0, estimate = 0;
+
+    rejected->len = 0;
+    while (buflen - end >= sizeof(req) && estimate < BINPROTO_BATCH_SIZE) {
+        binproto_parse_header(buf + end, &req);
+        if (req.len > max_payload) {
+            *rejected = req;
+            break;
+        }
+        if (buflen - end - sizeof(req) < req.len) {
+            break;
+        }
+        estimate += binproto_response_size(&req, buf + end + sizeof(req));
+        end += sizeof(req) + req.len;
+    }
+
+    return end;
+}
+
+size_t binproto_request_rest(const char *buf, size_t buflen) {
+    struct binproto_header req;
+
+    if (buflen < sizeof(req)) {
+        return sizeof(req) - buflen;
+    }
+    binproto_parse_header(buf, &req);
+    return sizeof(req) + req.len - buflen;
+}
@@ -0,0 +1,252 @@
+#define _GNU_SOURCE
+#include "binproto.h"
+#include "aesdsocket.h"
+#include "metrics.h"
+#include "log.h"
+#include <endian.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#define BINPROTO_RECV_SIZE (16*1024)
+
+struct response_buffer {
+    char   *data;
+    size_t  len;
+    size_t  size;
+};
+
+static void free_response_buffer(void *param) {
+    struct response_buffer *out = (struct response_buffer *) param;
+    free(out->data);
+}
+
+// makes room for @param n more bytes, returns where they go
+static char *reserve(struct response_buffer *out, size_t n) {
+    if (out->len + n > out->size) {
+        size_t size = out->size ? out->size : 4096;
+        while (size < out->len + n) {
+            size *= 2;
+        }
+        char *data = realloc(out->data, size);
+        if (!data) {
+            aesd_syslog(LOG_ERR, "%s", "Failure to allocate the response buffer");
+            return NULL;
+        }
+        out->data = data;
+        out->size = size;
+    }
+    return out->data + out->len;
+}
+
+// appends a response whose payload was already written right after the header
+static void commit_response(struct response_buffer *out, const struct binproto_header *req, uint8_t status, uint32_t len) {
+    binproto_put_header(out->data + out->len, req->op, status, req->id, len);
+    out->len += sizeof(struct binproto_header) + len;
+}
+
+static int put_response(struct response_buffer *out, const struct binproto_header *req, uint8_t status, const void *payload, uint32_t len) {
+    char *dst = reserve(out, sizeof(struct binproto_header) + len);
+    if (!dst) {
+        return -1;
+    }
+    if (len > 0) {
+        memcpy(dst + sizeof(struct binproto_header), payload, len);
+    }
+    commit_response(out, req, status, len);
+    return 0;
+}
+
+static int execute_append(int data_fd, const struct binproto_header *req, char *payload, struct response_buffer *out, off_t *commit_end) {
+    // the char device looks for AESDCHAR_IOCSEEKTO commands with strstr()
+    char saved = payload[req->len];
+    payload[req->len] = '\0';
+    off_t end = append_datafile(data_fd, payload, req->len);
+    payload[req->len] = saved;
+
+    if (end < 0) {
+        return put_response(out, req, BINPROTO_EIO, NULL, 0);
+    }
+    metrics_add(METRIC_LINES_COMMITTED, 1);
+    *commit_end = end;
+    uint64_t be_end = htobe64(end);
+    return put_response(out, req, BINPROTO_OK, &be_end, sizeof(be_end));
+}
+
+static int execute_read(const struct binproto_header *req, const char *payload, struct response_buffer *out) {
+    if (req->len != BINPROTO_READ_REQUEST_SIZE) {
+        return put_response(out, req, BINPROTO_EBADREQ, NULL, 0);
+    }
+#if USE_AESD_CHAR_DEVICE == 1
+    return put_response(out, req, BINPROTO_ENOTSUP, NULL, 0);
+#else
+    uint64_t offset;
+    uint32_t want;
+    memcpy(&offset, payload, sizeof(offset));
+    memcpy(&want, payload + sizeof(offset), sizeof(want));
+    offset = be64toh(offset);
+    want = ntohl(want);
+    if (want > BINPROTO_MAX_READ) {
+        want = BINPROTO_MAX_READ;
+    }
+
+    char *dst = reserve(out, sizeof(struct binproto_header) + want);
+    if (!dst) {
+        return -1;
+    }
+    dst += sizeof(struct binproto_header);
+    // the log is read straight into the response, a read stops at segment boundaries
+    size_t got = 0;
+    ssize_t m = 0;
+    while (got < want && (m = read_datafile_range(offset + got, dst + got, want - got)) > 0) {
+        got += m;
+    }
+    commit_response(out, req, m < 0 && got == 0 ? BINPROTO_EIO : BINPROTO_OK, got);
+    return 0;
+#endif
+}
+
+static int execute_info(const struct binproto_header *req, struct response_buffer *out) {
+    uint64_t range[2] = { htobe64(datafile_begin()), htobe64(datafile_end()) };
+    return put_response(out, req, BINPROTO_OK, range, sizeof(range));
+}
+
+static int send_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t rc = send(fd, buf, len, MSG_NOSIGNAL);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        metrics_add(METRIC_BYTES_SENT, rc);
+        buf += rc;
+        len -= rc;
+    }
+    return 0;
+}
+
+/*
+ * Executes the complete requests at the start of the line buffer holding @param buflen
+ * bytes and sends their responses. Returns the number of bytes consumed, 0 when no
+ * request is complete yet, or -1 when the connection has to be closed.
+ */
+static ssize_t execute_batch(struct aesdsocketclientconn *conn, int data_fd, size_t buflen, struct response_buffer *out) {
+    size_t max_payload = admission_max_line() > 0 ? admission_max_line() : BINPROTO_MAX_PAYLOAD;
+    struct binproto_header req, rejected;
+
+    size_t end = binproto_scan(conn->buffer, buflen, max_payload, &rejected);
+    int too_big = rejected.len > 0;
+    if (end == 0 && !too_big) {
+        return 0;
+    }
+
+    out->len = 0;
+    off_t commit_end = 0;
+    int rc = 0;
+    if (end > 0) {
+        uint64_t batch_ready = metrics_now_ns();
+        if ((rc = pthread_mutex_lock(conn->mutex)) != 0) {
+            aesd_syslog(LOG_ERR, "Failure to lock mutex with error code: %d", rc);
+            return -1;
+        }
+        metrics_observe_ns(METRIC_LOCK_WAIT, metrics_now_ns() - batch_ready);
+        for (size_t pos = 0; pos < end && rc == 0; pos += sizeof(req) + req.len) {
+            binproto_parse_header(conn->buffer + pos, &req);
+            char *payload = conn->buffer + pos + sizeof(req);
+            switch (req.op) {
+                case BINPROTO_APPEND:
+                    rc = execute_append(data_fd, &req, payload, out, &commit_end);
+                    break;
+                case BINPROTO_READ:
+                    rc = execute_read(&req, payload, out);
+                    break;
+                case BINPROTO_INFO:
+                    rc = execute_info(&req, out);
+                    break;
+                default:
+                    rc = put_response(out, &req, BINPROTO_EBADREQ, NULL, 0);
+            }
+        }
+        pthread_mutex_unlock(conn->mutex);
+        if (rc != 0) {
+            return -1;
+        }
+        // one group commit wait covers every append of the batch
+        if (config.datafile.durability == DURABILITY_BATCH && commit_end > 0) {
+            datafile_wait_durable(commit_end);
+        }
+    }
+    if (too_big) {
+        aesd_syslog(LOG_WARNING, "Request from %s exceeds %zu bytes, closing connection", conn->client_ip_addr, max_payload);
+        metrics_add(METRIC_LINES_REJECTED, 1);
+        if (put_response(out, &rejected, BINPROTO_ETOOBIG, NULL, 0) != 0) {
+            return -1;
+        }
+    }
+
+    if (send_all(conn->client_fd, out->data, out->len) != 0) {
+        aesd_syslog(LOG_ERR, "Failure to send response to the client - %s", conn->client_ip_addr);
+        return -1;
+    }
+
+    return too_big ? -1 : (ssize_t) end;
+}
+
+void *binproto_handler(void *param) {
+    clientconn_info *info = (clientconn_info *) param;
+    struct aesdsocketclientconn *args = &info->conn;
+    struct response_buffer out = { NULL, 0, 0 };
+
+    pthread_cleanup_push(connection_cleanup, info);
+    pthread_cleanup_push(free_response_buffer, &out);
+
+    aesd_syslog(LOG_DEBUG, "Accepted binary connection from %s", args->client_ip_addr);
+
+    char recv_buf[BINPROTO_RECV_SIZE];
+    ssize_t n, used = 0;
+    size_t buflen = 0;
+
+    int data_fd = open_datafile();
+    if (data_fd < 0) {
+        pthread_exit(args);
+    }
+    args->data_fd = data_fd;
+
+    while (used >= 0) {
+        size_t want = sizeof(recv_buf);
+        // a new request only starts while the in-flight budget allows it, a started one
+        // is then only finished
+        if (buflen == 0) {
+            admission_wait_bytes();
+        } else if (admission_bytes_exhausted()) {
+            size_t rest = binproto_request_rest(args->buffer, buflen);
+            want = rest < want ? rest : want;
+        }
+        if ((n = recv(args->client_fd, recv_buf, want, 0)) <= 0) {
+            break;
+        }
+        metrics_add(METRIC_BYTES_RECEIVED, n);
+        connection_received(args, n);
+        if (connpool_append(args, buflen, recv_buf, n) != 0) {
+            aesd_syslog(LOG_ERR, "Failure to grow the request buffer of %s, closing connection", args->client_ip_addr);
+            break;
+        }
+        buflen += n;
+
+        while ((used = execute_batch(args, data_fd, buflen, &out)) > 0) {
+            buflen -= used;
+            // keeps the NUL terminator
+            memmove(args->buffer, args->buffer + used, buflen + 1);
+            connection_committed(args, used);
+        }
+    }
+
+    pthread_cleanup_pop(1);
+    pthread_cleanup_pop(1);
+
+    return NULL;
+}
@@ -0,0 +1,75 @@
+#ifndef AESDSOCKET_BINPROTO_H
+#define AESDSOCKET_BINPROTO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Length-prefixed binary protocol, served on its own port next to the newline protocol.
+ * Requests and responses are a struct binproto_header followed by len payload bytes, all
+ * integers in network byte order. A response carries the id of its request, so clients
+ * may pipeline requests without waiting; responses come back in request order.
+ * Requests already received are executed as one batch: they share one acquisition of
+ * the data file lock (and one group commit wait) and their responses go out in one send.
+ *
+ * BINPROTO_APPEND  payload: bytes appended to the log verbatim, no newline needed
+ *                  response: uint64 logical end of the log after the append (0 on the char device)
+ * BINPROTO_READ    payload: uint64 logical offset, uint32 length
+ *                  response: up to length (at most BINPROTO_MAX_READ) bytes of the log at offset,
+ *                  fewer at the end of the log. Data file mode only
+ * BINPROTO_INFO    response: uint64 first and uint64 end logical offset of the retained log
+ */
+#define BINPROTO_APPEND 1
+#define BINPROTO_READ   2
+#define BINPROTO_INFO   3
+
+#define BINPROTO_OK         0
+#define BINPROTO_EBADREQ    1   // unknown op or malformed payload
+#define BINPROTO_ETOOBIG    2   // payload over the limit, the connection is closed
+#define BINPROTO_EIO        3
+#define BINPROTO_ENOTSUP    4
+
+// payload of a BINPROTO_READ request
+#define BINPROTO_READ_REQUEST_SIZE 12
+// payload limit when no line limit (-l) is set
+#define BINPROTO_MAX_PAYLOAD (16*1024*1024)
+#define BINPROTO_MAX_READ    (1024*1024)
+// a batch is cut once its responses hold this many bytes
+#define BINPROTO_BATCH_SIZE  (256*1024)
+
+struct binproto_header {
+    uint8_t  op;
+    uint8_t  status;    // responses only
+    uint16_t reserved;
+    uint32_t id;
+    uint32_t len;
+};
+
+/*
+ * Framing, binproto-frame.c. Headers are read from and written to possibly unaligned
+ * buffers, converting to and from network byte order.
+ */
+void binproto_parse_header(const char *buf, struct binproto_header *hdr);
+void binproto_put_header(char *buf, uint8_t op, uint8_t status, uint32_t id, uint32_t len);
+// response bytes a request may produce, to cut batches
+size_t binproto_response_size(const struct binproto_header *req, const char *payload);
+/*
+ * Finds the requests received in full at the start of the @param buflen bytes at @param buf,
+ * stopping once their responses may hold BINPROTO_BATCH_SIZE bytes. Returns the bytes they
+ * span. When the next header announces a payload over @param max_payload it is copied to
+ * @param rejected, whose len is 0 otherwise.
+ */
+size_t binproto_scan(const char *buf, size_t buflen, size_t max_payload, struct binproto_header *rejected);
+/*
+ * Bytes still missing from the request started in the @param buflen bytes at @param buf,
+ * its header first.
+ */
+size_t binproto_request_rest(const char *buf, size_t buflen);
+
+/*
+ * Thread function serving a binary protocol connection, takes a clientconn_info as
+ * connnection_handler() does.
+ */
+void *binproto_handler(void *param);
+
+#endif
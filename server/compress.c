@@ -0,0 +1,244 @@
+#include "compress.h"
+#include "datafile.h"
+#include "metrics.h"
+#include "log.h"
+#include "lz4.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#if USE_AESD_CHAR_DEVICE == 0
+struct cached_segment {
+    off_t     base;
+    off_t     end;
+    char     *frames;   // NULL in a free entry
+    size_t    len;
+    uint64_t  used;     // cache_tick of the last echo, the smallest is evicted first
+};
+
+static struct cached_segment cache[COMPRESS_CACHE_ENTRIES];
+static size_t cache_bytes;
+static uint64_t cache_tick;
+#endif
+// only used with the data file lock held
+static char raw_chunk[COMPRESS_CHUNK_SIZE];
+static char frame_buffer[sizeof(struct compress_frame) + LZ4_COMPRESS_BOUND(COMPRESS_CHUNK_SIZE)];
+
+static const char *method_names[] = {
+    [COMPRESS_NONE] = "none",
+    [COMPRESS_LZ4] = "lz4",
+};
+
+int compress_parse_command(const char *line, size_t len) {
+    size_t prefix = strlen(COMPRESS_COMMAND);
+    if (len < prefix || strncmp(line, COMPRESS_COMMAND, prefix) != 0) {
+        return -1;
+    }
+    line += prefix;
+    len -= prefix;
+    // the newline, and a carriage return from telnet like clients
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+        len--;
+    }
+    if (len == strlen(method_names[COMPRESS_LZ4]) && strncmp(line, method_names[COMPRESS_LZ4], len) == 0) {
+        return COMPRESS_LZ4;
+    }
+    return COMPRESS_NONE;
+}
+
+static int send_all(int client_fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t rc = send(client_fd, buf, len, MSG_NOSIGNAL);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        metrics_add(METRIC_BYTES_SENT, rc);
+        buf += rc;
+        len -= rc;
+    }
+    return 0;
+}
+
+int send_compress_reply(int client_fd, enum compress_method method) {
+    char reply[32];
+    int len = snprintf(reply, sizeof(reply), "%s%s\n", COMPRESS_COMMAND, method_names[method]);
+    return send_all(client_fd, reply, len);
+}
+
+// turns @param len raw bytes into a frame in frame_buffer, returns the frame size
+static size_t build_frame(const char *raw, size_t len) {
+    struct compress_frame frame = { .raw_len = htonl(len) };
+    char *payload = frame_buffer + sizeof(frame);
+    size_t n = lz4_compress(raw, len, payload);
+    if (n >= len) {
+        // incompressible, e.g. already compressed payloads
+        memcpy(payload, raw, len);
+        n = len;
+        frame.len = htonl(n | COMPRESS_FRAME_STORED);
+    } else {
+        frame.len = htonl(n);
+    }
+    memcpy(frame_buffer, &frame, sizeof(frame));
+    return sizeof(frame) + n;
+}
+
+/*
+ * Sends frames of the log from @param pos until read_datafile() reports the end,
+ * compressing as it goes.
+ */
+static int stream_frames(int data_fd, int client_fd, off_t *pos) {
+    for (;;) {
+        size_t filled = 0;
+        ssize_t m;
+        while (filled < sizeof(raw_chunk) && (m = read_datafile(data_fd, pos, raw_chunk + filled, sizeof(raw_chunk) - filled)) > 0) {
+            filled += m;
+        }
+        if (filled == 0) {
+            return 0;
+        }
+        if (send_all(client_fd, frame_buffer, build_frame(raw_chunk, filled)) != 0) {
+            return -1;
+        }
+    }
+}
+
+#if USE_AESD_CHAR_DEVICE == 0
+static void free_entry(struct cached_segment *entry) {
+    cache_bytes -= entry->len;
+    free(entry->frames);
+    memset(entry, 0, sizeof(*entry));
+}
+
+// least recently echoed cached segment, NULL when the cache is empty
+static struct cached_segment *least_recent() {
+    struct cached_segment *victim = NULL;
+    for (int i = 0; i < COMPRESS_CACHE_ENTRIES; i++) {
+        if (cache[i].frames && (!victim || cache[i].used < victim->used)) {
+            victim = &cache[i];
+        }
+    }
+    return victim;
+}
+
+// compresses the sealed segment [base, end) into a new cache entry
+static struct cached_segment *cache_segment(off_t base, off_t end) {
+    struct cached_segment *victim;
+    size_t len = 0, size = 0;
+    char *frames = NULL;
+
+    for (off_t pos = base; pos < end; ) {
+        size_t filled = 0;
+        ssize_t m;
+        while (filled < sizeof(raw_chunk) && pos < end && (m = read_datafile_range(pos, raw_chunk + filled, sizeof(raw_chunk) - filled)) > 0) {
+            filled += m;
+            pos += m;
+        }
+        if (filled == 0) {
+            free(frames);
+            return NULL;
+        }
+        size_t n = build_frame(raw_chunk, filled);
+        if (len + n > size) {
+            size_t grown = size ? size * 2 : n * 4;
+            while (grown < len + n) {
+                grown *= 2;
+            }
+            char *p = realloc(frames, grown);
+            if (!p) {
+                free(frames);
+                return NULL;
+            }
+            frames = p;
+            size = grown;
+        }
+        memcpy(frames + len, frame_buffer, n);
+        len += n;
+    }
+    if (len > COMPRESS_CACHE_BYTES / 2) {
+        // would flush most of the cache for a single segment
+        free(frames);
+        return NULL;
+    }
+    if (size > len) {
+        char *p = realloc(frames, len);
+        frames = p ? p : frames;
+    }
+
+    // least recently echoed segments make room
+    while (cache_bytes + len > COMPRESS_CACHE_BYTES && (victim = least_recent())) {
+        free_entry(victim);
+    }
+    for (victim = &cache[0]; victim < &cache[COMPRESS_CACHE_ENTRIES] && victim->frames; victim++);
+    if (victim == &cache[COMPRESS_CACHE_ENTRIES]) {
+        victim = least_recent();
+        free_entry(victim);
+    }
+    victim->base = base;
+    victim->end = end;
+    victim->frames = frames;
+    victim->len = len;
+    cache_bytes += len;
+    return victim;
+}
+
+static struct cached_segment *lookup_segment(off_t base, off_t end) {
+    for (int i = 0; i < COMPRESS_CACHE_ENTRIES; i++) {
+        if (cache[i].frames && cache[i].base == base && cache[i].end == end) {
+            metrics_add(METRIC_ECHO_CACHE_HITS, 1);
+            cache[i].used = ++cache_tick;
+            return &cache[i];
+        }
+    }
+    metrics_add(METRIC_ECHO_CACHE_MISSES, 1);
+    struct cached_segment *entry = cache_segment(base, end);
+    if (entry) {
+        entry->used = ++cache_tick;
+    }
+    return entry;
+}
+#endif
+
+int send_compressed_response(int data_fd, int client_fd) {
+    off_t pos = datafile_begin();
+
+#if USE_AESD_CHAR_DEVICE == 0
+    // segments dropped by retention
+    for (int i = 0; i < COMPRESS_CACHE_ENTRIES; i++) {
+        if (cache[i].frames && cache[i].base < pos) {
+            free_entry(&cache[i]);
+        }
+    }
+    off_t end;
+    while ((end = datafile_sealed_end(pos)) > 0) {
+        struct cached_segment *entry = lookup_segment(pos, end);
+        if (!entry) {
+            // not cacheable, compressed along with the head below
+            break;
+        }
+        if (send_all(client_fd, entry->frames, entry->len) != 0) {
+            return -1;
+        }
+        pos = end;
+    }
+#endif
+    if (stream_frames(data_fd, client_fd, &pos) != 0) {
+        return -1;
+    }
+    struct compress_frame last = { 0, 0 };
+    return send_all(client_fd, (const char *) &last, sizeof(last));
+}
+
+void compress_destroy() {
+#if USE_AESD_CHAR_DEVICE == 0
+    for (int i = 0; i < COMPRESS_CACHE_ENTRIES; i++) {
+        if (cache[i].frames) {
+            free_entry(&cache[i]);
+        }
+    }
+#endif
+}
@@ -0,0 +1,51 @@
+#ifndef AESDSOCKET_COMPRESS_H
+#define AESDSOCKET_COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Compressed echo. A client sending the line COMPRESS_COMMAND "lz4" gets the reply
+ * COMPRESS_COMMAND "lz4" (or "none" for a method not supported) and from then on every
+ * echo is a sequence of frames: a struct compress_frame followed by len bytes, an LZ4
+ * block decoding to raw_len bytes of the log or, with COMPRESS_FRAME_STORED set in len,
+ * the raw bytes when they did not compress. A frame with raw_len 0 ends the echo.
+ *
+ * Sealed segments never change, their frames are kept in a cache of COMPRESS_CACHE_BYTES
+ * so repeated echoes only compress the head segment. The cache is protected by the data
+ * file lock.
+ */
+#define COMPRESS_COMMAND "AESD_COMPRESS:"
+#define COMPRESS_CHUNK_SIZE (64*1024)           // raw bytes per frame, the LZ4 window
+#define COMPRESS_CACHE_BYTES (64*1024*1024)
+#define COMPRESS_CACHE_ENTRIES 64
+#define COMPRESS_FRAME_STORED 0x80000000U
+
+enum compress_method {
+    COMPRESS_NONE,
+    COMPRESS_LZ4,
+};
+
+// integers in network byte order
+struct compress_frame {
+    uint32_t raw_len;
+    uint32_t len;
+};
+
+/*
+ * Returns the method a COMPRESS_COMMAND line of @param len bytes asks for, or -1 when
+ * the line is not the command.
+ */
+int compress_parse_command(const char *line, size_t len);
+/*
+ * Sends the reply to the command, @param method is the one now in use.
+ */
+int send_compress_reply(int client_fd, enum compress_method method);
+/*
+ * As send_response() but as compressed frames, expects the data file lock held.
+ */
+int send_compressed_response(int data_fd, int client_fd);
+// frees the cached segments
+void compress_destroy();
+
+#endif
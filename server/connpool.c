@@ -0,0 +1,154 @@
+#include "connpool.h"
+#include "metrics.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct free_slab {
+    struct free_slab *next;
+};
+
+struct slab_class {
+    struct free_slab *free;
+    size_t            count;
+};
+
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct slab_class slab_classes[CONNPOOL_SLAB_CLASSES];
+static clientconn_info *free_conns;
+static size_t free_conn_count;
+
+static size_t class_size(int cls) {
+    return (size_t) CONNPOOL_INLINE_SIZE << (2 * (cls + 1));
+}
+
+// smallest class holding @param size bytes, CONNPOOL_SLAB_CLASSES when too big for any
+static int class_of(size_t size) {
+    int cls = 0;
+    while (cls < CONNPOOL_SLAB_CLASSES && class_size(cls) < size) {
+        cls++;
+    }
+    return cls;
+}
+
+static void *pool_malloc(size_t size) {
+    metrics_add(METRIC_POOL_ALLOCATIONS, 1);
+    return malloc(size);
+}
+
+static char *slab_get(int cls) {
+    struct free_slab *slab = NULL;
+
+    pthread_mutex_lock(&pool_mutex);
+    if ((slab = slab_classes[cls].free) != NULL) {
+        slab_classes[cls].free = slab->next;
+        slab_classes[cls].count--;
+    }
+    pthread_mutex_unlock(&pool_mutex);
+
+    return slab ? (char *) slab : pool_malloc(class_size(cls));
+}
+
+static void slab_put(char *buf, size_t size) {
+    int cls = class_of(size);
+
+    if (cls < CONNPOOL_SLAB_CLASSES) {
+        pthread_mutex_lock(&pool_mutex);
+        if (slab_classes[cls].count < CONNPOOL_CACHE_BYTES / size) {
+            struct free_slab *slab = (struct free_slab *) buf;
+            slab->next = slab_classes[cls].free;
+            slab_classes[cls].free = slab;
+            slab_classes[cls].count++;
+            buf = NULL;
+        }
+        pthread_mutex_unlock(&pool_mutex);
+    }
+    free(buf);
+}
+
+clientconn_info *connpool_get() {
+    clientconn_info *info;
+
+    pthread_mutex_lock(&pool_mutex);
+    if ((info = free_conns) != NULL) {
+        free_conns = SLIST_NEXT(info, next);
+        free_conn_count--;
+    }
+    pthread_mutex_unlock(&pool_mutex);
+
+    if (!info && !(info = pool_malloc(sizeof(*info)))) {
+        return NULL;
+    }
+    info->conn.buffer = info->conn.inline_buffer;
+    info->conn.buffer_size = sizeof(info->conn.inline_buffer);
+    info->conn.buffer[0] = '\0';
+
+    return info;
+}
+
+void connpool_put(clientconn_info *info) {
+    pthread_mutex_lock(&pool_mutex);
+    if (free_conn_count < CONNPOOL_CACHE_CONNS) {
+        SLIST_NEXT(info, next) = free_conns;
+        free_conns = info;
+        free_conn_count++;
+        info = NULL;
+    }
+    pthread_mutex_unlock(&pool_mutex);
+    free(info);
+}
+
+int connpool_append(struct aesdsocketclientconn *conn, size_t len, const char *data, size_t n) {
+    if (len + n + 1 > conn->buffer_size) {
+        int cls = class_of(len + n + 1);
+        size_t size;
+        char *buf;
+
+        if (cls < CONNPOOL_SLAB_CLASSES) {
+            size = class_size(cls);
+            buf = slab_get(cls);
+        } else {
+            // beyond the largest slab, grow by doubling on the heap
+            size = conn->buffer_size * 2 > len + n + 1 ? conn->buffer_size * 2 : len + n + 1;
+            buf = pool_malloc(size);
+        }
+        if (!buf) {
+            return -1;
+        }
+        memcpy(buf, conn->buffer, len);
+        connpool_release_buffer(conn);
+        conn->buffer = buf;
+        conn->buffer_size = size;
+    }
+    memcpy(conn->buffer + len, data, n);
+    conn->buffer[len + n] = '\0';
+
+    return 0;
+}
+
+void connpool_release_buffer(struct aesdsocketclientconn *conn) {
+    if (conn->buffer != conn->inline_buffer) {
+        slab_put(conn->buffer, conn->buffer_size);
+        conn->buffer = conn->inline_buffer;
+        conn->buffer_size = sizeof(conn->inline_buffer);
+    }
+    conn->buffer[0] = '\0';
+}
+
+void connpool_destroy() {
+    pthread_mutex_lock(&pool_mutex);
+    for (int cls = 0; cls < CONNPOOL_SLAB_CLASSES; cls++) {
+        while (slab_classes[cls].free) {
+            struct free_slab *slab = slab_classes[cls].free;
+            slab_classes[cls].free = slab->next;
+            free(slab);
+        }
+        slab_classes[cls].count = 0;
+    }
+    while (free_conns) {
+        clientconn_info *info = free_conns;
+        free_conns = SLIST_NEXT(info, next);
+        free(info);
+    }
+    free_conn_count = 0;
+    pthread_mutex_unlock(&pool_mutex);
+}
@@ -0,0 +1,61 @@
+#ifndef AESDSOCKET_CONNPOOL_H
+#define AESDSOCKET_CONNPOOL_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include "queue.h"
+#include "registry.h"
+
+/*
+ * Connection objects are recycled through a free list instead of being freed. Each one
+ * carries the client address and a small line buffer inline; longer lines move to slabs
+ * of size classes CONNPOOL_INLINE_SIZE * 4^n, which are recycled through per class free
+ * lists as well. Only lines above the largest class fall back to malloc().
+ */
+#define CONNPOOL_INLINE_SIZE 128
+#define CONNPOOL_SLAB_CLASSES 7                 // 512 bytes ... 2 MiB
+// idle memory kept per slab class, and idle connection objects kept, before freeing
+#define CONNPOOL_CACHE_BYTES (4*1024*1024)
+#define CONNPOOL_CACHE_CONNS 1024
+
+struct aesdsocketclientconn {
+    int                 data_fd;
+    int                 client_fd;
+    char                client_ip_addr[INET_ADDRSTRLEN];
+    pthread_mutex_t*    mutex;
+    char*               buffer;     // NUL terminated line, inline_buffer or a slab
+    size_t              buffer_size;
+    size_t              buffered;   // received bytes not committed yet, counted against the in-flight limit
+    int                 compress;   // enum compress_method of the echo
+    char                inline_buffer[CONNPOOL_INLINE_SIZE];
+};
+
+typedef struct _clientconn_info {
+    SLIST_ENTRY(_clientconn_info) next;     // free list link while pooled
+    registry_handle handle;
+    struct aesdsocketclientconn conn;
+} clientconn_info;
+
+/*
+ * Returns a connection with an empty inline line buffer, the other fields are left to
+ * the caller. Returns NULL when out of memory.
+ */
+clientconn_info *connpool_get();
+/*
+ * Recycles @param info, its line buffer must have been released already.
+ */
+void connpool_put(clientconn_info *info);
+/*
+ * Appends @param n bytes to the line buffer holding @param len bytes, moving it to a
+ * bigger slab when needed. Returns -1 when out of memory, the line buffer is unchanged.
+ */
+int connpool_append(struct aesdsocketclientconn *conn, size_t len, const char *data, size_t n);
+/*
+ * Returns a slab held by the line buffer to the pool and switches back to the inline buffer.
+ */
+void connpool_release_buffer(struct aesdsocketclientconn *conn);
+// frees everything cached
+void connpool_destroy();
+
+#endif
@@ -0,0 +1,103 @@
+#include "crc32c.h"
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+// reflected Castagnoli polynomial
+#define CRC32C_POLY 0x82f63b78
+
+static uint32_t table[8][256];
+static uint32_t (*crc32c_impl)(uint32_t crc, const unsigned char *p, size_t len);
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len) {
+    while (len > 0 && ((uintptr_t) p & 7) != 0) {
+        crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        word ^= crc;
+        crc = table[7][word & 0xff] ^ table[6][(word >> 8) & 0xff] ^
+            table[5][(word >> 16) & 0xff] ^ table[4][(word >> 24) & 0xff] ^
+            table[3][(word >> 32) & 0xff] ^ table[2][(word >> 40) & 0xff] ^
+            table[1][(word >> 48) & 0xff] ^ table[0][word >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len) {
+    uint64_t crc64 = crc;
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        p += 8;
+        len -= 8;
+    }
+    crc = crc64;
+    while (len > 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+        len--;
+    }
+    return crc;
+}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len) {
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        crc = __crc32cd(crc, word);
+        p += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        crc = __crc32cb(crc, *p++);
+        len--;
+    }
+    return crc;
+}
+#endif
+
+static void crc32c_init() {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = n;
+        for (int k = 0; k < 8; k++) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        table[0][n] = crc;
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+        for (int k = 1; k < 8; k++) {
+            table[k][n] = table[0][table[k - 1][n] & 0xff] ^ (table[k - 1][n] >> 8);
+        }
+    }
+
+    crc32c_impl = crc32c_sw;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_impl = crc32c_hw;
+    }
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+    crc32c_impl = crc32c_hw;
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+    pthread_once(&crc32c_once, crc32c_init);
+    return ~crc32c_impl(~crc, buf, len);
+}
@@ -0,0 +1,14 @@
+#ifndef AESDSOCKET_CRC32C_H
+#define AESDSOCKET_CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * CRC32C (Castagnoli) of @param len bytes at @param buf, continuing from @param crc
+ * (0 for the first chunk). Uses the SSE4.2 / ARMv8 crc32c instructions when the CPU
+ * has them and a slicing-by-8 table otherwise.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "datafile.h"
 #include <stdlib.h>
 #include <sys/types.h>
@@ -5,51 +6,743 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
-#include <syslog.h>
+#include "log.h"
 #include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include "crc32c.h"
+#include "../aesd-char-driver/aesd-ring-buffer.h"
 
 #if USE_AESD_CHAR_DEVICE == 1
 #include <sys/ioctl.h>
 #include "../aesd-char-driver/aesd_ioctl.h"
 #endif
 
+#if USE_AESD_CHAR_DEVICE == 0
+struct datafile_segment {
+    unsigned int seq;
+    off_t        base;     // logical offset of the first byte
+    size_t       size;
+    size_t       disk_size; // size plus the record headers in persistent mode
+    time_t       created;
+    time_t       sealed;
+};
+
+AESD_RING_DECLARE(segment_ring, struct datafile_segment, DATAFILE_MAX_SEGMENTS)
+
+static struct datafile_config datafile_cfg;
+static struct segment_ring sealed_segments;
+static struct datafile_segment head;
+static int head_fd = -1;
+// last sealed segment opened for reading, echoes read the segments in order
+static int cached_fd = -1;
+static unsigned int cached_seq;
+
+// bytes read at once when scanning or reading records in persistent mode
+#define DATAFILE_READ_SIZE (128*1024)
+/*
+ * Persistent mode: record boundary reached by the last read. Echoes read the log in
+ * order, so the next read continues from here instead of walking the segment again.
+ */
+static struct {
+    unsigned int seq;
+    off_t        offset;      // logical offset within the segment
+    off_t        disk_offset;
+} read_cursor;
+static char *read_buffer;
+
+/*
+ * Durability state, guarded by sync_mutex. The sync thread fdatasync()s a dup of
+ * sync_fd so it never holds the data file lock; a rotation syncs the old head itself
+ * before swapping sync_fd, so everything before the new head is durable already.
+ */
+static pthread_mutex_t sync_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sync_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t durable_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t sync_thread;
+static int sync_running;
+static int sync_stopping;
+static int sync_fd = -1;
+static off_t written_end;
+static off_t durable_end;
+
+static void segment_path(char *path, size_t size, unsigned int seq) {
+    snprintf(path, size, "%s.%06u", DATA_FILE_PATH, seq);
+}
+
+static int open_head(int flags) {
+    head_fd = open(DATA_FILE_PATH, O_CREAT | O_RDWR | O_APPEND | flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+    if (head_fd < 0) {
+        aesd_syslog(LOG_ERR, "Failure to open/create file - %s: %s", DATA_FILE_PATH, strerror(errno));
+    }
+    return head_fd;
+}
+
+static void sync_directory() {
+    char dir_path[PATH_MAX];
+    strcpy(dir_path, DATA_FILE_PATH);
+    *strrchr(dir_path, '/') = '\0';
+
+    int dir_fd = open(dir_path, O_RDONLY | O_DIRECTORY);
+    if (dir_fd < 0 || fsync(dir_fd) != 0) {
+        aesd_syslog(LOG_ERR, "Failure to sync directory - %s: %s", dir_path, strerror(errno));
+    }
+    if (dir_fd >= 0) {
+        close(dir_fd);
+    }
+}
+
+static void mark_durable(off_t end) {
+    pthread_mutex_lock(&sync_mutex);
+    if (end > durable_end) {
+        durable_end = end;
+        pthread_cond_broadcast(&durable_cond);
+    }
+    pthread_mutex_unlock(&sync_mutex);
+}
+
+static void* sync_loop(void* param) {
+    pthread_mutex_lock(&sync_mutex);
+    while (!sync_stopping) {
+        if (datafile_cfg.durability == DURABILITY_PERIODIC) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_sec += datafile_cfg.sync_interval / 1000;
+            deadline.tv_nsec += (datafile_cfg.sync_interval % 1000) * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            while (!sync_stopping && pthread_cond_clockwait(&sync_cond, &sync_mutex, CLOCK_MONOTONIC, &deadline) == 0);
+        } else {
+            while (!sync_stopping && written_end <= durable_end) {
+                pthread_cond_wait(&sync_cond, &sync_mutex);
+            }
+            if (datafile_cfg.sync_interval > 0) {
+                // let more appenders join the group
+                pthread_mutex_unlock(&sync_mutex);
+                usleep(datafile_cfg.sync_interval * 1000);
+                pthread_mutex_lock(&sync_mutex);
+            }
+        }
+        if (written_end <= durable_end) {
+            continue;
+        }
+
+        off_t target = written_end;
+        int fd = dup(sync_fd);
+        pthread_mutex_unlock(&sync_mutex);
+
+        if (fd < 0 || fdatasync(fd) != 0) {
+            aesd_syslog(LOG_ERR, "Failure to sync the datafile: %s", strerror(errno));
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        mark_durable(target);
+
+        pthread_mutex_lock(&sync_mutex);
+    }
+    pthread_mutex_unlock(&sync_mutex);
+
+    return NULL;
+}
+
+static int start_sync_thread() {
+    int rc = pthread_create(&sync_thread, NULL, sync_loop, NULL);
+    if (rc != 0) {
+        aesd_syslog(LOG_ERR, "Failure to create sync thread. Error code: %d", rc);
+        return -1;
+    }
+    sync_running = 1;
+
+    return 0;
+}
+
+static void stop_sync_thread() {
+    if (!sync_running) {
+        return;
+    }
+    pthread_mutex_lock(&sync_mutex);
+    sync_stopping = 1;
+    pthread_cond_signal(&sync_cond);
+    pthread_mutex_unlock(&sync_mutex);
+    pthread_join(sync_thread, NULL);
+    sync_running = 0;
+}
+
+static void unlock_sync_mutex(void *param) {
+    pthread_mutex_unlock(&sync_mutex);
+}
+
+static void drop_oldest_segment() {
+    struct datafile_segment segment;
+    char path[PATH_MAX];
+
+    if (!segment_ring_pop(&sealed_segments, &segment)) {
+        return;
+    }
+    if (cached_fd >= 0 && cached_seq == segment.seq) {
+        close(cached_fd);
+        cached_fd = -1;
+    }
+    segment_path(path, sizeof(path), segment.seq);
+    if (unlink(path) != 0) {
+        aesd_syslog(LOG_ERR, "Failure to remove segment - %s: %s", path, strerror(errno));
+    } else {
+        aesd_syslog(LOG_INFO, "Dropped segment %s with %zu bytes", path, segment.size);
+    }
+}
+
+static int rotate_head(time_t now) {
+    char path[PATH_MAX];
+
+    if (segment_ring_full(&sealed_segments)) {
+        // retention did not keep the log under the limit, see DATAFILE_MAX_SEGMENTS
+        aesd_syslog(LOG_WARNING, "%d sealed segments kept already, dropping the oldest", DATAFILE_MAX_SEGMENTS);
+        drop_oldest_segment();
+    }
+    if (datafile_cfg.durability != DURABILITY_NONE && fdatasync(head_fd) != 0) {
+        aesd_syslog(LOG_ERR, "Failure to sync the datafile: %s", strerror(errno));
+    }
+    segment_path(path, sizeof(path), head.seq);
+    if (rename(DATA_FILE_PATH, path) != 0) {
+        aesd_syslog(LOG_ERR, "Failure to seal segment - %s: %s", path, strerror(errno));
+        return -1;
+    }
+    close(head_fd);
+
+    head.sealed = now;
+    segment_ring_push(&sealed_segments, &head);
+    aesd_syslog(LOG_INFO, "Sealed segment %s with %zu bytes", path, head.size);
+
+    head.seq++;
+    head.base += head.size;
+    head.size = 0;
+    head.disk_size = 0;
+    head.created = now;
+
+    if (open_head(O_TRUNC) < 0) {
+        return -1;
+    }
+    if (datafile_cfg.durability != DURABILITY_NONE) {
+        // the rename and the new head must survive a crash as well
+        sync_directory();
+        pthread_mutex_lock(&sync_mutex);
+        close(sync_fd);
+        sync_fd = dup(head_fd);
+        pthread_mutex_unlock(&sync_mutex);
+        mark_durable(head.base);
+    }
+
+    return 0;
+}
+
+static void apply_retention(time_t now) {
+    struct datafile_segment *oldest;
+
+    while ((oldest = segment_ring_peek(&sealed_segments)) != NULL) {
+        int too_big = datafile_cfg.retention_bytes > 0 &&
+            (size_t)(datafile_end() - oldest->base) > datafile_cfg.retention_bytes;
+        int too_old = datafile_cfg.retention_age > 0 && now - oldest->sealed > datafile_cfg.retention_age;
+        if (!too_big && !too_old) {
+            break;
+        }
+        drop_oldest_segment();
+    }
+}
+
+static uint32_t record_crc(const struct datafile_record *record, const void *payload) {
+    return crc32c(crc32c(0, &record->len, sizeof(record->len)), payload, record->len);
+}
+
+/*
+ * Persistent mode: checks the records of a segment file and truncates it right after
+ * the last intact one. Sets the logical and on-disk size of @param segment, a missing
+ * file is an empty segment.
+ */
+static int recover_segment(const char *path, struct datafile_segment *segment) {
+    struct datafile_record record;
+    struct stat st;
+
+    segment->size = segment->disk_size = 0;
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        aesd_syslog(LOG_ERR, "Failure to open segment - %s: %s", path, strerror(errno));
+        return -1;
+    }
+    if (fstat(fd, &st) != 0) {
+        aesd_syslog(LOG_ERR, "Failure to stat segment - %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    size_t capacity = DATAFILE_READ_SIZE, have = 0;
+    char *chunk = malloc(capacity);
+    if (chunk == NULL) {
+        aesd_syslog(LOG_ERR, "Failure to allocate %zu bytes to recover %s", capacity, path);
+        close(fd);
+        errno = ENOMEM;
+        return -1;
+    }
+    off_t valid_end = 0;      // file offset of chunk[0], everything before it is intact
+    int torn = 0, rc = 0, out_of_memory = 0;
+    while (!torn) {
+        ssize_t n = read(fd, chunk + have, capacity - have);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            aesd_syslog(LOG_ERR, "Failure to read segment - %s: %s", path, strerror(errno));
+            rc = -1;
+            break;
+        }
+        have += n;
+
+        size_t p = 0;
+        while (have - p >= sizeof(record)) {
+            memcpy(&record, chunk + p, sizeof(record));
+            if (record.len == 0 || record.len > st.st_size - (valid_end + p + sizeof(record))) {
+                torn = 1;
+                break;
+            }
+            if (have - p < sizeof(record) + record.len) {
+                break;
+            }
+            if (record_crc(&record, chunk + p + sizeof(record)) != record.crc) {
+                torn = 1;
+                break;
+            }
+            p += sizeof(record) + record.len;
+            segment->size += record.len;
+        }
+        memmove(chunk, chunk + p, have - p);
+        have -= p;
+        valid_end += p;
+
+        if (n == 0) {
+            // a header or payload cut short by the end of the file
+            torn = have > 0;
+            break;
+        }
+        if (!torn && have >= sizeof(record) && sizeof(record) + record.len > capacity) {
+            char *grown = realloc(chunk, sizeof(record) + record.len);
+            if (grown == NULL) {
+                aesd_syslog(LOG_ERR, "Failure to allocate %zu bytes to recover %s",
+                        sizeof(record) + record.len, path);
+                rc = -1;
+                out_of_memory = 1;
+                break;
+            }
+            chunk = grown;
+            capacity = sizeof(record) + record.len;
+        }
+    }
+    free(chunk);
+
+    if (rc == 0 && torn) {
+        aesd_syslog(LOG_WARNING, "Truncating %s after the last intact record: %lld of %lld bytes kept",
+                path, (long long) valid_end, (long long) st.st_size);
+        if (ftruncate(fd, valid_end) != 0 || fdatasync(fd) != 0) {
+            aesd_syslog(LOG_ERR, "Failure to truncate segment - %s: %s", path, strerror(errno));
+            rc = -1;
+        }
+    }
+    segment->disk_size = valid_end;
+    close(fd);
+    if (out_of_memory) {
+        errno = ENOMEM;
+    }
+
+    return rc;
+}
+
+static int compare_segment_seq(const void *a, const void *b) {
+    unsigned int x = ((const struct datafile_segment *) a)->seq, y = ((const struct datafile_segment *) b)->seq;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Collects DATA_FILE_PATH.<seq> files left by a previous run, in sequence order. Only the
+ * newest DATAFILE_MAX_SEGMENTS are picked up, older files are left alone on disk.
+ */
+static int discover_segments() {
+    char dir_path[PATH_MAX], path[PATH_MAX];
+    strcpy(dir_path, DATA_FILE_PATH);
+    char *slash = strrchr(dir_path, '/');
+    const char *prefix = slash + 1;
+    *slash = '\0';
+    size_t prefix_len = strlen(prefix);
+
+    DIR *dir = opendir(dir_path);
+    if (!dir) {
+        aesd_syslog(LOG_ERR, "Failure to open directory - %s: %s", dir_path, strerror(errno));
+        return -1;
+    }
+
+    struct datafile_segment *found = NULL;
+    size_t count = 0, capacity = 0;
+    int rc = 0;
+    struct dirent *dent;
+    while ((dent = readdir(dir)) != NULL) {
+        char *end;
+        if (strncmp(dent->d_name, prefix, prefix_len) != 0 || dent->d_name[prefix_len] != '.') {
+            continue;
+        }
+        unsigned long seq = strtoul(dent->d_name + prefix_len + 1, &end, 10);
+        if (*end != '\0' || end == dent->d_name + prefix_len + 1) {
+            continue;
+        }
+        struct stat st;
+        segment_path(path, sizeof(path), seq);
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        if (count == capacity) {
+            size_t size = capacity ? capacity * 2 : 64;
+            struct datafile_segment *bigger = realloc(found, size * sizeof(*found));
+            if (!bigger) {
+                aesd_syslog(LOG_ERR, "%s", "Failure to allocate the segment list");
+                rc = -1;
+                break;
+            }
+            found = bigger;
+            capacity = size;
+        }
+        found[count].seq = seq;
+        found[count].size = found[count].disk_size = st.st_size;
+        found[count].created = st.st_mtime;
+        found[count].sealed = st.st_mtime;
+        count++;
+    }
+    closedir(dir);
+    if (rc != 0) {
+        free(found);
+        return rc;
+    }
+
+    qsort(found, count, sizeof(*found), compare_segment_seq);
+    size_t first = 0;
+    if (count > DATAFILE_MAX_SEGMENTS) {
+        first = count - DATAFILE_MAX_SEGMENTS;
+        aesd_syslog(LOG_WARNING, "%zu segments found, ignoring the %zu oldest up to %s.%u",
+                count, first, DATA_FILE_PATH, found[first - 1].seq);
+    }
+    off_t base = 0;
+    for (size_t i = first; i < count; i++) {
+        if (datafile_cfg.persistent) {
+            segment_path(path, sizeof(path), found[i].seq);
+            if (recover_segment(path, &found[i]) != 0) {
+                rc = -1;
+                break;
+            }
+        }
+        found[i].base = base;
+        base += found[i].size;
+        segment_ring_push(&sealed_segments, &found[i]);
+    }
+    head.seq = count > 0 ? found[count - 1].seq + 1 : 0;
+    head.base = base;
+    free(found);
+
+    return rc;
+}
+
+static int open_sealed(const struct datafile_segment *segment) {
+    char path[PATH_MAX];
+
+    if (cached_fd >= 0 && cached_seq == segment->seq) {
+        return cached_fd;
+    }
+    if (cached_fd >= 0) {
+        close(cached_fd);
+    }
+    segment_path(path, sizeof(path), segment->seq);
+    cached_fd = open(path, O_RDONLY);
+    cached_seq = segment->seq;
+    if (cached_fd < 0) {
+        aesd_syslog(LOG_ERR, "Failure to open segment - %s: %s", path, strerror(errno));
+    }
+    return cached_fd;
+}
+#endif
+
+int init_datafile(const struct datafile_config *cfg) {
+#if USE_AESD_CHAR_DEVICE == 0
+    datafile_cfg = *cfg;
+    if (datafile_cfg.segment_size == 0) {
+        datafile_cfg.segment_size = DATAFILE_SEGMENT_SIZE;
+    }
+    segment_ring_init(&sealed_segments);
+    if (discover_segments() != 0) {
+        return -1;
+    }
+    if (datafile_cfg.persistent) {
+        read_buffer = malloc(DATAFILE_READ_SIZE);
+        if (read_buffer == NULL) {
+            aesd_syslog(LOG_ERR, "Failure to allocate the %d byte read buffer", DATAFILE_READ_SIZE);
+            errno = ENOMEM;
+            return -1;
+        }
+        if (recover_segment(DATA_FILE_PATH, &head) != 0) {
+            return -1;
+        }
+    }
+    if (open_head(0) < 0) {
+        return -1;
+    }
+    if (!datafile_cfg.persistent) {
+        struct stat st;
+        if (fstat(head_fd, &st) != 0) {
+            aesd_syslog(LOG_ERR, "Failure to stat file - %s: %s", DATA_FILE_PATH, strerror(errno));
+            return -1;
+        }
+        head.size = head.disk_size = st.st_size;
+    }
+    head.created = time(NULL);
+    apply_retention(head.created);
+
+    written_end = durable_end = datafile_end();
+    if (datafile_cfg.durability == DURABILITY_PERIODIC && datafile_cfg.sync_interval == 0) {
+        datafile_cfg.sync_interval = DATAFILE_SYNC_INTERVAL;
+    }
+    if (datafile_cfg.durability == DURABILITY_PERIODIC || datafile_cfg.durability == DURABILITY_BATCH) {
+        sync_fd = dup(head_fd);
+        // after daemonizing, threads do not survive fork()
+        return start_sync_thread();
+    }
+
+    return 0;
+#else
+    // open and close data file
+    int fd = open_datafile();
+    if (fd < 0) {
+        return -1;
+    }
+    close_datafile(fd);
+
+    return 0;
+#endif
+}
+
 int open_datafile() {
+#if USE_AESD_CHAR_DEVICE == 1
     int fd = open(DATA_FILE_PATH, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
     if (fd < 0) {
-        syslog(LOG_ERR, "Failure to open/create file - %s: %s", DATA_FILE_PATH, strerror(errno));
+        aesd_syslog(LOG_ERR, "Failure to open/create file - %s: %s", DATA_FILE_PATH, strerror(errno));
     }
 
     return fd;
+#else
+    return DATAFILE_SHARED;
+#endif
 }
 
 void close_datafile(int fd) {
     if (fd > 0) {
         int rc = close(fd);
         if (rc < 0) {
-            syslog(LOG_ERR, "Failure to close file - %s: %s", DATA_FILE_PATH, strerror(errno));
+            aesd_syslog(LOG_ERR, "Failure to close file - %s: %s", DATA_FILE_PATH, strerror(errno));
         } 
     }
 }
 
 void destroy_datafile() {
-    if (!USE_AESD_CHAR_DEVICE) {
-        remove(DATA_FILE_PATH);
+#if USE_AESD_CHAR_DEVICE == 0
+    stop_sync_thread();
+    if (sync_fd >= 0) {
+        close(sync_fd);
+        sync_fd = -1;
+    }
+    if (cached_fd >= 0) {
+        close(cached_fd);
+        cached_fd = -1;
+    }
+    free(read_buffer);
+    read_buffer = NULL;
+    if (datafile_cfg.persistent) {
+        // the log outlives the server, only make sure the tail is on disk
+        if (head_fd >= 0 && fdatasync(head_fd) != 0) {
+            aesd_syslog(LOG_ERR, "Failure to sync the datafile: %s", strerror(errno));
+        }
     }
+    if (head_fd >= 0) {
+        close(head_fd);
+        head_fd = -1;
+    }
+    if (datafile_cfg.persistent) {
+        return;
+    }
+    while (!segment_ring_empty(&sealed_segments)) {
+        drop_oldest_segment();
+    }
+    remove(DATA_FILE_PATH);
+#endif
 }
 
-int adjust_datafile_pos(int fd, int offset, int pos_kind) {
+void datafile_wait_durable(off_t end) {
 #if USE_AESD_CHAR_DEVICE == 0
-    // put cursor to the end of file
-    int rc = lseek(fd, offset, pos_kind);
-    if (rc == -1) {
-        syslog(LOG_ERR, "Failure to reposition cursor file to the EOF: %s", strerror(errno));
+    if (datafile_cfg.durability != DURABILITY_BATCH) {
+        return;
     }
+    pthread_mutex_lock(&sync_mutex);
+    // pthread_cond_wait() is a cancellation point
+    pthread_cleanup_push(unlock_sync_mutex, NULL);
+    while (durable_end < end && sync_running && !sync_stopping) {
+        pthread_cond_wait(&durable_cond, &sync_mutex);
+    }
+    pthread_cleanup_pop(1);
+#endif
+}
+
+off_t datafile_begin() {
+#if USE_AESD_CHAR_DEVICE == 0
+    struct datafile_segment *oldest = segment_ring_peek(&sealed_segments);
+    return oldest ? oldest->base : head.base;
 #else
-    int rc = 0;
-#endif    
-    return rc;
+    return 0;
+#endif
 }
 
+off_t datafile_end() {
+#if USE_AESD_CHAR_DEVICE == 0
+    return head.base + head.size;
+#else
+    return 0;
+#endif
+}
+
+#if USE_AESD_CHAR_DEVICE == 0
+/*
+ * Copies the payload of the records of @param segment from logical offset @param offset
+ * (relative to the segment) into @param buf, skipping the headers.
+ */
+static ssize_t read_records(const struct datafile_segment *segment, int fd, off_t offset, char *buf, size_t len) {
+    struct datafile_record record;
+    size_t copied = 0;
+
+    if (read_cursor.seq != segment->seq || read_cursor.offset > offset) {
+        read_cursor.seq = segment->seq;
+        read_cursor.offset = 0;
+        read_cursor.disk_offset = 0;
+    }
+    while (copied < len && read_cursor.disk_offset < segment->disk_size) {
+        off_t chunk_start = read_cursor.disk_offset;
+        size_t chunk_len = segment->disk_size - chunk_start;
+        ssize_t n = pread(fd, read_buffer, chunk_len < DATAFILE_READ_SIZE ? chunk_len : DATAFILE_READ_SIZE, chunk_start);
+        if (n < (ssize_t) sizeof(record)) {
+            aesd_syslog(LOG_ERR, "Failure to read segment %u: %s", segment->seq, n < 0 ? strerror(errno) : "truncated");
+            return copied > 0 ? copied : -1;
+        }
+        off_t chunk_end = chunk_start + n;
+
+        while (copied < len && read_cursor.disk_offset + (off_t) sizeof(record) <= chunk_end) {
+            memcpy(&record, read_buffer + (read_cursor.disk_offset - chunk_start), sizeof(record));
+            // payload bytes of this record before the position wanted next
+            off_t skip = offset + copied - read_cursor.offset;
+            if (skip < record.len) {
+                size_t want = record.len - skip < len - copied ? record.len - skip : len - copied;
+                off_t from = read_cursor.disk_offset + sizeof(record) + skip;
+                if (from + (off_t) want <= chunk_end) {
+                    memcpy(buf + copied, read_buffer + (from - chunk_start), want);
+                } else if (pread(fd, buf + copied, want, from) != (ssize_t) want) {
+                    aesd_syslog(LOG_ERR, "Failure to read segment %u: %s", segment->seq, strerror(errno));
+                    return copied > 0 ? copied : -1;
+                }
+                copied += want;
+                if (skip + want < record.len) {
+                    // buf is full, the cursor stays at the start of this record
+                    break;
+                }
+            }
+            read_cursor.offset += record.len;
+            read_cursor.disk_offset += sizeof(record) + record.len;
+        }
+    }
+
+    return copied;
+}
+#endif
+
+#if USE_AESD_CHAR_DEVICE == 0
+// segment holding a retained logical offset
+static const struct datafile_segment *segment_at(off_t offset) {
+    if (offset >= head.base) {
+        return &head;
+    }
+    // last sealed segment starting at or before offset
+    size_t lo = 0, hi = segment_ring_count(&sealed_segments) - 1;
+    while (lo < hi) {
+        size_t mid = (lo + hi + 1) / 2;
+        if (segment_ring_at(&sealed_segments, mid)->base <= offset) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return segment_ring_at(&sealed_segments, lo);
+}
+#endif
+
+off_t datafile_sealed_end(off_t offset) {
+#if USE_AESD_CHAR_DEVICE == 0
+    if (offset < datafile_begin() || offset >= head.base) {
+        return 0;
+    }
+    const struct datafile_segment *segment = segment_at(offset);
+    return segment->base + segment->size;
+#else
+    return 0;
+#endif
+}
+
+ssize_t read_datafile_range(off_t offset, char *buf, size_t len) {
+#if USE_AESD_CHAR_DEVICE == 0
+    const struct datafile_segment *segment;
+    int fd = head_fd;
+
+    if (offset < datafile_begin() || offset >= datafile_end()) {
+        return 0;
+    }
+    segment = segment_at(offset);
+    if (segment != &head) {
+        if ((fd = open_sealed(segment)) < 0) {
+            return -1;
+        }
+    }
+
+    if (datafile_cfg.persistent) {
+        return read_records(segment, fd, offset - segment->base, buf, len);
+    }
+    size_t avail = segment->size - (offset - segment->base);
+    ssize_t n = pread(fd, buf, len < avail ? len : avail, offset - segment->base);
+    if (n < 0) {
+        aesd_syslog(LOG_ERR, "Failure to read segment %u: %s", segment->seq, strerror(errno));
+    }
+    return n;
+#else
+    return -1;
+#endif
+}
+
+ssize_t read_datafile(int fd, off_t *pos, char *buf, size_t len) {
+#if USE_AESD_CHAR_DEVICE == 0
+    ssize_t n = read_datafile_range(*pos, buf, len);
+    if (n > 0) {
+        *pos += n;
+    }
+    return n;
+#else
+    return read(fd, buf, len);
+#endif
+}
+
+#if USE_AESD_CHAR_DEVICE == 1
 int parse_seekto_cmd(char *buf, int size, struct aesd_seekto *seekto) {
     const char *match_cmd = "AESDCHAR_IOCSEEKTO:";
     char *cmd;
@@ -90,28 +783,80 @@ int parse_seekto_cmd(char *buf, int size, struct aesd_seekto *seekto) {
 
     return -1;
 }
+#endif
 
-
-void append_datafile(int fd, char *buf, int size) {
+off_t append_datafile(int fd, char *buf, int size) {
 #if USE_AESD_CHAR_DEVICE == 1
     struct aesd_seekto seekto;
     memset(&seekto, 0, sizeof(seekto));
 
     if (parse_seekto_cmd(buf, size, &seekto) != -1) {
         if (ioctl(fd, AESDCHAR_IOCSEEKTO, &seekto) != 0) {
-            syslog(LOG_ERR, "Failure to write to the datafile: %s", strerror(errno));
+            aesd_syslog(LOG_ERR, "Failure to write to the datafile: %s", strerror(errno));
         }
-    } else 
-#endif    
-    if (write(fd, buf, size) == -1) {
-        syslog(LOG_ERR, "Failure to write to the datafile: %s", strerror(errno));
+    } else if (write(fd, buf, size) == -1) {
+        aesd_syslog(LOG_ERR, "Failure to write to the datafile: %s", strerror(errno));
     }
-}
 
-void append_string(char **buf, size_t* maxbuflen, size_t buflen, char *in_buf, int n) {
-    if (*maxbuflen < buflen + n + 1) {
-        *maxbuflen += buflen + 2*n;
-        *buf = realloc(*buf, *maxbuflen);
-    } 
-    strncat(*buf, in_buf, n);
+    return 0;
+#else
+    time_t now = time(NULL);
+    // lines never span segments, the head is sealed before it would overflow
+    size_t record_size = size + (datafile_cfg.persistent ? sizeof(struct datafile_record) : 0);
+    if (head.disk_size > 0 && (head.disk_size + record_size > datafile_cfg.segment_size ||
+            (datafile_cfg.segment_age > 0 && now - head.created >= datafile_cfg.segment_age))) {
+        rotate_head(now);
+    }
+    size_t head_offset = head.disk_size;
+    ssize_t n;
+    if (datafile_cfg.persistent) {
+        struct datafile_record record = { .len = size };
+        record.crc = record_crc(&record, buf);
+        struct iovec iov[2] = { { &record, sizeof(record) }, { buf, size } };
+        n = writev(head_fd, iov, 2);
+        if (n >= 0 && n != record_size) {
+            // drop the partial record, anything appended after it would be lost at the next start
+            if (ftruncate(head_fd, head_offset) != 0) {
+                aesd_syslog(LOG_ERR, "Failure to truncate the datafile: %s", strerror(errno));
+            }
+            errno = EIO;
+            n = -1;
+        }
+    } else {
+        n = write(head_fd, buf, size);
+    }
+    if (n == -1) {
+        aesd_syslog(LOG_ERR, "Failure to write to the datafile: %s", strerror(errno));
+        return -1;
+    }
+    head.disk_size += n;
+    head.size += datafile_cfg.persistent ? size : n;
+
+    switch (datafile_cfg.durability) {
+        case DURABILITY_LINE:
+            if (fdatasync(head_fd) != 0) {
+                aesd_syslog(LOG_ERR, "Failure to sync the datafile: %s", strerror(errno));
+            }
+            break;
+        case DURABILITY_PERIODIC:
+            // start writeback now so the periodic fdatasync has little left to flush
+            if (sync_file_range(head_fd, head_offset, n, SYNC_FILE_RANGE_WRITE) != 0) {
+                aesd_syslog(LOG_ERR, "Failure to start writeback of the datafile: %s", strerror(errno));
+            }
+            /* fall through */
+        case DURABILITY_BATCH:
+            pthread_mutex_lock(&sync_mutex);
+            written_end = datafile_end();
+            pthread_cond_signal(&sync_cond);
+            pthread_mutex_unlock(&sync_mutex);
+            break;
+        case DURABILITY_NONE:
+            break;
+    }
+
+    off_t end = datafile_end();
+    apply_retention(now);
+
+    return end;
+#endif
 }
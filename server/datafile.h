@@ -1,4 +1,9 @@
+#ifndef AESDSOCKET_DATAFILE_H
+#define AESDSOCKET_DATAFILE_H
+
 #include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
 
 #ifndef USE_AESD_CHAR_DEVICE
 #   define USE_AESD_CHAR_DEVICE 1
@@ -10,9 +15,91 @@
 #   define DATA_FILE_PATH "/var/tmp/aesdsocketdata"
 #endif
 
+/*
+ * In data file mode the log is stored as a sequence of segment files: DATA_FILE_PATH is
+ * the active head segment, sealed segments are renamed to DATA_FILE_PATH.<seq>.
+ * Offsets used by the read functions are logical offsets into the whole log and keep
+ * growing when old segments are dropped.
+ *
+ * In persistent mode every line is written as a record: a struct datafile_record header
+ * (payload length and CRC32C) followed by the line. Segments are checked at startup and
+ * cut after the last intact record, so a crash mid-write never leaves a torn line in
+ * the log, and the segments are kept on shutdown. Offsets still count payload bytes only.
+ */
+#define DATAFILE_SEGMENT_SIZE (16*1024*1024)
+/*
+ * Sealed segments kept at most, whatever the retention settings: sealing one more drops
+ * the oldest, with a warning. The log is therefore bounded to about DATAFILE_MAX_SEGMENTS
+ * times the segment size even with retention disabled (-r 0 -t 0).
+ */
+#define DATAFILE_MAX_SEGMENTS 1024
+// default ms between syncs with DURABILITY_PERIODIC
+#define DATAFILE_SYNC_INTERVAL 1000
+// returned by open_datafile() in data file mode, the segments are shared by all connections
+#define DATAFILE_SHARED 0
+
+struct datafile_record {
+    uint32_t len;   // payload bytes following the header
+    uint32_t crc;   // CRC32C of len and the payload
+};
+
+enum datafile_durability {
+    DURABILITY_NONE,      // plain write(), left to the page cache
+    DURABILITY_PERIODIC,  // writeback started per append, fdatasync every sync_interval ms
+    DURABILITY_BATCH,     // group commit: appenders wait for a shared fdatasync before the echo
+    DURABILITY_LINE,      // fdatasync after every append
+};
+
+struct datafile_config {
+    size_t       segment_size;    // rotate the head segment before it grows beyond this size
+    unsigned int segment_age;     // rotate the head segment when it is older (seconds), 0 - never
+    size_t       retention_bytes; // drop the oldest sealed segments while the log is bigger, 0 - keep all
+    unsigned int retention_age;   // drop sealed segments sealed longer ago (seconds), 0 - keep all
+    enum datafile_durability durability;
+    unsigned int sync_interval;   // periodic: ms between syncs, batch: ms to gather a group before syncing
+    int          persistent;      // frame lines as checksummed records and keep the log on shutdown
+};
+
+/*
+ * Prepares the data file: checks the char device can be opened, or picks up the segments
+ * left by a previous run in data file mode. Fields left 0 in @param cfg use defaults.
+ */
+int init_datafile(const struct datafile_config *cfg);
 int open_datafile();
 void close_datafile(int fd);
 void destroy_datafile();
-int adjust_datafile_pos(int fd, int offset, int pos_kind);
-void append_datafile(int fd, char *buf, int size);
-void append_string(char **buf, size_t* maxbuflen, size_t buflen, char *in_buf, int n);
\ No newline at end of file
+/*
+ * Blocks until everything up to logical offset @param end is on stable storage.
+ * Only waits with DURABILITY_BATCH, must be called without the data file lock held.
+ */
+void datafile_wait_durable(off_t end);
+/*
+ * The functions below expect the caller to hold the data file lock.
+ */
+/*
+ * Returns the logical offset right after the appended data (0 on the char device).
+ */
+off_t append_datafile(int fd, char *buf, int size);
+/*
+ * Reads the next chunk of the log into @param buf starting at logical offset @param pos and
+ * advances it. The char device reads from the position of @param fd instead.
+ * Returns the number of bytes read, 0 at the end of the log or -1 on error.
+ */
+ssize_t read_datafile(int fd, off_t *pos, char *buf, size_t len);
+/*
+ * Data file mode only: reads up to @param len bytes at logical @param offset. A read never
+ * crosses a segment boundary, so callers loop until 0 is returned.
+ */
+ssize_t read_datafile_range(off_t offset, char *buf, size_t len);
+/*
+ * Returns the end of the sealed segment holding logical @param offset, 0 when the offset
+ * is in the head segment or not retained (and always on the char device). A sealed
+ * segment never changes, so whatever is derived from its range can be cached.
+ */
+off_t datafile_sealed_end(off_t offset);
+// first logical offset still retained
+off_t datafile_begin();
+// logical offset the next append is written to
+off_t datafile_end();
+
+#endif
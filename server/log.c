@@ -0,0 +1,157 @@
+#include "log.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "../aesd-char-driver/aesd-ring-buffer.h"
+
+#define LOG_PRIORITIES (LOG_DEBUG + 1)
+
+struct log_entry {
+    int  priority;
+    char message[LOG_MESSAGE_SIZE];
+};
+
+AESD_MPSC_RING_DECLARE(log_ring, struct log_entry, LOG_RING_SIZE)
+
+struct log_rate {
+    unsigned long window;     // second the counter belongs to
+    unsigned int  count;      // messages accepted in the window
+    unsigned int  limit;
+    unsigned long suppressed; // dropped because of the limit, reported by the drain thread
+};
+
+static struct log_ring ring;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+static unsigned long ring_dropped;
+static struct log_rate rates[LOG_PRIORITIES];
+static sem_t log_sem;
+static pthread_t log_thread;
+static int log_running;
+static volatile int log_stopping;
+
+static void log_init() {
+    log_ring_init(&ring);
+    sem_init(&log_sem, 0, 0);
+    for (int i = 0; i < LOG_PRIORITIES; i++) {
+        rates[i].limit = LOG_DEFAULT_RATE_LIMIT;
+    }
+}
+
+static void log_init_once() {
+    pthread_once(&ring_once, log_init);
+}
+
+void log_set_rate_limit(int priority, unsigned int per_second) {
+    log_init_once();
+    if (priority >= 0 && priority < LOG_PRIORITIES) {
+        __atomic_store_n(&rates[priority].limit, per_second, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Fixed one second window per priority. Resetting the window races with other
+ * producers which only makes the limit approximate, it never blocks.
+ */
+static int rate_allows(int priority) {
+    struct log_rate *rate = &rates[priority];
+    unsigned int limit = __atomic_load_n(&rate->limit, __ATOMIC_RELAXED);
+    if (limit == 0) {
+        return 1;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    unsigned long now = ts.tv_sec;
+    unsigned long window = __atomic_load_n(&rate->window, __ATOMIC_RELAXED);
+    if (window != now && __atomic_compare_exchange_n(&rate->window, &window, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&rate->count, 0, __ATOMIC_RELAXED);
+    }
+    if (__atomic_fetch_add(&rate->count, 1, __ATOMIC_RELAXED) < limit) {
+        return 1;
+    }
+    __atomic_fetch_add(&rate->suppressed, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void log_message(int priority, const char *fmt, ...) {
+    struct log_entry entry;
+    va_list args;
+
+    log_init_once();
+    priority &= LOG_PRIMASK;
+    if (!rate_allows(priority)) {
+        return;
+    }
+
+    entry.priority = priority;
+    va_start(args, fmt);
+    vsnprintf(entry.message, sizeof(entry.message), fmt, args);
+    va_end(args);
+
+    if (log_ring_push(&ring, &entry)) {
+        // only enters the kernel when the drain thread is waiting
+        sem_post(&log_sem);
+    } else {
+        __atomic_fetch_add(&ring_dropped, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void drain() {
+    struct log_entry entry;
+
+    while (log_ring_pop(&ring, &entry)) {
+        syslog(entry.priority, "%s", entry.message);
+    }
+
+    unsigned long dropped = __atomic_exchange_n(&ring_dropped, 0, __ATOMIC_RELAXED);
+    if (dropped > 0) {
+        syslog(LOG_WARNING, "%lu log messages dropped, log queue is full", dropped);
+    }
+    for (int i = 0; i < LOG_PRIORITIES; i++) {
+        unsigned long suppressed = __atomic_exchange_n(&rates[i].suppressed, 0, __ATOMIC_RELAXED);
+        if (suppressed > 0) {
+            syslog(i, "%lu log messages suppressed by rate limit", suppressed);
+        }
+    }
+}
+
+static void *log_loop(void *param) {
+    while (!log_stopping) {
+        if (sem_wait(&log_sem) != 0 && errno != EINTR) {
+            break;
+        }
+        drain();
+    }
+
+    return NULL;
+}
+
+int log_start() {
+    log_init_once();
+
+    int rc = pthread_create(&log_thread, NULL, log_loop, NULL);
+    if (rc != 0) {
+        syslog(LOG_ERR, "Failure to create logging thread. Error code: %d", rc);
+        return -1;
+    }
+    log_running = 1;
+
+    return 0;
+}
+
+void log_stop() {
+    log_init_once();
+
+    if (log_running) {
+        log_stopping = 1;
+        sem_post(&log_sem);
+        pthread_join(log_thread, NULL);
+        log_running = 0;
+    }
+    // messages queued while the thread was shutting down, or before it was started
+    drain();
+}
@@ -0,0 +1,51 @@
+#ifndef AESDSOCKET_LOG_H
+#define AESDSOCKET_LOG_H
+
+#include <syslog.h>
+
+/*
+ * Messages with a priority numerically above AESD_LOG_LEVEL are compiled out,
+ * e.g. build with AESD_LOG_LEVEL=LOG_INFO to drop all LOG_DEBUG calls.
+ */
+#ifndef AESD_LOG_LEVEL
+#   define AESD_LOG_LEVEL LOG_DEBUG
+#endif
+
+// maximum length of a formatted message, longer messages are truncated
+#define LOG_MESSAGE_SIZE 240
+// number of queued messages, must be a power of two
+#define LOG_RING_SIZE 1024
+// default number of messages per second and priority, 0 disables the limit
+#define LOG_DEFAULT_RATE_LIMIT 200
+
+/*
+ * Drop-in replacement for syslog(). The message is formatted by the caller into a
+ * lock-free ring and written to syslog by a background thread, so it never blocks.
+ * Messages are dropped (and counted) when the ring is full or the rate limit of the
+ * priority is exceeded.
+ * Not async-signal-safe (pthread_once(), vsnprintf()), never call it from a signal handler.
+ */
+#define aesd_syslog(priority, fmt, ...) \
+    do { \
+        if ((priority) <= AESD_LOG_LEVEL) log_message(priority, fmt, ##__VA_ARGS__); \
+    } while (0)
+
+void log_message(int priority, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/*
+ * Sets the maximum number of messages per second accepted for @param priority
+ */
+void log_set_rate_limit(int priority, unsigned int per_second);
+
+/*
+ * Starts the background thread writing queued messages to syslog.
+ * Must be called after daemonizing since threads do not survive fork().
+ */
+int log_start();
+
+/*
+ * Stops the background thread and writes all messages still queued.
+ */
+void log_stop();
+
+#endif
@@ -0,0 +1,154 @@
+#include "lz4.h"
+#include <stdint.h>
+#include <string.h>
+
+#define MIN_MATCH 4
+// the last match starts at least MF_LIMIT bytes before the end, the last LAST_LITERALS are literals
+#define MF_LIMIT 12
+#define LAST_LITERALS 5
+#define MAX_DISTANCE 65535
+// every 2^SKIP_TRIGGER misses in a row the search steps one byte further
+#define SKIP_TRIGGER 6
+
+static uint32_t read32(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t hash(uint32_t v) {
+    return (v * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+static char *put_length(char *op, size_t len) {
+    while (len >= 255) {
+        *op++ = (char) 255;
+        len -= 255;
+    }
+    *op++ = (char) len;
+    return op;
+}
+
+// writes the token and literals of a sequence, returns the token for the match length
+static char *put_literals(char **op, const char *anchor, size_t lit) {
+    char *token = (*op)++;
+    *token = (char) ((lit >= 15 ? 15 : lit) << 4);
+    if (lit >= 15) {
+        *op = put_length(*op, lit - 15);
+    }
+    memcpy(*op, anchor, lit);
+    *op += lit;
+    return token;
+}
+
+size_t lz4_compress(const char *src, size_t len, char *dst) {
+    uint32_t table[1 << LZ4_HASH_BITS];
+    const char *ip = src, *anchor = src, *end = src + len;
+    char *op = dst;
+
+    if (len > MF_LIMIT) {
+        const char *mflimit = end - MF_LIMIT;
+        const char *match_limit = end - LAST_LITERALS;
+        unsigned int misses = 0;
+
+        // stale entries are caught by the distance and content checks
+        memset(table, 0, sizeof(table));
+        while (ip <= mflimit) {
+            uint32_t h = hash(read32(ip));
+            const char *ref = src + table[h];
+            table[h] = ip - src;
+            if (ip - ref > MAX_DISTANCE || ref == ip || read32(ref) != read32(ip)) {
+                ip += 1 + (misses++ >> SKIP_TRIGGER);
+                continue;
+            }
+            misses = 0;
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const char *m = ip + MIN_MATCH, *r = ref + MIN_MATCH;
+            while (m < match_limit && *m == *r) {
+                m++;
+                r++;
+            }
+
+            char *token = put_literals(&op, anchor, ip - anchor);
+            uint16_t offset = ip - ref;
+            *op++ = (char) (offset & 0xff);
+            *op++ = (char) (offset >> 8);
+            size_t match_len = m - ip - MIN_MATCH;
+            if (match_len >= 15) {
+                *token |= 15;
+                op = put_length(op, match_len - 15);
+            } else {
+                *token |= (char) match_len;
+            }
+            ip = anchor = m;
+            if (ip <= mflimit) {
+                // the position just before the next search, catches runs right away
+                table[hash(read32(ip - 2))] = ip - 2 - src;
+            }
+        }
+    }
+    put_literals(&op, anchor, end - anchor);
+
+    return op - dst;
+}
+
+// adds the 255 terminated length extension at *@param ip to @param len
+static int get_length(const unsigned char **ip, const unsigned char *end, size_t *len) {
+    unsigned char b;
+    do {
+        if (*ip == end) {
+            return -1;
+        }
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+int lz4_decompress(const char *src, size_t len, char *dst, size_t raw_len) {
+    const unsigned char *ip = (const unsigned char *) src, *end = ip + len;
+    size_t out = 0;
+
+    for (;;) {
+        if (ip == end) {
+            return -1;
+        }
+        unsigned char token = *ip++;
+        size_t lit = token >> 4;
+        if (lit == 15 && get_length(&ip, end, &lit) != 0) {
+            return -1;
+        }
+        if (lit > (size_t) (end - ip) || lit > raw_len - out) {
+            return -1;
+        }
+        memcpy(dst + out, ip, lit);
+        ip += lit;
+        out += lit;
+        if (ip == end) {
+            // the last sequence has literals only
+            return out == raw_len ? 0 : -1;
+        }
+
+        if (end - ip < 2) {
+            return -1;
+        }
+        size_t offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        size_t match_len = token & 15;
+        if (match_len == 15 && get_length(&ip, end, &match_len) != 0) {
+            return -1;
+        }
+        match_len += MIN_MATCH;
+        if (offset == 0 || offset > out || raw_len < MF_LIMIT || out > raw_len - MF_LIMIT ||
+                match_len > raw_len - LAST_LITERALS - out) {
+            return -1;
+        }
+        // byte by byte, a match may overlap the bytes it produces
+        for (size_t i = 0; i < match_len; i++, out++) {
+            dst[out] = dst[out - offset];
+        }
+    }
+}
@@ -0,0 +1,30 @@
+#ifndef AESDSOCKET_LZ4_H
+#define AESDSOCKET_LZ4_H
+
+#include <stddef.h>
+
+/*
+ * Compressor for the LZ4 block format, output is decoded by LZ4_decompress_safe() of
+ * liblz4 or any other LZ4 block decoder. Greedy matching with a single hash table, it
+ * trades some ratio for speed like the LZ4 fast mode. The decoder checks blocks against
+ * the format, for clients and tests without liblz4.
+ */
+#define LZ4_HASH_BITS 12
+
+// worst case compressed size of @param len bytes
+#define LZ4_COMPRESS_BOUND(len) ((len) + (len) / 255 + 16)
+
+/*
+ * Compresses @param len bytes of @param src into @param dst, which must hold
+ * LZ4_COMPRESS_BOUND(len) bytes. Returns the compressed size.
+ */
+size_t lz4_compress(const char *src, size_t len, char *dst);
+/*
+ * Decodes the block of @param len bytes at @param src into exactly @param raw_len bytes
+ * at @param dst. Returns 0, or -1 when the block is malformed, decodes to another size or
+ * breaks the end of block rules (the last match starts at least 12 bytes before the end,
+ * the last 5 bytes are literals).
+ */
+int lz4_decompress(const char *src, size_t len, char *dst, size_t raw_len);
+
+#endif
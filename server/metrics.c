@@ -0,0 +1,258 @@
+#define _GNU_SOURCE
+#include "metrics.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define METRICS_LISTEN_BACKLOG 4
+#define METRICS_RENDER_SIZE (16*1024)
+#define METRICS_REQUEST_TIMEOUT_MS 1000
+
+struct metrics_shard {
+    uint64_t counters[METRIC_COUNTER_MAX];
+    uint64_t buckets[METRIC_HISTOGRAM_MAX][METRICS_HIST_BUCKETS];
+    uint64_t sum_ns[METRIC_HISTOGRAM_MAX];
+} __attribute__((aligned(64)));
+
+static struct metrics_shard shards[METRICS_SHARDS];
+static unsigned int next_shard;
+static __thread struct metrics_shard *thread_shard;
+
+static int metrics_fd = -1;
+static char metrics_unix_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static pthread_t metrics_thread;
+static int metrics_thread_started;
+
+static const char *counter_names[METRIC_COUNTER_MAX][2] = {
+    [METRIC_CONNECTIONS_ACCEPTED] = { "aesdsocket_connections_accepted_total", "Client connections accepted" },
+    [METRIC_CONNECTIONS_CLOSED] = { "aesdsocket_connections_closed_total", "Client connections closed" },
+    [METRIC_BYTES_RECEIVED] = { "aesdsocket_bytes_received_total", "Bytes received from clients" },
+    [METRIC_BYTES_SENT] = { "aesdsocket_bytes_sent_total", "Bytes echoed back to clients" },
+    [METRIC_LINES_COMMITTED] = { "aesdsocket_lines_committed_total", "Lines appended to the data file" },
+    [METRIC_LINES_REJECTED] = { "aesdsocket_lines_rejected_total", "Connections closed for a line over the size limit" },
+    [METRIC_BACKPRESSURE_STALLS] = { "aesdsocket_backpressure_stalls_total", "Reads held back by the in-flight bytes limit" },
+    [METRIC_POOL_ALLOCATIONS] = { "aesdsocket_pool_allocations_total", "Connection objects and line buffers the pool had to malloc()" },
+    [METRIC_ECHO_CACHE_HITS] = { "aesdsocket_echo_cache_hits_total", "Sealed segments sent from the compressed echo cache" },
+    [METRIC_ECHO_CACHE_MISSES] = { "aesdsocket_echo_cache_misses_total", "Sealed segments compressed for a compressed echo" },
+};
+
+static const char *histogram_names[METRIC_HISTOGRAM_MAX][2] = {
+    [METRIC_LOCK_WAIT] = { "aesdsocket_lock_wait_seconds", "Time spent waiting for the data file lock" },
+    [METRIC_ECHO_LATENCY] = { "aesdsocket_echo_latency_seconds", "Time from a complete line to its echo being sent" },
+};
+
+static struct metrics_shard *get_shard() {
+    if (!thread_shard) {
+        unsigned int n = __atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED);
+        thread_shard = &shards[n % METRICS_SHARDS];
+    }
+    return thread_shard;
+}
+
+uint64_t metrics_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void metrics_add(enum metrics_counter counter, uint64_t value) {
+    __atomic_fetch_add(&get_shard()->counters[counter], value, __ATOMIC_RELAXED);
+}
+
+void metrics_observe_ns(enum metrics_histogram histogram, uint64_t ns) {
+    struct metrics_shard *shard = get_shard();
+    // rounded up, a truncated 1.5 us would land in the le="1e-06" bucket
+    uint64_t us = (ns + 999) / 1000;
+    int bucket = 0;
+    // smallest bucket with us <= 2^bucket
+    while (bucket < METRICS_HIST_BUCKETS - 1 && (1ULL << bucket) < us) {
+        bucket++;
+    }
+    __atomic_fetch_add(&shard->buckets[histogram][bucket], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&shard->sum_ns[histogram], ns, __ATOMIC_RELAXED);
+}
+
+static uint64_t sum_counter(enum metrics_counter counter) {
+    uint64_t total = 0;
+    for (int i = 0; i < METRICS_SHARDS; i++) {
+        total += __atomic_load_n(&shards[i].counters[counter], __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
+size_t metrics_render(char *buf, size_t size) {
+    size_t len = 0;
+#define RENDER(...) len += snprintf(buf + (len < size ? len : size), len < size ? size - len : 0, __VA_ARGS__)
+
+    uint64_t accepted = sum_counter(METRIC_CONNECTIONS_ACCEPTED);
+    uint64_t closed = sum_counter(METRIC_CONNECTIONS_CLOSED);
+    RENDER("# HELP aesdsocket_connections_active Client connections currently open\n");
+    RENDER("# TYPE aesdsocket_connections_active gauge\n");
+    RENDER("aesdsocket_connections_active %llu\n", (unsigned long long)(accepted - closed));
+
+    for (int c = 0; c < METRIC_COUNTER_MAX; c++) {
+        RENDER("# HELP %s %s\n", counter_names[c][0], counter_names[c][1]);
+        RENDER("# TYPE %s counter\n", counter_names[c][0]);
+        RENDER("%s %llu\n", counter_names[c][0], (unsigned long long) sum_counter(c));
+    }
+
+    for (int h = 0; h < METRIC_HISTOGRAM_MAX; h++) {
+        const char *name = histogram_names[h][0];
+        uint64_t cumulative = 0, sum_ns = 0;
+
+        RENDER("# HELP %s %s\n", name, histogram_names[h][1]);
+        RENDER("# TYPE %s histogram\n", name);
+        for (int b = 0; b < METRICS_HIST_BUCKETS; b++) {
+            for (int i = 0; i < METRICS_SHARDS; i++) {
+                cumulative += __atomic_load_n(&shards[i].buckets[h][b], __ATOMIC_RELAXED);
+            }
+            if (b < METRICS_HIST_BUCKETS - 1) {
+                RENDER("%s_bucket{le=\"%g\"} %llu\n", name, (1ULL << b) / 1e6, (unsigned long long) cumulative);
+            } else {
+                RENDER("%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long) cumulative);
+            }
+        }
+        for (int i = 0; i < METRICS_SHARDS; i++) {
+            sum_ns += __atomic_load_n(&shards[i].sum_ns[h], __ATOMIC_RELAXED);
+        }
+        RENDER("%s_sum %.9f\n", name, sum_ns / 1e9);
+        RENDER("%s_count %llu\n", name, (unsigned long long) cumulative);
+    }
+#undef RENDER
+
+    return len;
+}
+
+/*
+ * Answers every connection with a minimal HTTP/1.0 response so the endpoint can be
+ * scraped by Prometheus as well as read with curl or nc.
+ */
+static void serve_scrape(int client_fd) {
+    char request[1024];
+    struct pollfd pfd = { .fd = client_fd, .events = POLLIN };
+    // drain the request (if any) so closing the socket does not reset the connection
+    if (poll(&pfd, 1, METRICS_REQUEST_TIMEOUT_MS) > 0) {
+        recv(client_fd, request, sizeof(request), MSG_DONTWAIT);
+    }
+
+    char *body = malloc(METRICS_RENDER_SIZE);
+    size_t len = body ? metrics_render(body, METRICS_RENDER_SIZE) : 0;
+    if (body && len >= METRICS_RENDER_SIZE) {
+        char *grown = realloc(body, len + 1);
+        if (grown) {
+            metrics_render(grown, len + 1);
+        } else {
+            free(body);
+        }
+        body = grown;
+    }
+    if (!body) {
+        static const char error[] = "HTTP/1.0 500 Internal Server Error\r\nContent-Length: 0\r\n\r\n";
+        aesd_syslog(LOG_ERR, "Failure to allocate the metrics response");
+        send(client_fd, error, sizeof(error) - 1, MSG_NOSIGNAL);
+        return;
+    }
+
+    char header[160];
+    int hlen = snprintf(header, sizeof(header),
+            "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", len);
+    if (send(client_fd, header, hlen, MSG_NOSIGNAL) < 0 || send(client_fd, body, len, MSG_NOSIGNAL) < 0) {
+        aesd_syslog(LOG_ERR, "Failure to send metrics: %s", strerror(errno));
+    }
+    free(body);
+}
+
+static void *metrics_loop(void *param) {
+    for (;;) {
+        int client_fd = accept(metrics_fd, NULL, NULL);
+        if (client_fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;
+        }
+        serve_scrape(client_fd);
+        close(client_fd);
+    }
+
+    return NULL;
+}
+
+int metrics_start(const char *endpoint) {
+    if (endpoint[0] == '/') {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(endpoint) >= sizeof(addr.sun_path)) {
+            aesd_syslog(LOG_ERR, "Metrics socket path is too long: %s", endpoint);
+            return -1;
+        }
+        strcpy(addr.sun_path, endpoint);
+        unlink(endpoint);
+
+        metrics_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (metrics_fd < 0 || bind(metrics_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+            aesd_syslog(LOG_ERR, "Unable to bind metrics socket %s: %s", endpoint, strerror(errno));
+            return -1;
+        }
+        strcpy(metrics_unix_path, endpoint);
+    } else {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(atoi(endpoint));
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        const int enable = 1;
+        metrics_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (metrics_fd < 0) {
+            aesd_syslog(LOG_ERR, "%s", "Failure to open metrics socket");
+            return -1;
+        }
+        setsockopt(metrics_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int));
+        if (bind(metrics_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+            aesd_syslog(LOG_ERR, "Unable to bind metrics on port %s: %s", endpoint, strerror(errno));
+            return -1;
+        }
+    }
+
+    if (listen(metrics_fd, METRICS_LISTEN_BACKLOG) != 0) {
+        aesd_syslog(LOG_ERR, "Failure to listen metrics socket: %s", strerror(errno));
+        return -1;
+    }
+
+    int rc = pthread_create(&metrics_thread, NULL, metrics_loop, NULL);
+    if (rc != 0) {
+        aesd_syslog(LOG_ERR, "Failure to create metrics thread. Error code: %d", rc);
+        return -1;
+    }
+    metrics_thread_started = 1;
+    aesd_syslog(LOG_DEBUG, "Serving metrics on %s", endpoint);
+
+    return 0;
+}
+
+void metrics_stop() {
+    if (metrics_fd >= 0) {
+        // wakes up accept() in the metrics thread, the fd is closed once it has returned
+        shutdown(metrics_fd, SHUT_RDWR);
+        if (metrics_thread_started) {
+            pthread_join(metrics_thread, NULL);
+            metrics_thread_started = 0;
+        }
+        close(metrics_fd);
+        metrics_fd = -1;
+    }
+    if (metrics_unix_path[0]) {
+        unlink(metrics_unix_path);
+        metrics_unix_path[0] = '\0';
+    }
+}
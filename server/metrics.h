@@ -0,0 +1,53 @@
+#ifndef AESDSOCKET_METRICS_H
+#define AESDSOCKET_METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Counters and histograms are kept in cache line aligned shards, each thread is
+ * bound to one shard on first use and only does relaxed atomic adds on it.
+ * The shards are summed up when the metrics endpoint is scraped.
+ */
+#define METRICS_SHARDS 64
+// histogram buckets are powers of two in microseconds: 1us, 2us ... ~8.4s, +Inf
+#define METRICS_HIST_BUCKETS 24
+
+enum metrics_counter {
+    METRIC_CONNECTIONS_ACCEPTED,
+    METRIC_CONNECTIONS_CLOSED,
+    METRIC_BYTES_RECEIVED,
+    METRIC_BYTES_SENT,
+    METRIC_LINES_COMMITTED,
+    METRIC_LINES_REJECTED,
+    METRIC_BACKPRESSURE_STALLS,
+    METRIC_POOL_ALLOCATIONS,
+    METRIC_ECHO_CACHE_HITS,
+    METRIC_ECHO_CACHE_MISSES,
+    METRIC_COUNTER_MAX
+};
+
+enum metrics_histogram {
+    METRIC_LOCK_WAIT,
+    METRIC_ECHO_LATENCY,
+    METRIC_HISTOGRAM_MAX
+};
+
+uint64_t metrics_now_ns();
+void metrics_add(enum metrics_counter counter, uint64_t value);
+void metrics_observe_ns(enum metrics_histogram histogram, uint64_t ns);
+
+/*
+ * Writes the aggregated metrics in Prometheus text exposition format into @param buf.
+ * Returns the number of characters that would have been written (as snprintf).
+ */
+size_t metrics_render(char *buf, size_t size);
+
+/*
+ * Starts the metrics endpoint thread. @param endpoint is either a TCP port bound to
+ * the loopback interface or an absolute path of a Unix domain socket.
+ */
+int metrics_start(const char *endpoint);
+void metrics_stop();
+
+#endif
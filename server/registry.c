@@ -0,0 +1,179 @@
+#define _GNU_SOURCE
+#include "registry.h"
+#include "log.h"
+#include <stdlib.h>
+
+#define SLOT_FREE_END UINT32_MAX
+
+struct registry_slot {
+    void      *conn;        // NULL while the slot is free
+    pthread_t  thread;
+    int        started;
+    int        closing;
+    uint32_t   generation;  // bumped on every removal
+    uint32_t   next_free;
+};
+
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t empty_cond = PTHREAD_COND_INITIALIZER;
+static struct registry_slot *slots;
+static uint32_t capacity;
+static uint32_t free_head = SLOT_FREE_END;
+static size_t count;
+static int cancelling;
+
+static registry_handle make_handle(uint32_t index) {
+    return (registry_handle) slots[index].generation << 32 | index;
+}
+
+// slot of a handle still referring to its connection, NULL otherwise
+static struct registry_slot *lookup(registry_handle handle) {
+    uint32_t index = (uint32_t) handle;
+    if (index >= capacity || slots[index].generation != (uint32_t)(handle >> 32) || !slots[index].conn) {
+        return NULL;
+    }
+    return &slots[index];
+}
+
+static int grow() {
+    uint32_t new_capacity = capacity ? capacity * 2 : REGISTRY_INITIAL_SLOTS;
+    struct registry_slot *grown = realloc(slots, new_capacity * sizeof(*slots));
+    if (!grown) {
+        return -1;
+    }
+    slots = grown;
+    // chained in index order so low slots are reused first
+    for (uint32_t i = new_capacity; i-- > capacity; ) {
+        slots[i].conn = NULL;
+        slots[i].started = 0;
+        // generation 0 is never handed out, a zero handle means failure
+        slots[i].generation = 1;
+        slots[i].next_free = free_head;
+        free_head = i;
+    }
+    capacity = new_capacity;
+
+    return 0;
+}
+
+int registry_init() {
+    pthread_mutex_lock(&registry_mutex);
+    int rc = capacity ? 0 : grow();
+    pthread_mutex_unlock(&registry_mutex);
+    if (rc != 0) {
+        aesd_syslog(LOG_ERR, "%s", "Failure to allocate the connection table");
+    }
+    return rc;
+}
+
+registry_handle registry_add(void *conn) {
+    registry_handle handle = 0;
+
+    pthread_mutex_lock(&registry_mutex);
+    if (free_head != SLOT_FREE_END || grow() == 0) {
+        uint32_t index = free_head;
+        free_head = slots[index].next_free;
+        slots[index].conn = conn;
+        slots[index].started = 0;
+        slots[index].closing = 0;
+        count++;
+        handle = make_handle(index);
+    }
+    pthread_mutex_unlock(&registry_mutex);
+
+    return handle;
+}
+
+void registry_started(registry_handle handle, pthread_t thread) {
+    pthread_mutex_lock(&registry_mutex);
+    struct registry_slot *slot = lookup(handle);
+    if (slot) {
+        slot->thread = thread;
+        slot->started = 1;
+        if (cancelling) {
+            pthread_cancel(thread);
+        }
+    }
+    pthread_mutex_unlock(&registry_mutex);
+}
+
+void registry_closing(registry_handle handle) {
+    pthread_mutex_lock(&registry_mutex);
+    struct registry_slot *slot = lookup(handle);
+    if (slot) {
+        slot->closing = 1;
+    }
+    pthread_mutex_unlock(&registry_mutex);
+}
+
+void registry_remove(registry_handle handle) {
+    pthread_mutex_lock(&registry_mutex);
+    struct registry_slot *slot = lookup(handle);
+    if (slot) {
+        uint32_t index = slot - slots;
+        slot->conn = NULL;
+        slot->started = 0;
+        slot->generation = slot->generation == UINT32_MAX ? 1 : slot->generation + 1;
+        slot->next_free = free_head;
+        free_head = index;
+        if (--count == 0) {
+            pthread_cond_broadcast(&empty_cond);
+        }
+    }
+    pthread_mutex_unlock(&registry_mutex);
+}
+
+size_t registry_count() {
+    pthread_mutex_lock(&registry_mutex);
+    size_t n = count;
+    pthread_mutex_unlock(&registry_mutex);
+    return n;
+}
+
+void registry_foreach(void (*fn)(void *conn, void *arg), void *arg) {
+    pthread_mutex_lock(&registry_mutex);
+    for (uint32_t i = 0; i < capacity; i++) {
+        if (slots[i].conn && !slots[i].closing) {
+            fn(slots[i].conn, arg);
+        }
+    }
+    pthread_mutex_unlock(&registry_mutex);
+}
+
+void registry_cancel_all() {
+    pthread_mutex_lock(&registry_mutex);
+    cancelling = 1;
+    // a registered thread is alive, it removes itself under the same lock before exiting
+    for (uint32_t i = 0; i < capacity; i++) {
+        if (slots[i].conn && slots[i].started) {
+            pthread_cancel(slots[i].thread);
+        }
+    }
+    pthread_mutex_unlock(&registry_mutex);
+}
+
+void registry_wait_empty() {
+    pthread_mutex_lock(&registry_mutex);
+    while (count > 0) {
+        pthread_cond_wait(&empty_cond, &registry_mutex);
+    }
+    pthread_mutex_unlock(&registry_mutex);
+}
+
+int registry_wait_empty_until(const struct timespec *deadline) {
+    pthread_mutex_lock(&registry_mutex);
+    while (count > 0 && pthread_cond_clockwait(&empty_cond, &registry_mutex, CLOCK_MONOTONIC, deadline) == 0);
+    int rc = count > 0 ? -1 : 0;
+    pthread_mutex_unlock(&registry_mutex);
+
+    return rc;
+}
+
+void registry_destroy() {
+    pthread_mutex_lock(&registry_mutex);
+    free(slots);
+    slots = NULL;
+    capacity = 0;
+    free_head = SLOT_FREE_END;
+    pthread_mutex_unlock(&registry_mutex);
+}
@@ -0,0 +1,57 @@
+#ifndef AESDSOCKET_REGISTRY_H
+#define AESDSOCKET_REGISTRY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * Table of live connections. A handle packs a slot index with the generation of the
+ * slot, so a handle kept after its connection was removed never matches a newer one.
+ * Free slots are chained in a free list, adding and removing are O(1) and the table
+ * doubles when it is full.
+ */
+#define REGISTRY_INITIAL_SLOTS 64
+
+typedef uint64_t registry_handle;
+
+int registry_init();
+/*
+ * Reserves a slot for @param conn, returns 0 when the table cannot grow.
+ */
+registry_handle registry_add(void *conn);
+/*
+ * Records the thread serving the connection once it was created. The thread is
+ * cancelled right away when registry_cancel_all() was called in between.
+ */
+void registry_started(registry_handle handle, pthread_t thread);
+/*
+ * Called by the connection thread before it closes its socket, registry_foreach()
+ * skips the connection from then on.
+ */
+void registry_closing(registry_handle handle);
+/*
+ * Frees the slot, called by the connection thread itself as the last thing it does.
+ */
+void registry_remove(registry_handle handle);
+size_t registry_count();
+/*
+ * Calls @param fn for every connection not closing yet, with the registry locked.
+ */
+void registry_foreach(void (*fn)(void *conn, void *arg), void *arg);
+/*
+ * Cancels every registered connection thread, connections registered later are cancelled
+ * as soon as they start.
+ */
+void registry_cancel_all();
+// blocks until every connection removed itself
+void registry_wait_empty();
+/*
+ * As registry_wait_empty() but gives up at @param deadline (CLOCK_MONOTONIC),
+ * returns -1 when connections are left.
+ */
+int registry_wait_empty_until(const struct timespec *deadline);
+void registry_destroy();
+
+#endif
@@ -0,0 +1,399 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include "../../examples/systemcalls/systemcalls.h"
+#include "../../examples/systemcalls/systemcalls-batch.h"
+
+#define OUTPUT_FILE "/tmp/aesd-systemcalls-test.txt"
+#define ASYNC_COMMANDS 16
+#define BATCH_COMMANDS 6
+
+extern char **environ;
+
+// set to fail adding descriptors to epoll sets, as when the user's epoll watches run out
+static bool fail_epoll_add;
+
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+    if (fail_epoll_add && op == EPOLL_CTL_ADD) {
+        errno = ENOSPC;
+        return -1;
+    }
+    return syscall(SYS_epoll_ctl, epfd, op, fd, event);
+}
+
+static const enum exec_backend backends[] = { EXEC_BACKEND_SPAWN, EXEC_BACKEND_FORK };
+
+// reads @param path into @param buf, NUL terminated
+static size_t read_file(const char *path, char *buf, size_t size)
+{
+    int fd = open(path, O_RDONLY);
+    TEST_ASSERT_TRUE_MESSAGE(fd >= 0, "Failure to open the output file");
+    ssize_t n = read(fd, buf, size - 1);
+    close(fd);
+    TEST_ASSERT_TRUE_MESSAGE(n >= 0, "Failure to read the output file");
+    buf[n] = '\0';
+    return n;
+}
+
+void test_exec_status()
+{
+    for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+        set_exec_backend(backends[i]);
+        TEST_ASSERT_TRUE_MESSAGE(do_exec(1, "/bin/true"), "Successful command reported as failed");
+        TEST_ASSERT_FALSE_MESSAGE(do_exec(1, "/bin/false"), "Failed command reported as successful");
+        TEST_ASSERT_FALSE_MESSAGE(do_exec(3, "/bin/sh", "-c", "exit 3"), "Non zero exit status reported as successful");
+        TEST_ASSERT_FALSE_MESSAGE(do_exec(1, "/nonexistent/command"), "Missing command reported as successful");
+        // no path lookup, the full path is required
+        TEST_ASSERT_FALSE_MESSAGE(do_exec(1, "true"), "Command found without its full path");
+        TEST_ASSERT_TRUE_MESSAGE(do_exec(3, "/bin/sh", "-c", "exit 0"), "Arguments not passed to the command");
+    }
+    set_exec_backend(EXEC_BACKEND_SPAWN);
+}
+
+void test_exec_redirect()
+{
+    char buf[64];
+
+    for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+        set_exec_backend(backends[i]);
+        TEST_ASSERT_TRUE_MESSAGE(do_exec_redirect(OUTPUT_FILE, 3, "/bin/echo", "home", "is"), "Failure to redirect a command");
+        read_file(OUTPUT_FILE, buf, sizeof(buf));
+        TEST_ASSERT_EQUAL_STRING_MESSAGE("home is\n", buf, "Wrong redirected output");
+        // the file is truncated, not appended to
+        TEST_ASSERT_TRUE_MESSAGE(do_exec_redirect(OUTPUT_FILE, 2, "/bin/echo", "x"), "Failure to redirect a command");
+        read_file(OUTPUT_FILE, buf, sizeof(buf));
+        TEST_ASSERT_EQUAL_STRING_MESSAGE("x\n", buf, "Redirected output not truncated");
+        TEST_ASSERT_FALSE_MESSAGE(do_exec_redirect(OUTPUT_FILE, 1, "/bin/false"), "Failed command reported as successful");
+        TEST_ASSERT_FALSE_MESSAGE(do_exec_redirect("/nonexistent/dir/file", 1, "/bin/true"), "Unwritable output file accepted");
+    }
+    set_exec_backend(EXEC_BACKEND_SPAWN);
+    unlink(OUTPUT_FILE);
+}
+
+// do_exec() waits for its own child, an unrelated child of the caller is left to it
+void test_exec_waits_for_its_child_only()
+{
+    char *sleeper[] = { "/bin/sleep", "0.2", NULL };
+    pid_t other;
+    int status;
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, posix_spawn(&other, sleeper[0], NULL, NULL, sleeper, environ), "Failure to start a child");
+    for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+        set_exec_backend(backends[i]);
+        TEST_ASSERT_TRUE_MESSAGE(do_exec(1, "/bin/true"), "Successful command reported as failed");
+    }
+    set_exec_backend(EXEC_BACKEND_SPAWN);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, waitpid(other, &status, WNOHANG), "The other child was reaped or not running");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(other, waitpid(other, &status, 0), "The other child was reaped by do_exec");
+    TEST_ASSERT_TRUE_MESSAGE(WIFEXITED(status) && WEXITSTATUS(status) == 0, "Wrong status of the other child");
+}
+
+void test_exec_async_status()
+{
+    struct exec_handle *handle;
+
+    handle = do_exec_async(1, "/bin/true");
+    TEST_ASSERT_NOT_NULL_MESSAGE(handle, "Failure to start a command");
+    TEST_ASSERT_TRUE_MESSAGE(handle->pidfd >= 0, "No pidfd for the command");
+    TEST_ASSERT_TRUE_MESSAGE(exec_handle_wait(handle), "Successful command reported as failed");
+    TEST_ASSERT_TRUE_MESSAGE(handle->done, "Command not done once waited for");
+    // waiting again returns the collected status
+    TEST_ASSERT_TRUE_MESSAGE(exec_handle_wait(handle), "Status lost on the second wait");
+    exec_handle_free(handle);
+
+    handle = do_exec_async(3, "/bin/sh", "-c", "exit 3");
+    TEST_ASSERT_NOT_NULL_MESSAGE(handle, "Failure to start a command");
+    TEST_ASSERT_FALSE_MESSAGE(exec_handle_wait(handle), "Failed command reported as successful");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(3, handle->status, "Wrong exit status");
+    exec_handle_free(handle);
+
+    handle = do_exec_async(3, "/bin/sh", "-c", "kill -9 $$");
+    TEST_ASSERT_NOT_NULL_MESSAGE(handle, "Failure to start a command");
+    TEST_ASSERT_FALSE_MESSAGE(exec_handle_wait(handle), "Killed command reported as successful");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(SIGKILL, handle->status, "Wrong signal of a killed command");
+    exec_handle_free(handle);
+
+    TEST_ASSERT_NULL_MESSAGE(do_exec_async(1, "/nonexistent/command"), "Missing command started");
+    TEST_ASSERT_NULL_MESSAGE(do_exec_async(0), "Empty command started");
+    // freeing a running command waits for it
+    exec_handle_free(do_exec_async(2, "/bin/sleep", "0.05"));
+}
+
+void test_exec_redirect_async()
+{
+    char buf[64];
+
+    struct exec_handle *handle = do_exec_redirect_async(OUTPUT_FILE, 2, "/bin/echo", "async");
+    TEST_ASSERT_NOT_NULL_MESSAGE(handle, "Failure to start a command");
+    TEST_ASSERT_TRUE_MESSAGE(exec_handle_wait(handle), "Successful command reported as failed");
+    exec_handle_free(handle);
+    read_file(OUTPUT_FILE, buf, sizeof(buf));
+    TEST_ASSERT_EQUAL_STRING_MESSAGE("async\n", buf, "Wrong redirected output");
+    TEST_ASSERT_NULL_MESSAGE(do_exec_redirect_async("/nonexistent/dir/file", 1, "/bin/true"), "Unwritable output file accepted");
+    unlink(OUTPUT_FILE);
+}
+
+void test_exec_waitset()
+{
+    struct exec_handle *done[4];
+    bool collected[ASYNC_COMMANDS] = { false };
+    char scripts[ASYNC_COMMANDS][32];
+
+    struct exec_waitset *set = exec_waitset_create();
+    TEST_ASSERT_NOT_NULL_MESSAGE(set, "Failure to create the wait set");
+    for (int i = 0; i < ASYNC_COMMANDS; i++) {
+        // each command exits with its index, in no particular order
+        snprintf(scripts[i], sizeof(scripts[i]), "sleep 0.0%d; exit %d", i % 3, i);
+        struct exec_handle *handle = do_exec_async(3, "/bin/sh", "-c", scripts[i]);
+        TEST_ASSERT_NOT_NULL_MESSAGE(handle, "Failure to start a command");
+        handle->data = (void *)(intptr_t) i;
+        TEST_ASSERT_TRUE_MESSAGE(exec_waitset_add(set, handle), "Failure to add a command to the wait set");
+    }
+    TEST_ASSERT_EQUAL_INT_MESSAGE(ASYNC_COMMANDS, exec_waitset_count(set), "Wrong count of the wait set");
+    TEST_ASSERT_TRUE_MESSAGE(exec_waitset_fd(set) >= 0, "No descriptor for the wait set");
+
+    while (exec_waitset_count(set) > 0) {
+        int n = exec_waitset_wait(set, done, 4, 5000);
+        TEST_ASSERT_TRUE_MESSAGE(n > 0, "No command collected before the timeout");
+        TEST_ASSERT_TRUE_MESSAGE(n <= 4, "More commands collected than asked for");
+        for (int i = 0; i < n; i++) {
+            int index = (int)(intptr_t) done[i]->data;
+            TEST_ASSERT_TRUE_MESSAGE(done[i]->done, "Command returned before it was collected");
+            TEST_ASSERT_FALSE_MESSAGE(collected[index], "Command collected twice");
+            TEST_ASSERT_EQUAL_INT_MESSAGE(index, done[i]->status, "Wrong exit status");
+            TEST_ASSERT_EQUAL_INT_MESSAGE(index == 0, done[i]->success, "Wrong success of the command");
+            collected[index] = true;
+            exec_handle_free(done[i]);
+        }
+    }
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, exec_waitset_wait(set, done, 4, 0), "Command collected from an empty set");
+    exec_waitset_destroy(set);
+}
+
+// without a pidfd the child is killed, the call does not wait for it to exit by itself
+void test_exec_async_without_pidfd()
+{
+    struct rlimit saved, limit;
+    int fds[64], n = 0;
+    struct timespec start, end;
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, getrlimit(RLIMIT_NOFILE, &saved), "Failure to get the descriptor limit");
+    limit = saved;
+    limit.rlim_cur = 64;
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, setrlimit(RLIMIT_NOFILE, &limit), "Failure to lower the descriptor limit");
+    // close on exec, the command itself gets its descriptors back
+    while (n < 64 && (fds[n] = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0)) >= 0) {
+        n++;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct exec_handle *handle = do_exec_async(2, "/bin/sleep", "10");
+    int error = errno;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    while (n > 0) {
+        close(fds[--n]);
+    }
+    setrlimit(RLIMIT_NOFILE, &saved);
+
+    TEST_ASSERT_NULL_MESSAGE(handle, "Handle returned without a pidfd");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(EMFILE, error, "Wrong errno without a pidfd");
+    TEST_ASSERT_TRUE_MESSAGE(end.tv_sec - start.tv_sec < 5, "Blocked until the command exited");
+    // the child was reaped
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-1, waitpid(-1, NULL, WNOHANG), "Child left behind");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(ECHILD, errno, "Child left behind");
+}
+
+struct batch_results {
+    unsigned int calls[BATCH_COMMANDS];
+    struct exec_batch_result results[BATCH_COMMANDS];
+};
+
+static void record_result(const struct exec_batch_result *result, void *arg)
+{
+    struct batch_results *batch = (struct batch_results *) arg;
+
+    // the callback runs on the calling thread, assertions may fail here
+    TEST_ASSERT_LESS_THAN_UINT_MESSAGE(BATCH_COMMANDS, result->index, "Result for no command of the batch");
+    batch->calls[result->index]++;
+    batch->results[result->index] = *result;
+}
+
+static double elapsed_since(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void test_exec_batch_status()
+{
+    char *ok[] = { "/bin/true", NULL };
+    char *fail[] = { "/bin/sh", "-c", "exit 4", NULL };
+    char *missing[] = { "/nonexistent/command", NULL };
+    char **commands[BATCH_COMMANDS] = { ok, fail, ok, missing, ok, fail };
+    struct batch_results batch = { { 0 } };
+    struct exec_batch_options options = { .concurrency = 2, .on_done = record_result, .arg = &batch };
+
+    TEST_ASSERT_EQUAL_size_t_MESSAGE(3, do_exec_batch(commands, BATCH_COMMANDS, &options), "Wrong number of failed commands");
+    for (int i = 0; i < BATCH_COMMANDS; i++) {
+        TEST_ASSERT_EQUAL_UINT_MESSAGE(1, batch.calls[i], "Not exactly one result per command");
+        TEST_ASSERT_EQUAL_INT_MESSAGE(commands[i] != missing, batch.results[i].started, "Wrong started flag");
+        TEST_ASSERT_EQUAL_INT_MESSAGE(commands[i] == ok, batch.results[i].success, "Wrong success of a command");
+    }
+    TEST_ASSERT_EQUAL_INT_MESSAGE(4, batch.results[1].status, "Wrong exit status");
+    TEST_ASSERT_EQUAL_size_t_MESSAGE(0, do_exec_batch(commands, 1, NULL), "Batch with default options failed");
+    TEST_ASSERT_EQUAL_size_t_MESSAGE(0, do_exec_batch(commands, 0, &options), "Empty batch failed");
+}
+
+void test_exec_batch_concurrency()
+{
+    char *sleeper[] = { "/bin/sleep", "0.2", NULL };
+    char **commands[BATCH_COMMANDS] = { sleeper, sleeper, sleeper, sleeper, sleeper, sleeper };
+    struct exec_batch_options options = { .concurrency = 3 };
+    struct timespec start;
+
+    // two rounds of three
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    TEST_ASSERT_EQUAL_size_t_MESSAGE(0, do_exec_batch(commands, BATCH_COMMANDS, &options), "Batch failed");
+    double seconds = elapsed_since(&start);
+    TEST_ASSERT_TRUE_MESSAGE(seconds >= 0.4, "More commands running than the concurrency allows");
+    TEST_ASSERT_TRUE_MESSAGE(seconds < 1.0, "Commands not run concurrently");
+}
+
+void test_exec_batch_fail_fast()
+{
+    char *ok[] = { "/bin/true", NULL };
+    char *fail[] = { "/bin/false", NULL };
+    char *sleeper[] = { "/bin/sleep", "10", NULL };
+    char **commands[BATCH_COMMANDS] = { sleeper, ok, fail, ok, ok, ok };
+    struct batch_results batch = { { 0 } };
+    struct exec_batch_options options = { .concurrency = 2, .fail_fast = true, .on_done = record_result, .arg = &batch };
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    TEST_ASSERT_EQUAL_size_t_MESSAGE(5, do_exec_batch(commands, BATCH_COMMANDS, &options), "Wrong number of failed commands");
+    TEST_ASSERT_TRUE_MESSAGE(elapsed_since(&start) < 5, "Running command not terminated");
+    TEST_ASSERT_TRUE_MESSAGE(batch.results[0].started && !batch.results[0].success, "Running command not terminated");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(SIGTERM, batch.results[0].status, "Running command not terminated with SIGTERM");
+    TEST_ASSERT_TRUE_MESSAGE(batch.results[1].success, "Command before the failure not run");
+    TEST_ASSERT_FALSE_MESSAGE(batch.results[2].success, "Failed command reported as successful");
+    for (int i = 0; i < BATCH_COMMANDS; i++) {
+        TEST_ASSERT_EQUAL_UINT_MESSAGE(1, batch.calls[i], "Not exactly one result per command");
+    }
+    for (int i = 3; i < BATCH_COMMANDS; i++) {
+        TEST_ASSERT_FALSE_MESSAGE(batch.results[i].started, "Command started after the failure");
+    }
+}
+
+// a command the wait set cannot watch is killed, not waited for while the other slots stall
+void test_exec_batch_waitset_add_failure()
+{
+    char *sleeper[] = { "/bin/sleep", "10", NULL };
+    char **commands[BATCH_COMMANDS] = { sleeper, sleeper, sleeper, sleeper, sleeper, sleeper };
+    struct batch_results batch = { { 0 } };
+    struct exec_batch_options options = { .concurrency = 2, .on_done = record_result, .arg = &batch };
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fail_epoll_add = true;
+    size_t failed = do_exec_batch(commands, BATCH_COMMANDS, &options);
+    fail_epoll_add = false;
+    TEST_ASSERT_TRUE_MESSAGE(elapsed_since(&start) < 5, "Batch waited for commands it could not watch");
+    TEST_ASSERT_EQUAL_size_t_MESSAGE(BATCH_COMMANDS, failed, "Wrong number of failed commands");
+    for (int i = 0; i < BATCH_COMMANDS; i++) {
+        TEST_ASSERT_EQUAL_UINT_MESSAGE(1, batch.calls[i], "Not exactly one result per command");
+        TEST_ASSERT_TRUE_MESSAGE(batch.results[i].started, "Killed command not reported as started");
+        TEST_ASSERT_EQUAL_INT_MESSAGE(SIGKILL, batch.results[i].status, "Wrong status of the killed command");
+    }
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-1, waitpid(-1, NULL, WNOHANG), "Child left behind");
+}
+
+void test_exec_capture_to_memory()
+{
+    struct exec_capture out = EXEC_CAPTURE_BUFFER, err = EXEC_CAPTURE_BUFFER;
+
+    TEST_ASSERT_TRUE_MESSAGE(do_exec_capture(&out, &err, 3, "/bin/sh", "-c", "echo out; echo err >&2"), "Failure to capture a command");
+    TEST_ASSERT_EQUAL_STRING_MESSAGE("out\n", out.data, "Wrong standard out");
+    TEST_ASSERT_EQUAL_STRING_MESSAGE("err\n", err.data, "Wrong standard error");
+    TEST_ASSERT_EQUAL_size_t_MESSAGE(4, out.len, "Wrong length of standard out");
+    free(out.data);
+    free(err.data);
+
+    // merged in the order it was written
+    struct exec_capture both = EXEC_CAPTURE_BUFFER;
+    TEST_ASSERT_TRUE_MESSAGE(do_exec_capture(&both, &both, 3, "/bin/sh", "-c", "echo 1; echo 2 >&2; echo 3"), "Failure to capture a command");
+    TEST_ASSERT_EQUAL_STRING_MESSAGE("1\n2\n3\n", both.data, "Streams not merged in order");
+    free(both.data);
+
+    // output is kept when the command fails
+    struct exec_capture failed = EXEC_CAPTURE_BUFFER;
+    TEST_ASSERT_FALSE_MESSAGE(do_exec_capture(&failed, NULL, 3, "/bin/sh", "-c", "echo partial; exit 1"), "Failed command reported as successful");
+    TEST_ASSERT_EQUAL_STRING_MESSAGE("partial\n", failed.data, "Output of a failed command lost");
+    free(failed.data);
+
+    struct exec_capture nothing = EXEC_CAPTURE_BUFFER;
+    TEST_ASSERT_FALSE_MESSAGE(do_exec_capture(&nothing, NULL, 1, "/nonexistent/command"), "Missing command captured");
+    TEST_ASSERT_EQUAL_size_t_MESSAGE(0, nothing.len, "Output from a missing command");
+    free(nothing.data);
+}
+
+void test_exec_capture_limit()
+{
+    struct exec_capture out = { .fd = -1, .limit = 1000 }, err = EXEC_CAPTURE_BUFFER;
+
+    // both streams well over the pipe capacity, neither may block the command
+    TEST_ASSERT_TRUE_MESSAGE(do_exec_capture(&out, &err, 3, "/bin/sh", "-c",
+                                             "head -c 300000 /dev/zero | tr '\\0' a; head -c 300000 /dev/zero | tr '\\0' b >&2"),
+                             "Failure to capture a command");
+    TEST_ASSERT_EQUAL_size_t_MESSAGE(1000, out.len, "Output not cut at the limit");
+    TEST_ASSERT_TRUE_MESSAGE(out.truncated, "Truncation not reported");
+    TEST_ASSERT_TRUE_MESSAGE(out.size <= 1001, "More memory than the limit allocated");
+    TEST_ASSERT_EQUAL_size_t_MESSAGE(1000, strlen(out.data), "Output not NUL terminated at the limit");
+    TEST_ASSERT_EQUAL_size_t_MESSAGE(300000, err.len, "Standard error not captured in full");
+    TEST_ASSERT_FALSE_MESSAGE(err.truncated, "Truncation reported under the limit");
+    for (size_t i = 0; i < err.len; i++) {
+        TEST_ASSERT_TRUE_MESSAGE(err.data[i] == 'b', "Wrong standard error");
+    }
+    free(out.data);
+    free(err.data);
+}
+
+void test_exec_capture_to_fd()
+{
+    char buf[64];
+    const char *command = "echo spliced; echo again";
+
+    // a regular file takes spliced pages
+    int fd = open(OUTPUT_FILE, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    TEST_ASSERT_TRUE_MESSAGE(fd >= 0, "Failure to open the output file");
+    struct exec_capture out = EXEC_CAPTURE_FD(fd);
+    TEST_ASSERT_TRUE_MESSAGE(do_exec_capture(&out, NULL, 3, "/bin/sh", "-c", command), "Failure to capture into a file");
+    close(fd);
+    TEST_ASSERT_EQUAL_size_t_MESSAGE(strlen("spliced\nagain\n"), out.len, "Wrong length moved to the file");
+    TEST_ASSERT_NULL_MESSAGE(out.data, "Memory allocated for a capture into a file");
+    read_file(OUTPUT_FILE, buf, sizeof(buf));
+    TEST_ASSERT_EQUAL_STRING_MESSAGE("spliced\nagain\n", buf, "Wrong output in the file");
+
+    // splice() refuses O_APPEND files, they are written from user space
+    fd = open(OUTPUT_FILE, O_WRONLY | O_APPEND | O_CLOEXEC);
+    TEST_ASSERT_TRUE_MESSAGE(fd >= 0, "Failure to open the output file");
+    struct exec_capture appended = { .fd = fd, .limit = 10 };
+    TEST_ASSERT_TRUE_MESSAGE(do_exec_capture(&appended, NULL, 3, "/bin/sh", "-c", command), "Failure to capture into an O_APPEND file");
+    close(fd);
+    TEST_ASSERT_TRUE_MESSAGE(appended.truncated, "Truncation not reported");
+    read_file(OUTPUT_FILE, buf, sizeof(buf));
+    TEST_ASSERT_EQUAL_STRING_MESSAGE("spliced\nagain\nspliced\nag", buf, "Wrong output appended to the file");
+    unlink(OUTPUT_FILE);
+}
@@ -0,0 +1,95 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "../../examples/threading/threading.h"
+
+struct fib_task {
+    struct threadpool *pool;
+    int n;
+};
+
+static void *add_one(void *arg)
+{
+    return (void *)((intptr_t) arg + 1);
+}
+
+/**
+ * Submits both halves back to the pool from the worker running it and waits on them,
+ * which only finishes if future_get() runs queued tasks instead of blocking the worker.
+ */
+static void *fib(void *arg)
+{
+    struct fib_task *task = (struct fib_task *) arg;
+    if (task->n < 2) {
+        return (void *)(intptr_t) task->n;
+    }
+
+    struct fib_task left = { task->pool, task->n - 1 };
+    struct fib_task right = { task->pool, task->n - 2 };
+    // Unity assertions longjmp and may only fail on the test thread, not on a worker
+    struct threadpool_future *left_future = threadpool_submit(task->pool, fib, &left);
+    struct threadpool_future *right_future = threadpool_submit(task->pool, fib, &right);
+    if (!left_future || !right_future) {
+        abort();
+    }
+    intptr_t result = (intptr_t) threadpool_future_get(left_future) + (intptr_t) threadpool_future_get(right_future);
+    threadpool_future_free(left_future);
+    threadpool_future_free(right_future);
+
+    return (void *) result;
+}
+
+void test_threadpool_submit_and_get()
+{
+    struct threadpool *pool = threadpool_create(2);
+    TEST_ASSERT_NOT_NULL_MESSAGE(pool, "Failure to create the pool");
+
+    struct threadpool_future *futures[64];
+    for (intptr_t i = 0; i < 64; i++) {
+        futures[i] = threadpool_submit(pool, add_one, (void *) i);
+        TEST_ASSERT_NOT_NULL_MESSAGE(futures[i], "Failure to submit a task");
+    }
+    for (intptr_t i = 0; i < 64; i++) {
+        TEST_ASSERT_EQUAL_INT_MESSAGE(i + 1, (intptr_t) threadpool_future_get(futures[i]), "Wrong task result");
+        TEST_ASSERT_TRUE_MESSAGE(threadpool_future_done(futures[i]), "Task not done after future_get");
+        threadpool_future_free(futures[i]);
+    }
+
+    threadpool_destroy(pool);
+}
+
+void test_threadpool_recursive_submit()
+{
+    // a single worker has nobody to hand the subtasks to, it must run them while waiting
+    struct threadpool *pool = threadpool_create(1);
+    TEST_ASSERT_NOT_NULL_MESSAGE(pool, "Failure to create the pool");
+
+    struct fib_task task = { pool, 15 };
+    struct threadpool_future *future = threadpool_submit(pool, fib, &task);
+    TEST_ASSERT_NOT_NULL_MESSAGE(future, "Failure to submit a task");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(610, (intptr_t) threadpool_future_get(future), "Wrong result of the recursive tasks");
+    threadpool_future_free(future);
+
+    threadpool_destroy(pool);
+}
+
+void test_submit_obtaining_mutex()
+{
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    struct threadpool *pool = threadpool_create(0);
+    TEST_ASSERT_NOT_NULL_MESSAGE(pool, "Failure to create the pool");
+
+    struct threadpool_future *future = submit_obtaining_mutex(pool, &mutex, 1, 1);
+    TEST_ASSERT_NOT_NULL_MESSAGE(future, "Failure to submit the task");
+    struct thread_data *data = (struct thread_data *) threadpool_future_get(future);
+    TEST_ASSERT_NOT_NULL_MESSAGE(data, "The task did not return its thread_data");
+    TEST_ASSERT_TRUE_MESSAGE(data->thread_complete_success, "The task failed to obtain and release the mutex");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, pthread_mutex_trylock(&mutex), "The mutex was not released");
+    pthread_mutex_unlock(&mutex);
+    free(data);
+    threadpool_future_free(future);
+
+    threadpool_destroy(pool);
+}
@@ -0,0 +1,215 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include "../../examples/threading/threading.h"
+
+#define SHORT_US 50000
+// bound on how late a wait may end, generous for loaded machines
+#define SLACK_US 2000000
+
+// a waiter on a thread of its own, results are checked on the test thread
+struct lock_attempt {
+    pthread_t thread;
+    pthread_mutex_t *mutex;
+    unsigned long timeout_us;   // 0 for no deadline
+    struct cancel_token *token;
+    int rc;
+    long elapsed_us;
+};
+
+static long us_since(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000L + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+static void *attempt_lock(void *param)
+{
+    struct lock_attempt *attempt = (struct lock_attempt *) param;
+    struct timespec start, deadline;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    deadline = deadline_after_us(attempt->timeout_us);
+    attempt->rc = mutex_lock_until(attempt->mutex, attempt->timeout_us ? &deadline : NULL, attempt->token);
+    attempt->elapsed_us = us_since(&start);
+    if (attempt->rc == 0) {
+        pthread_mutex_unlock(attempt->mutex);
+    }
+    return NULL;
+}
+
+static void start_attempt(struct lock_attempt *attempt)
+{
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, pthread_create(&attempt->thread, NULL, attempt_lock, attempt), "Failure to create the waiter");
+}
+
+void test_deadline_after_us()
+{
+    struct timespec start, deadline;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    deadline = deadline_after_us(1999999);
+    TEST_ASSERT_TRUE_MESSAGE(deadline.tv_nsec >= 0 && deadline.tv_nsec < 1000000000, "Deadline not normalized");
+    long us = (deadline.tv_sec - start.tv_sec) * 1000000L + (deadline.tv_nsec - start.tv_nsec) / 1000;
+    TEST_ASSERT_TRUE_MESSAGE(us >= 1999999 && us < 1999999 + SLACK_US, "Deadline not on CLOCK_MONOTONIC or wrong");
+}
+
+void test_sleep_until()
+{
+    struct cancel_token token;
+    struct timespec start, deadline;
+
+    TEST_ASSERT_TRUE_MESSAGE(cancel_token_init(&token), "Failure to create the token");
+    for (int with_token = 0; with_token < 2; with_token++) {
+        struct cancel_token *t = with_token ? &token : NULL;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        deadline = deadline_after_us(SHORT_US);
+        TEST_ASSERT_EQUAL_INT_MESSAGE(0, sleep_until(&deadline, t), "Failure to sleep");
+        long elapsed = us_since(&start);
+        TEST_ASSERT_TRUE_MESSAGE(elapsed >= SHORT_US, "Woke up before the deadline");
+        TEST_ASSERT_TRUE_MESSAGE(elapsed < SHORT_US + SLACK_US, "Woke up long after the deadline");
+
+        // a deadline in the past returns at once
+        TEST_ASSERT_EQUAL_INT_MESSAGE(0, sleep_until(&start, t), "Failure to sleep until a past deadline");
+        deadline.tv_nsec = 1000000000;
+        TEST_ASSERT_EQUAL_INT_MESSAGE(EINVAL, sleep_until(&deadline, t), "Invalid deadline accepted");
+    }
+    cancel_token_destroy(&token);
+}
+
+struct delayed_cancel {
+    struct cancel_token *token;
+    unsigned long delay_us;
+};
+
+static void *cancel_later(void *param)
+{
+    struct delayed_cancel *cancel = (struct delayed_cancel *) param;
+    struct timespec deadline = deadline_after_us(cancel->delay_us);
+
+    sleep_until(&deadline, NULL);
+    cancel_token_cancel(cancel->token);
+    return NULL;
+}
+
+void test_sleep_until_cancelled()
+{
+    struct cancel_token token;
+    struct delayed_cancel cancel = { &token, SHORT_US };
+    struct timespec start, deadline;
+    pthread_t canceller;
+
+    TEST_ASSERT_TRUE_MESSAGE(cancel_token_init(&token), "Failure to create the token");
+    TEST_ASSERT_FALSE_MESSAGE(cancel_token_cancelled(&token), "New token cancelled");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, pthread_create(&canceller, NULL, cancel_later, &cancel), "Failure to create the canceller");
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    deadline = deadline_after_us(60 * 1000000UL);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(ECANCELED, sleep_until(&deadline, &token), "Sleep not cancelled");
+    TEST_ASSERT_TRUE_MESSAGE(us_since(&start) < SLACK_US, "Cancellation not noticed promptly");
+    pthread_join(canceller, NULL);
+    TEST_ASSERT_TRUE_MESSAGE(cancel_token_cancelled(&token), "Token not cancelled");
+
+    // a cancelled token ends every later wait at once
+    TEST_ASSERT_EQUAL_INT_MESSAGE(ECANCELED, sleep_until(&deadline, &token), "Sleep on a cancelled token");
+    cancel_token_destroy(&token);
+}
+
+void test_mutex_lock_until_deadline()
+{
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    struct cancel_token token;
+    struct timespec deadline = deadline_after_us(SHORT_US);
+
+    TEST_ASSERT_TRUE_MESSAGE(cancel_token_init(&token), "Failure to create the token");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, mutex_lock_until(&mutex, &deadline, NULL), "Failure to lock a free mutex");
+    pthread_mutex_unlock(&mutex);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, mutex_lock_until(&mutex, NULL, &token), "Failure to lock a free mutex with a token");
+    pthread_mutex_unlock(&mutex);
+
+    // held by the test thread, the waiters give up at their deadline, in slices with a token
+    token.check_interval_us = 5000;
+    pthread_mutex_lock(&mutex);
+    for (int with_token = 0; with_token < 2; with_token++) {
+        struct lock_attempt attempt = { .mutex = &mutex, .timeout_us = SHORT_US, .token = with_token ? &token : NULL };
+        start_attempt(&attempt);
+        pthread_join(attempt.thread, NULL);
+        TEST_ASSERT_EQUAL_INT_MESSAGE(ETIMEDOUT, attempt.rc, "Mutex held by another thread obtained");
+        TEST_ASSERT_TRUE_MESSAGE(attempt.elapsed_us >= SHORT_US, "Gave up before the deadline");
+        TEST_ASSERT_TRUE_MESSAGE(attempt.elapsed_us < SHORT_US + SLACK_US, "Gave up long after the deadline");
+    }
+
+    // obtained once released before the deadline
+    struct lock_attempt attempt = { .mutex = &mutex, .timeout_us = 60 * 1000000UL, .token = &token };
+    start_attempt(&attempt);
+    deadline = deadline_after_us(SHORT_US);
+    sleep_until(&deadline, NULL);
+    pthread_mutex_unlock(&mutex);
+    pthread_join(attempt.thread, NULL);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, attempt.rc, "Released mutex not obtained");
+    cancel_token_destroy(&token);
+}
+
+void test_mutex_lock_until_cancelled()
+{
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    struct cancel_token token;
+
+    TEST_ASSERT_TRUE_MESSAGE(cancel_token_init(&token), "Failure to create the token");
+    pthread_mutex_lock(&mutex);
+    // no deadline, only the cancellation ends the wait
+    struct lock_attempt attempt = { .mutex = &mutex, .timeout_us = 0, .token = &token };
+    start_attempt(&attempt);
+    struct timespec deadline = deadline_after_us(SHORT_US);
+    sleep_until(&deadline, NULL);
+    cancel_token_cancel(&token);
+    pthread_join(attempt.thread, NULL);
+    pthread_mutex_unlock(&mutex);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(ECANCELED, attempt.rc, "Wait for the mutex not cancelled");
+    TEST_ASSERT_TRUE_MESSAGE(attempt.elapsed_us < SHORT_US + SLACK_US, "Cancellation not noticed within a slice");
+
+    // cancelled before the call, a free mutex is not taken either
+    TEST_ASSERT_EQUAL_INT_MESSAGE(ECANCELED, mutex_lock_until(&mutex, NULL, &token), "Mutex taken on a cancelled token");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, pthread_mutex_trylock(&mutex), "Mutex left locked");
+    pthread_mutex_unlock(&mutex);
+    cancel_token_destroy(&token);
+}
+
+void test_thread_obtaining_mutex_timed()
+{
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    struct cancel_token token;
+    struct thread_data *data;
+    pthread_t thread;
+
+    TEST_ASSERT_TRUE_MESSAGE(cancel_token_init(&token), "Failure to create the token");
+    TEST_ASSERT_TRUE_MESSAGE(start_thread_obtaining_mutex_timed(&thread, &mutex, 1000, 1000, 0, NULL), "Failure to start the thread");
+    pthread_join(thread, (void **) &data);
+    TEST_ASSERT_TRUE_MESSAGE(data->thread_complete_success, "The thread failed to obtain and release the mutex");
+    free(data);
+
+    pthread_mutex_lock(&mutex);
+    TEST_ASSERT_TRUE_MESSAGE(start_thread_obtaining_mutex_timed(&thread, &mutex, 0, 0, SHORT_US, &token), "Failure to start the thread");
+    pthread_join(thread, (void **) &data);
+    pthread_mutex_unlock(&mutex);
+    TEST_ASSERT_FALSE_MESSAGE(data->thread_complete_success, "The thread obtained a held mutex");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(ETIMEDOUT, data->error, "Wrong error of the timed out thread");
+    free(data);
+
+    // cancelled while holding the mutex, it is released
+    TEST_ASSERT_TRUE_MESSAGE(start_thread_obtaining_mutex_timed(&thread, &mutex, 0, 60 * 1000000UL, 0, &token), "Failure to start the thread");
+    struct timespec deadline = deadline_after_us(SHORT_US);
+    sleep_until(&deadline, NULL);
+    cancel_token_cancel(&token);
+    pthread_join(thread, (void **) &data);
+    TEST_ASSERT_FALSE_MESSAGE(data->thread_complete_success, "Cancelled thread reported success");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(ECANCELED, data->error, "Wrong error of the cancelled thread");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, pthread_mutex_trylock(&mutex), "The mutex was not released on cancellation");
+    pthread_mutex_unlock(&mutex);
+    free(data);
+    cancel_token_destroy(&token);
+}
@@ -0,0 +1,132 @@
+#include "unity.h"
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "../../server/binproto.h"
+
+#define HEADER_SIZE sizeof(struct binproto_header)
+#define MAX_PAYLOAD 1024
+
+static char buf[4 * BINPROTO_BATCH_SIZE];
+
+// appends a request with @param len payload bytes at @param pos, returns the position after it
+static size_t put_request(size_t pos, uint8_t op, uint32_t id, const void *payload, uint32_t len) {
+    binproto_put_header(buf + pos, op, 0, id, len);
+    if (len > 0) {
+        memcpy(buf + pos + HEADER_SIZE, payload, len);
+    }
+    return pos + HEADER_SIZE + len;
+}
+
+static size_t put_read(size_t pos, uint32_t id, uint64_t offset, uint32_t want) {
+    char payload[BINPROTO_READ_REQUEST_SIZE];
+    uint64_t be_offset = htobe64(offset);
+    want = htonl(want);
+    memcpy(payload, &be_offset, sizeof(be_offset));
+    memcpy(payload + sizeof(be_offset), &want, sizeof(want));
+    return put_request(pos, BINPROTO_READ, id, payload, sizeof(payload));
+}
+
+void test_binproto_header_round_trip()
+{
+    struct binproto_header hdr;
+    const unsigned char expected[] = { BINPROTO_APPEND, BINPROTO_ETOOBIG, 0, 0, 0x01, 0x02, 0x03, 0x04, 0x00, 0x00, 0x01, 0x00 };
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(12, HEADER_SIZE, "The header is not 12 bytes on the wire");
+    // at an odd offset, headers are packed back to back
+    binproto_put_header(buf + 1, BINPROTO_APPEND, BINPROTO_ETOOBIG, 0x01020304, 256);
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE(expected, buf + 1, sizeof(expected), "The header is not in network byte order");
+    binproto_parse_header(buf + 1, &hdr);
+    TEST_ASSERT_EQUAL_UINT_MESSAGE(BINPROTO_APPEND, hdr.op, "Wrong op parsed");
+    TEST_ASSERT_EQUAL_UINT_MESSAGE(BINPROTO_ETOOBIG, hdr.status, "Wrong status parsed");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(0x01020304, hdr.id, "Wrong id parsed");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(256, hdr.len, "Wrong length parsed");
+}
+
+void test_binproto_scan_partial_requests()
+{
+    struct binproto_header rejected;
+    size_t end = put_request(0, BINPROTO_APPEND, 1, "hello", 5);
+
+    TEST_ASSERT_EQUAL_size_t_MESSAGE(0, binproto_scan(buf, 0, MAX_PAYLOAD, &rejected), "Requests found in an empty buffer");
+    // every prefix of the request is incomplete
+    for (size_t len = 1; len < end; len++) {
+        TEST_ASSERT_EQUAL_size_t_MESSAGE(0, binproto_scan(buf, len, MAX_PAYLOAD, &rejected), "Incomplete request found");
+        TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, rejected.len, "Incomplete request rejected");
+        // the payload length is only known once the header is complete
+        size_t rest = len < HEADER_SIZE ? HEADER_SIZE - len : end - len;
+        TEST_ASSERT_EQUAL_size_t_MESSAGE(rest, binproto_request_rest(buf, len), "Wrong number of missing bytes");
+    }
+    TEST_ASSERT_EQUAL_size_t_MESSAGE(end, binproto_scan(buf, end, MAX_PAYLOAD, &rejected), "Complete request not found");
+}
+
+void test_binproto_scan_pipelined_requests()
+{
+    struct binproto_header rejected;
+    size_t first = put_request(0, BINPROTO_APPEND, 1, "one", 3);
+    size_t second = put_request(first, BINPROTO_INFO, 2, NULL, 0);
+    size_t third = put_request(second, BINPROTO_APPEND, 3, "three", 5);
+
+    TEST_ASSERT_EQUAL_size_t_MESSAGE(third, binproto_scan(buf, third, MAX_PAYLOAD, &rejected), "Not every complete request found");
+    TEST_ASSERT_EQUAL_size_t_MESSAGE(second, binproto_scan(buf, third - 1, MAX_PAYLOAD, &rejected), "Incomplete last request found");
+    TEST_ASSERT_EQUAL_size_t_MESSAGE(second, binproto_scan(buf, second + HEADER_SIZE - 1, MAX_PAYLOAD, &rejected),
+                                     "Request with a partial header found");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, rejected.len, "Valid request rejected");
+}
+
+void test_binproto_scan_rejects_oversized_payload()
+{
+    struct binproto_header rejected;
+    size_t first = put_request(0, BINPROTO_APPEND, 1, "ok", 2);
+    // only the header of the oversized request has arrived
+    binproto_put_header(buf + first, BINPROTO_APPEND, 0, 2, MAX_PAYLOAD + 1);
+
+    TEST_ASSERT_EQUAL_size_t_MESSAGE(first, binproto_scan(buf, first + HEADER_SIZE, MAX_PAYLOAD, &rejected),
+                                     "Requests before the oversized one not executed");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(MAX_PAYLOAD + 1, rejected.len, "Oversized request not rejected");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(2, rejected.id, "Wrong request rejected");
+    TEST_ASSERT_EQUAL_size_t_MESSAGE(first, binproto_scan(buf, first + HEADER_SIZE - 1, MAX_PAYLOAD, &rejected),
+                                     "Wrong requests found before a partial header");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, rejected.len, "Partial header rejected");
+}
+
+void test_binproto_scan_cuts_batches()
+{
+    struct binproto_header rejected;
+    size_t pos = 0, ends[8];
+
+    // each read may answer BINPROTO_MAX_READ bytes, a batch is cut after the first
+    for (int i = 0; i < 8; i++) {
+        pos = ends[i] = put_read(pos, i, 0, UINT32_MAX);
+    }
+    TEST_ASSERT_EQUAL_size_t_MESSAGE(ends[0], binproto_scan(buf, pos, MAX_PAYLOAD, &rejected), "Batch of reads not cut");
+
+    // small responses fit many requests in a batch
+    pos = 0;
+    while (pos + HEADER_SIZE < sizeof(buf)) {
+        pos = put_request(pos, BINPROTO_INFO, 0, NULL, 0);
+    }
+    size_t end = binproto_scan(buf, pos, MAX_PAYLOAD, &rejected);
+    size_t per_batch = end / HEADER_SIZE;
+    TEST_ASSERT_EQUAL_size_t_MESSAGE(0, end % HEADER_SIZE, "Batch cut inside a request");
+    TEST_ASSERT_TRUE_MESSAGE(end < pos, "Batch of small requests not cut");
+    TEST_ASSERT_EQUAL_size_t_MESSAGE(BINPROTO_BATCH_SIZE / (HEADER_SIZE + 2 * sizeof(uint64_t)) + 1, per_batch,
+                                     "Batch not cut once its responses reach BINPROTO_BATCH_SIZE");
+}
+
+void test_binproto_response_size()
+{
+    struct binproto_header req;
+
+    put_read(0, 1, 0, 100);
+    binproto_parse_header(buf, &req);
+    TEST_ASSERT_EQUAL_size_t_MESSAGE(HEADER_SIZE + 100, binproto_response_size(&req, buf + HEADER_SIZE), "Wrong read response size");
+    put_read(0, 1, 0, UINT32_MAX);
+    binproto_parse_header(buf, &req);
+    TEST_ASSERT_EQUAL_size_t_MESSAGE(HEADER_SIZE + BINPROTO_MAX_READ, binproto_response_size(&req, buf + HEADER_SIZE),
+                                     "Read response not capped at BINPROTO_MAX_READ");
+    put_request(0, BINPROTO_READ, 1, "short", 5);
+    binproto_parse_header(buf, &req);
+    TEST_ASSERT_EQUAL_size_t_MESSAGE(HEADER_SIZE + 2 * sizeof(uint64_t), binproto_response_size(&req, buf + HEADER_SIZE),
+                                     "Malformed read not sized as a short response");
+}
@@ -0,0 +1,299 @@
+#include "unity.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include "../../server/lz4.h"
+#include "../../server/compress.h"
+#include "../../server/datafile.h"
+#include "../../server/metrics.h"
+
+#define MF_LIMIT 12
+#define SEALED_SEGMENTS 3
+
+/*
+ * In memory log standing in for datafile.c: sealed segments end at sealed_ends, the head
+ * segment holds the rest of test_log.
+ */
+static char test_log[128 * 1024];
+static size_t log_len;
+static off_t sealed_ends[SEALED_SEGMENTS];
+static unsigned int sealed_reads;
+static uint64_t cache_hits;
+
+off_t datafile_begin()
+{
+    return 0;
+}
+
+off_t datafile_sealed_end(off_t offset)
+{
+    off_t base = 0;
+    for (int i = 0; i < SEALED_SEGMENTS; i++) {
+        if (offset >= base && offset < sealed_ends[i]) {
+            return sealed_ends[i];
+        }
+        base = sealed_ends[i];
+    }
+    return 0;
+}
+
+ssize_t read_datafile_range(off_t offset, char *buf, size_t len)
+{
+    // a read never crosses a segment boundary
+    off_t limit = datafile_sealed_end(offset);
+    if (limit == 0) {
+        limit = log_len;
+    } else {
+        sealed_reads++;
+    }
+    if (offset >= limit) {
+        return 0;
+    }
+    size_t n = len < (size_t) (limit - offset) ? len : (size_t) (limit - offset);
+    memcpy(buf, test_log + offset, n);
+    return n;
+}
+
+ssize_t read_datafile(int fd, off_t *pos, char *buf, size_t len)
+{
+    ssize_t n = read_datafile_range(*pos, buf, len);
+    if (n > 0) {
+        *pos += n;
+    }
+    return n;
+}
+
+void metrics_add(enum metrics_counter counter, uint64_t value)
+{
+    if (counter == METRIC_ECHO_CACHE_HITS) {
+        cache_hits += value;
+    }
+}
+
+static uint32_t random_state = 2463534242U;
+
+static void fill_random(char *buf, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        random_state ^= random_state << 13;
+        random_state ^= random_state >> 17;
+        random_state ^= random_state << 5;
+        buf[i] = (char) random_state;
+    }
+}
+
+// returns the compressed size of @param len bytes at @param src after checking they decode back
+static size_t assert_round_trip(const char *src, size_t len, const char *message)
+{
+    char *compressed = malloc(LZ4_COMPRESS_BOUND(len));
+    char *decoded = malloc(len + 1);
+    TEST_ASSERT_NOT_NULL_MESSAGE(compressed, "Failure to allocate the compressed buffer");
+    TEST_ASSERT_NOT_NULL_MESSAGE(decoded, "Failure to allocate the decoded buffer");
+
+    size_t n = lz4_compress(src, len, compressed);
+    TEST_ASSERT_TRUE_MESSAGE(n <= LZ4_COMPRESS_BOUND(len), "Compressed size over LZ4_COMPRESS_BOUND");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, lz4_decompress(compressed, n, decoded, len), message);
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE(src, decoded, len, message);
+    if (n > 0) {
+        // a block is only valid with its exact decoded size
+        TEST_ASSERT_EQUAL_INT_MESSAGE(-1, lz4_decompress(compressed, n, decoded, len + 1), "Block decoded to a bigger size");
+        TEST_ASSERT_EQUAL_INT_MESSAGE(-1, lz4_decompress(compressed, n - 1, decoded, len), "Truncated block decoded");
+    }
+
+    free(decoded);
+    free(compressed);
+    return n;
+}
+
+void test_lz4_empty_input()
+{
+    char compressed[LZ4_COMPRESS_BOUND(0)];
+    char decoded[1];
+
+    size_t n = lz4_compress("", 0, compressed);
+    TEST_ASSERT_EQUAL_size_t_MESSAGE(1, n, "An empty block is not a single token");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, lz4_decompress(compressed, n, decoded, 0), "Empty block not decoded");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-1, lz4_decompress(compressed, 0, decoded, 0), "Block without a token decoded");
+}
+
+void test_lz4_input_under_mflimit()
+{
+    const char repeated[] = "aaaaaaaaaaaaaaaaaaaa";
+
+    // too short for a match, whatever repeats in them
+    for (size_t len = 1; len <= MF_LIMIT; len++) {
+        TEST_ASSERT_EQUAL_size_t_MESSAGE(1 + len, assert_round_trip(repeated, len, "Short input not round tripped"),
+                                         "Short input not stored as literals");
+    }
+    assert_round_trip(repeated, MF_LIMIT + 1, "Input one byte over MF_LIMIT not round tripped");
+}
+
+void test_lz4_incompressible_data()
+{
+    static char data[COMPRESS_CHUNK_SIZE];
+
+    fill_random(data, sizeof(data));
+    size_t n = assert_round_trip(data, sizeof(data), "Random data not round tripped");
+    TEST_ASSERT_TRUE_MESSAGE(n > sizeof(data), "Random data compressed");
+}
+
+void test_lz4_long_runs()
+{
+    static char data[COMPRESS_CHUNK_SIZE];
+    // around the 15 and 255 steps of the length encoding
+    const size_t lengths[] = { 13, 18, 19, 20, 34, 35, 273, 274, 275, 530, 4096, COMPRESS_CHUNK_SIZE };
+
+    memset(data, 'x', sizeof(data));
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        assert_round_trip(data, lengths[i], "Run not round tripped");
+    }
+    TEST_ASSERT_TRUE_MESSAGE(assert_round_trip(data, sizeof(data), "Run not round tripped") < 300, "Run not compressed");
+
+    // long literal runs between matches
+    fill_random(data, sizeof(data));
+    memcpy(data + sizeof(data) / 2, data, 1000);
+    assert_round_trip(data, sizeof(data), "Literals around a match not round tripped");
+}
+
+void test_lz4_matches_near_the_end()
+{
+    char data[256];
+
+    // a repeating pattern offers matches right up to the last byte, the decoder enforces
+    // that the last match starts MF_LIMIT bytes before the end and leaves 5 literals
+    for (size_t len = MF_LIMIT + 1; len <= 64; len++) {
+        for (size_t i = 0; i < len; i++) {
+            data[i] = "0123456789abcdef"[i % 16];
+        }
+        assert_round_trip(data, len, "Pattern not round tripped");
+    }
+    // a single repeat of the start right at the end of random data
+    for (size_t tail = 4; tail <= 24; tail++) {
+        fill_random(data, sizeof(data));
+        memcpy(data + sizeof(data) - tail, data, tail);
+        assert_round_trip(data, sizeof(data), "Repeat at the end not round tripped");
+    }
+}
+
+void test_lz4_rejects_malformed_blocks()
+{
+    char decoded[64];
+    // literal run of 4, match of 4 at offset 8 before any output exists
+    const char far_match[] = { 0x40, 'a', 'b', 'c', 'd', 0x08, 0x00, 0x00 };
+    // literal length extension cut short
+    const char cut_length[] = { (char) 0xf0, (char) 255 };
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-1, lz4_decompress(far_match, sizeof(far_match), decoded, 20), "Match before the output decoded");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-1, lz4_decompress(cut_length, sizeof(cut_length), decoded, 300), "Cut length decoded");
+}
+
+struct echo {
+    int    fd;
+    char  *data;
+    size_t len;
+};
+
+static void *read_echo(void *param)
+{
+    struct echo *echo = (struct echo *) param;
+    size_t size = 0;
+    ssize_t n;
+
+    do {
+        if (echo->len == size) {
+            size = size ? size * 2 : 64 * 1024;
+            // Unity assertions may only fail on the test thread
+            if (!(echo->data = realloc(echo->data, size))) {
+                abort();
+            }
+        }
+        n = recv(echo->fd, echo->data + echo->len, size - echo->len, 0);
+        echo->len += n > 0 ? n : 0;
+    } while (n > 0);
+    return NULL;
+}
+
+// runs send_compressed_response() and decodes its frames into @param decoded
+static size_t compressed_echo(char *decoded, size_t size)
+{
+    int fds[2];
+    struct echo echo = { .data = NULL, .len = 0 };
+    pthread_t reader;
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds), "Failure to create a socket pair");
+    echo.fd = fds[1];
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, pthread_create(&reader, NULL, read_echo, &echo), "Failure to create the reader");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, send_compressed_response(DATAFILE_SHARED, fds[0]), "Failure to send the echo");
+    close(fds[0]);
+    pthread_join(reader, NULL);
+    close(fds[1]);
+
+    size_t pos = 0, len = 0;
+    for (;;) {
+        struct compress_frame frame;
+        TEST_ASSERT_TRUE_MESSAGE(echo.len - pos >= sizeof(frame), "Echo without its last frame");
+        memcpy(&frame, echo.data + pos, sizeof(frame));
+        pos += sizeof(frame);
+        uint32_t raw_len = ntohl(frame.raw_len), n = ntohl(frame.len) & ~COMPRESS_FRAME_STORED;
+        if (raw_len == 0) {
+            break;
+        }
+        TEST_ASSERT_TRUE_MESSAGE(raw_len <= COMPRESS_CHUNK_SIZE, "Frame over COMPRESS_CHUNK_SIZE");
+        TEST_ASSERT_TRUE_MESSAGE(echo.len - pos >= n && size - len >= raw_len, "Frame cut short or too long");
+        if (ntohl(frame.len) & COMPRESS_FRAME_STORED) {
+            TEST_ASSERT_EQUAL_UINT32_MESSAGE(raw_len, n, "Stored frame of the wrong size");
+            memcpy(decoded + len, echo.data + pos, n);
+        } else {
+            TEST_ASSERT_EQUAL_INT_MESSAGE(0, lz4_decompress(echo.data + pos, n, decoded + len, raw_len), "Frame not decoded");
+        }
+        pos += n;
+        len += raw_len;
+    }
+    TEST_ASSERT_EQUAL_size_t_MESSAGE(echo.len, pos, "Data after the last frame");
+    free(echo.data);
+    return len;
+}
+
+void test_compressed_echo_caches_sealed_segments()
+{
+    static char decoded[sizeof(test_log)];
+    size_t len = 0;
+
+    compress_destroy();
+    // lines spanning two frames, an incompressible segment stored as is, a short segment
+    while (len < COMPRESS_CHUNK_SIZE + 5000) {
+        len += sprintf(test_log + len, "line %06zu of the sealed segment\n", len);
+    }
+    sealed_ends[0] = len;
+    fill_random(test_log + len, 20000);
+    sealed_ends[1] = len += 20000;
+    memset(test_log + len, 'y', 100);
+    sealed_ends[2] = len += 100;
+    while (len < sealed_ends[2] + 5000) {
+        len += sprintf(test_log + len, "line %06zu of the head segment\n", len);
+    }
+    log_len = len;
+
+    sealed_reads = 0;
+    cache_hits = 0;
+    TEST_ASSERT_EQUAL_size_t_MESSAGE(log_len, compressed_echo(decoded, sizeof(decoded)), "Wrong size of the first echo");
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE(test_log, decoded, log_len, "Wrong first echo");
+    TEST_ASSERT_EQUAL_UINT64_MESSAGE(0, cache_hits, "Cache hits before anything was cached");
+    TEST_ASSERT_TRUE_MESSAGE(sealed_reads > 0, "Sealed segments not read");
+
+    // the head grows, sealed segments come from the cache
+    unsigned int reads = sealed_reads;
+    log_len += sprintf(test_log + log_len, "one more line\n");
+    memset(decoded, 0, sizeof(decoded));
+    TEST_ASSERT_EQUAL_size_t_MESSAGE(log_len, compressed_echo(decoded, sizeof(decoded)), "Wrong size of the cached echo");
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE(test_log, decoded, log_len, "Wrong cached echo");
+    TEST_ASSERT_EQUAL_UINT64_MESSAGE(SEALED_SEGMENTS, cache_hits, "Sealed segments not served from the cache");
+    TEST_ASSERT_EQUAL_UINT_MESSAGE(reads, sealed_reads, "Cached segments read again");
+
+    compress_destroy();
+}
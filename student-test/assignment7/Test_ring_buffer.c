@@ -0,0 +1,207 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include "../../aesd-char-driver/aesd-ring-buffer.h"
+
+#define RING_CAPACITY 8
+#define PRODUCERS 4
+#define VALUES_PER_PRODUCER 20000
+
+AESD_RING_DECLARE(int_ring, int, RING_CAPACITY)
+AESD_SPSC_RING_DECLARE(size_spsc, size_t, RING_CAPACITY)
+AESD_MPSC_RING_DECLARE(size_mpsc, size_t, RING_CAPACITY)
+
+static struct size_spsc spsc;
+static struct size_mpsc mpsc;
+
+void test_ring_push_pop_full_empty()
+{
+    struct int_ring ring;
+    int value;
+
+    int_ring_init(&ring);
+    TEST_ASSERT_TRUE_MESSAGE(int_ring_empty(&ring), "A new ring is not empty");
+    TEST_ASSERT_FALSE_MESSAGE(int_ring_pop(&ring, &value), "Pop from an empty ring succeeded");
+    TEST_ASSERT_NULL_MESSAGE(int_ring_peek(&ring), "Peek into an empty ring returned an element");
+    for (int i = 0; i < RING_CAPACITY; i++) {
+        TEST_ASSERT_TRUE_MESSAGE(int_ring_push(&ring, &i), "Push into a ring with room failed");
+    }
+    TEST_ASSERT_TRUE_MESSAGE(int_ring_full(&ring), "The ring is not full at its capacity");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(RING_CAPACITY, int_ring_count(&ring), "Wrong count of a full ring");
+    value = 100;
+    TEST_ASSERT_FALSE_MESSAGE(int_ring_push(&ring, &value), "Push into a full ring succeeded");
+    for (int i = 0; i < RING_CAPACITY; i++) {
+        TEST_ASSERT_EQUAL_INT_MESSAGE(i, *int_ring_at(&ring, i), "Wrong element at an index");
+    }
+    for (int i = 0; i < RING_CAPACITY; i++) {
+        TEST_ASSERT_TRUE_MESSAGE(int_ring_pop(&ring, &value), "Pop from a non empty ring failed");
+        TEST_ASSERT_EQUAL_INT_MESSAGE(i, value, "Elements not popped in order");
+    }
+    TEST_ASSERT_TRUE_MESSAGE(int_ring_empty(&ring), "The ring is not empty once drained");
+}
+
+void test_ring_push_overwrite()
+{
+    struct int_ring ring;
+    int value, evicted = -1;
+
+    int_ring_init(&ring);
+    for (int i = 0; i < RING_CAPACITY; i++) {
+        TEST_ASSERT_FALSE_MESSAGE(int_ring_push_overwrite(&ring, &i, &evicted), "Overwrite reported on a ring with room");
+    }
+    value = RING_CAPACITY;
+    TEST_ASSERT_TRUE_MESSAGE(int_ring_push_overwrite(&ring, &value, &evicted), "No overwrite reported on a full ring");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, evicted, "The oldest element was not evicted");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(1, *int_ring_peek(&ring), "The oldest element is still in the ring");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(RING_CAPACITY, *int_ring_at(&ring, RING_CAPACITY - 1), "The new element is not the newest");
+}
+
+/**
+ * Counters are free running, start them right below SIZE_MAX so they wrap around to 0
+ * while the ring holds elements.
+ */
+void test_ring_counter_wrap()
+{
+    struct int_ring ring;
+    int value;
+
+    int_ring_init(&ring);
+    ring.head = ring.tail = SIZE_MAX - RING_CAPACITY / 2;
+    for (int round = 0; round < 4; round++) {
+        for (int i = 0; i < RING_CAPACITY; i++) {
+            int pushed = round * RING_CAPACITY + i;
+            TEST_ASSERT_TRUE_MESSAGE(int_ring_push(&ring, &pushed), "Push across the counter wrap failed");
+        }
+        TEST_ASSERT_TRUE_MESSAGE(int_ring_full(&ring), "Not full across the counter wrap");
+        for (int i = 0; i < RING_CAPACITY; i++) {
+            TEST_ASSERT_EQUAL_INT_MESSAGE(round * RING_CAPACITY + i, *int_ring_at(&ring, i), "Wrong element across the counter wrap");
+        }
+        for (int i = 0; i < RING_CAPACITY; i++) {
+            TEST_ASSERT_TRUE_MESSAGE(int_ring_pop(&ring, &value), "Pop across the counter wrap failed");
+            TEST_ASSERT_EQUAL_INT_MESSAGE(round * RING_CAPACITY + i, value, "Out of order across the counter wrap");
+        }
+        TEST_ASSERT_TRUE_MESSAGE(int_ring_empty(&ring), "Not empty across the counter wrap");
+    }
+}
+
+void test_spsc_push_pop_full_empty_wrap()
+{
+    size_t value;
+
+    size_spsc_init(&spsc);
+    spsc.head = spsc.tail = SIZE_MAX - 2;
+    TEST_ASSERT_FALSE_MESSAGE(size_spsc_pop(&spsc, &value), "Pop from an empty ring succeeded");
+    for (size_t round = 0; round < 3; round++) {
+        for (size_t i = 0; i < RING_CAPACITY; i++) {
+            value = round * RING_CAPACITY + i;
+            TEST_ASSERT_TRUE_MESSAGE(size_spsc_push(&spsc, &value), "Push into a ring with room failed");
+        }
+        TEST_ASSERT_EQUAL_UINT_MESSAGE(RING_CAPACITY, size_spsc_count(&spsc), "Wrong count of a full ring");
+        TEST_ASSERT_FALSE_MESSAGE(size_spsc_push(&spsc, &value), "Push into a full ring succeeded");
+        for (size_t i = 0; i < RING_CAPACITY; i++) {
+            TEST_ASSERT_TRUE_MESSAGE(size_spsc_pop(&spsc, &value), "Pop from a non empty ring failed");
+            TEST_ASSERT_EQUAL_UINT_MESSAGE(round * RING_CAPACITY + i, value, "Elements not popped in order");
+        }
+        TEST_ASSERT_FALSE_MESSAGE(size_spsc_pop(&spsc, &value), "Pop from a drained ring succeeded");
+    }
+}
+
+// spinning producers and consumers yield, the tests may run on a single CPU
+static void *spsc_producer(void *param)
+{
+    for (size_t i = 0; i < VALUES_PER_PRODUCER; i++) {
+        while (!size_spsc_push(&spsc, &i)) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+void test_spsc_threads()
+{
+    pthread_t producer;
+    size_t value;
+
+    size_spsc_init(&spsc);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, pthread_create(&producer, NULL, spsc_producer, NULL), "Failure to create the producer");
+    for (size_t i = 0; i < VALUES_PER_PRODUCER; i++) {
+        while (!size_spsc_pop(&spsc, &value)) {
+            sched_yield();
+        }
+        TEST_ASSERT_EQUAL_UINT_MESSAGE(i, value, "Value lost or reordered between threads");
+    }
+    pthread_join(producer, NULL);
+    TEST_ASSERT_FALSE_MESSAGE(size_spsc_pop(&spsc, &value), "Extra value in the ring");
+}
+
+void test_mpsc_push_pop_full_empty_wrap()
+{
+    size_t value;
+
+    size_mpsc_init(&mpsc);
+    TEST_ASSERT_FALSE_MESSAGE(size_mpsc_pop(&mpsc, &value), "Pop from an empty ring succeeded");
+    // the slots are reused with a new sequence number on every round
+    for (size_t round = 0; round < 3; round++) {
+        for (size_t i = 0; i < RING_CAPACITY; i++) {
+            value = round * RING_CAPACITY + i;
+            TEST_ASSERT_TRUE_MESSAGE(size_mpsc_push(&mpsc, &value), "Push into a ring with room failed");
+        }
+        TEST_ASSERT_FALSE_MESSAGE(size_mpsc_push(&mpsc, &value), "Push into a full ring succeeded");
+        for (size_t i = 0; i < RING_CAPACITY; i++) {
+            TEST_ASSERT_TRUE_MESSAGE(size_mpsc_pop(&mpsc, &value), "Pop from a non empty ring failed");
+            TEST_ASSERT_EQUAL_UINT_MESSAGE(round * RING_CAPACITY + i, value, "Elements not popped in order");
+        }
+        TEST_ASSERT_FALSE_MESSAGE(size_mpsc_pop(&mpsc, &value), "Pop from a drained ring succeeded");
+    }
+    // keep the ring half full, so the head and tail wrap at different slots
+    for (size_t i = 0; i < 3 * RING_CAPACITY; i++) {
+        value = i;
+        TEST_ASSERT_TRUE_MESSAGE(size_mpsc_push(&mpsc, &value), "Push into a ring with room failed");
+        if (i >= RING_CAPACITY / 2) {
+            TEST_ASSERT_TRUE_MESSAGE(size_mpsc_pop(&mpsc, &value), "Pop from a non empty ring failed");
+            TEST_ASSERT_EQUAL_UINT_MESSAGE(i - RING_CAPACITY / 2, value, "Elements not popped in order");
+        }
+    }
+}
+
+static void *mpsc_producer(void *param)
+{
+    size_t producer = (size_t)(uintptr_t) param;
+
+    for (size_t i = 0; i < VALUES_PER_PRODUCER; i++) {
+        size_t value = producer * VALUES_PER_PRODUCER + i;
+        while (!size_mpsc_push(&mpsc, &value)) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+void test_mpsc_threads()
+{
+    pthread_t producers[PRODUCERS];
+    size_t next[PRODUCERS] = { 0 };
+    size_t value;
+
+    size_mpsc_init(&mpsc);
+    for (size_t p = 0; p < PRODUCERS; p++) {
+        TEST_ASSERT_EQUAL_INT_MESSAGE(0, pthread_create(&producers[p], NULL, mpsc_producer, (void *)(uintptr_t) p),
+                                      "Failure to create a producer");
+    }
+    for (size_t i = 0; i < PRODUCERS * VALUES_PER_PRODUCER; i++) {
+        while (!size_mpsc_pop(&mpsc, &value)) {
+            sched_yield();
+        }
+        size_t producer = value / VALUES_PER_PRODUCER;
+        TEST_ASSERT_LESS_THAN_UINT_MESSAGE(PRODUCERS, producer, "Value from no producer");
+        // every producer's values arrive in the order it pushed them
+        TEST_ASSERT_EQUAL_UINT_MESSAGE(next[producer], value % VALUES_PER_PRODUCER, "Value lost or reordered between threads");
+        next[producer]++;
+    }
+    for (size_t p = 0; p < PRODUCERS; p++) {
+        pthread_join(producers[p], NULL);
+    }
+    TEST_ASSERT_FALSE_MESSAGE(size_mpsc_pop(&mpsc, &value), "Extra value in the ring");
+}